@@ -13,9 +13,29 @@
 #include "api.h"
 #include "action.h"
 #include "weight_scale.h"
+#include "progress_reporter.h"
+#include "outbox.h"
+#include "journal.h"
+#include "flow_estimator.h"
+#include "ota.h"
 
 static const char *TAG = "action";
 
+#define POUR_SAMPLE_TIMEOUT_MS 1000     // No HX711 conversion for this long is a scale failure
+#define TARE_TOLERANCE_G 0.2f           // Standard error wanted on the weights a dose is measured against
+#define TARE_MAX_MS 3000                // A noisy scale gets at most this long to settle
+#define JOURNAL_CHECKPOINT_MS 500       // Progress lost to a reboot is at most this much pouring
+#define PROGRESS_FLUSH_TIMEOUT_MS 12000 // The report in flight and the final one, each within the pour call deadline
+
+// Predictive cutoff: the pump stops when the fitted weight plus what is still in flight reaches the target
+#define FLOW_MIN_RATE 0.5f      // g/s, below this the flow estimate is not trusted for prediction
+#define DRIP_DEFAULT_S 0.3f     // Initial drip-tail compensation, in seconds of flow
+#define DRIP_MAX_S 3.0f         // Upper bound of the learned compensation
+#define DRIP_LEARNING_RATE 0.5f // Fraction of the measured overshoot corrected after each pour
+// Learned overshoot aimed at: centred on zero, half of the pours would end short and need a second pump start
+#define DRIP_TARGET_OVERSHOOT_G 0.5f
+#define POUR_SETTLE_MS 1500     // Time for the drip tail to land before measuring the overshoot
+
 void init_gpio(gpio_num_t gpio_num)
 {
     // Configure the GPIO pin
@@ -65,7 +85,14 @@ bool handle_action(device_action_t *action)
         return true;
 
     case ACTION_PUMP:
-        return handle_pump(action);
+    case ACTION_PLAN:
+    {
+        // A background update writes to flash once the pour is over, its erases would stall the scale
+        ota_hold_flash_writes(true);
+        bool handled = action->type == ACTION_PUMP ? handle_pump(action) : handle_plan(action);
+        ota_hold_flash_writes(false);
+        return handled;
+    }
 
     default:
         ESP_LOGE(TAG, "Unknown action type: %d", action->type);
@@ -73,17 +100,14 @@ bool handle_action(device_action_t *action)
     }
 }
 
-bool handle_pump(device_action_t *action)
+// Pour a single dose, `delivered_progress` receives the dose progress measured at the end.
+// Without `stream_progress` (plan doses) nothing is sent while pouring, the caller reports one summary;
+// a stop pushed by the server over the WebSocket still ends the dose.
+static bool pour_dose(const char *order_id, const char *dose_id, int gpio, float target_weight, float initial_progress,
+                      bool stream_progress, float *delivered_progress)
 {
-    if (!action || action->type != ACTION_PUMP)
-    {
-        ESP_LOGE(TAG, "Invalid pump action");
-        return false;
-    }
-
-    gpio_num_t pump_gpio = (gpio_num_t)action->data.pump.pump_gpio;
-    float target_weight = action->data.pump.dose_weight;
-    float initial_progress = action->data.pump.dose_weight_progress;
+    gpio_num_t pump_gpio = (gpio_num_t)gpio;
+    *delivered_progress = initial_progress;
     float weight_to_deliver = target_weight - initial_progress;
 
     ESP_LOGI(TAG, "Starting pump action: GPIO=%d, target=%.2fg, initial_progress=%.2fg, to_deliver=%.2fg",
@@ -92,24 +116,72 @@ bool handle_pump(device_action_t *action)
     // Step 1: Initialize GPIO for pump
     init_gpio(pump_gpio);
 
-    // Step 2: Measure initial weight (20 samples for accuracy)
+    // Step 2: Measure initial weight, sampling only as long as the scale is noisy
     float initial_weight;
     int32_t initial_raw;
-    if (!measure_weight(&initial_weight, &initial_raw, 20))
+    journal_dose_t journal;
+    if (journal_take_interrupted(order_id, dose_id, &journal))
+    {
+        // The glass already holds what was poured before the reboot, a new tare would not see it
+        initial_raw = journal.tare_raw;
+        initial_weight = weight_interface_to_grams(journal.tare_raw);
+        initial_progress = journal.initial_progress;
+        ESP_LOGW(TAG, "Resuming interrupted dose from %.2fg against its original tare", journal.progress);
+    }
+    else
+    {
+        weight_stability_t stability;
+        if (!measure_weight_until_stable(TARE_TOLERANCE_G, TARE_MAX_MS, &initial_weight, &initial_raw, &stability))
+        {
+            ESP_LOGE(TAG, "Failed to measure initial weight");
+            outbox_add_error(order_id, ERROR_CODE_WEIGHT_SCALE, "Failed to measure initial weight");
+            return false;
+        }
+        ESP_LOGI(TAG, "Initial weight: %.2fg (%u samples, %u ms)", initial_weight, stability.samples, stability.elapsed_ms);
+    }
+
+    // From here a reboot resumes the dose instead of starting it over
+    memset(&journal, 0, sizeof(journal));
+    strncpy(journal.order_id, order_id, sizeof(journal.order_id) - 1);
+    strncpy(journal.dose_id, dose_id, sizeof(journal.dose_id) - 1);
+    journal.pump_gpio = gpio;
+    journal.target_weight = target_weight;
+    journal.initial_progress = initial_progress;
+    journal.tare_raw = initial_raw;
+    journal_dose_start(&journal);
+    int64_t last_checkpoint_time = esp_timer_get_time() / 1000;
+
+    // Drip-tail compensation learned from the previous pours of this pump
+    float drip_s = DRIP_DEFAULT_S;
+    get_stored_pump_drip(pump_gpio, &drip_s);
+
+    // Progress is sent by the reporter task, this loop never waits on the server.
+    // Without it nothing could stop the pump but the local cutoff, so the dose is not started.
+    if (!progress_reporter_begin(order_id, dose_id))
     {
-        ESP_LOGE(TAG, "Failed to measure initial weight");
-        report_error(action->data.pump.order_id, ERROR_CODE_WEIGHT_SCALE, "Failed to measure initial weight");
+        ESP_LOGE(TAG, "Progress reporter unavailable, dose not started");
+        outbox_add_error(order_id, ERROR_CODE_UNABLE_TO_REPORT_PROGRESS, "Progress reporter could not start");
+        journal_dose_end();
         return false;
     }
-    ESP_LOGI(TAG, "Initial weight: %.2fg", initial_weight);
 
     // Step 3: Turn on pump
     gpio_set_level(pump_gpio, 1);
     ESP_LOGI(TAG, "Pump turned ON");
 
+    flow_estimator_t flow;
+    flow_estimator_reset(&flow, esp_timer_get_time());
+    bool cutoff_reached = false;
+    float cutoff_rate = 0;
+
     bool success = true;
     bool should_continue = true;
     bool pump_is_on = true;
+    float current_progress = initial_progress;
+
+    // Errors found while pumping are reported once the pump is off
+    error_code_t error_code = ERROR_CODE_UNKNOWN;
+    char error_msg[192] = {0};
 
     // Weight monitoring for pump failure detection
     float last_weight = initial_weight;
@@ -117,23 +189,28 @@ bool handle_pump(device_action_t *action)
     const int64_t PUMP_TIMEOUT_MS = 30000;                         // 30 seconds
     const float WEIGHT_CHANGE_THRESHOLD = 5.0f;                    // 5g minimum change to consider progress
 
-    // Step 4: Main pouring loop
+    // Step 4: Main pouring loop, paced by the HX711 conversions
+    uint32_t sample_cursor = 0;
     while (should_continue && success)
     {
-        // Measure current weight (10 samples during pumping)
+        // Wait for the next conversion, already through the spike rejection and smoothing filters
+        weight_sample_t sample;
         float current_weight;
-        int32_t current_raw;
-        if (!measure_weight(&current_weight, &current_raw, 10))
+        if (!weight_interface_wait_sample(&sample_cursor, &sample, POUR_SAMPLE_TIMEOUT_MS) ||
+            !measure_weight_latest(&current_weight, NULL, NULL))
         {
             ESP_LOGE(TAG, "Failed to measure current weight during pumping");
-            report_error(action->data.pump.order_id, ERROR_CODE_WEIGHT_SCALE, "Failed to measure current weight during pumping");
+            error_code = ERROR_CODE_WEIGHT_SCALE;
+            snprintf(error_msg, sizeof(error_msg), "Failed to measure current weight during pumping");
             success = false;
             break;
         }
 
         // Calculate current progress from initial weight
         float weight_poured = current_weight - initial_weight;
-        float current_progress = initial_progress + weight_poured;
+        current_progress = initial_progress + weight_poured;
+
+        flow_estimator_add(&flow, sample.timestamp_us, weight_interface_to_grams(sample.filtered));
 
         ESP_LOGI(TAG, "Current weight: %.2fg, poured: %.2fg, progress: %.2fg/%.2fg",
                  current_weight, weight_poured, current_progress, target_weight);
@@ -152,7 +229,8 @@ bool handle_pump(device_action_t *action)
             ESP_LOGE(TAG, "Pump timeout: No weight change for %lld ms (threshold: %lld ms)",
                      current_time - last_weight_change_time, PUMP_TIMEOUT_MS);
             ESP_LOGE(TAG, "Pump may be malfunctioning or liquid reservoir is empty");
-            report_error(action->data.pump.order_id, ERROR_CODE_NO_WEIGHT_CHANGE, "Pump timeout: No weight change detected - pump may be malfunctioning or liquid reservoir is empty");
+            error_code = ERROR_CODE_NO_WEIGHT_CHANGE;
+            snprintf(error_msg, sizeof(error_msg), "Pump timeout: No weight change detected - pump may be malfunctioning or liquid reservoir is empty");
             success = false;
             break;
         }
@@ -162,65 +240,62 @@ bool handle_pump(device_action_t *action)
         {
             ESP_LOGE(TAG, "Weight decreased below initial weight (margin 10g): %.2fg < %.2fg",
                      current_weight, initial_weight - 10.0f);
-            char error_msg[128];
+            error_code = ERROR_CODE_NEGATIVE_WEIGHT_CHANGE;
             snprintf(error_msg, sizeof(error_msg), "Weight decreased below initial weight: %.2fg < %.2fg",
                      current_weight, initial_weight - 10.0f);
-            report_error(action->data.pump.order_id, ERROR_CODE_NEGATIVE_WEIGHT_CHANGE, error_msg);
             success = false;
             break;
         }
 
+        // Predict where the weight will settle if the pump stopped now
+        float flow_rate = 0;
+        float fitted_weight = current_weight;
+        float predicted_progress = current_progress;
+        if (pump_is_on && flow_estimator_fit(&flow, esp_timer_get_time(), &flow_rate, &fitted_weight) &&
+            flow_rate > FLOW_MIN_RATE)
+        {
+            predicted_progress = initial_progress + (fitted_weight - initial_weight) + flow_rate * drip_s;
+        }
+
         // Check if we've delivered enough weight - turn off pump immediately
-        if (current_progress >= target_weight && pump_is_on)
+        if ((current_progress >= target_weight || predicted_progress >= target_weight) && pump_is_on)
         {
             gpio_set_level(pump_gpio, 0);
             pump_is_on = false;
-            ESP_LOGI(TAG, "Target weight reached: %.2fg >= %.2fg - Pump turned OFF", current_progress, target_weight);
+            cutoff_reached = true;
+            cutoff_rate = flow_rate;
+            ESP_LOGI(TAG, "Target weight reached: %.2fg (predicted %.2fg at %.2fg/s) >= %.2fg - Pump turned OFF",
+                     current_progress, predicted_progress, flow_rate, target_weight);
         }
 
-        // Report progress to server (this might hang, but pump is already off if needed)
-        char server_message[256] = {0};
-        bool api_success = report_progress(action->data.pump.order_id, action->data.pump.dose_id,
-                                           current_progress, &should_continue, server_message, sizeof(server_message));
-
-        if (!api_success)
-        {
-            ESP_LOGE(TAG, "Failed to report progress to server");
-            report_error(action->data.pump.order_id, ERROR_CODE_UNABLE_TO_REPORT_PROGRESS, "Failed to report progress to server");
-            // Don't fail completely - we might have already delivered the dose
-            if (current_progress >= target_weight)
-            {
-                ESP_LOGI(TAG, "API failed but target weight reached - considering success");
-                should_continue = false;
-            }
-            else
-            {
-                success = false;
-                break;
-            }
-        }
-        else if (strlen(server_message) > 0)
+        // A conversion was just read, the next one is 100 ms away: a short page program is safe here,
+        // unlike the sector erases the OTA writer holds back until the pour is over
+        if (current_time - last_checkpoint_time >= JOURNAL_CHECKPOINT_MS)
         {
-            ESP_LOGI(TAG, "Server message: %s", server_message);
+            journal_checkpoint(current_progress);
+            last_checkpoint_time = current_time;
         }
 
-        // If target weight reached, stop the loop regardless of server response
-        if (current_progress >= target_weight)
+        // Hand the latest progress to the reporter task and pick up its answers so far
+        if (stream_progress)
         {
-            ESP_LOGI(TAG, "Target weight reached - stopping loop");
-            should_continue = false;
+            progress_reporter_publish(current_progress);
         }
+        // An undelivered report is already in the outbox and the cutoff is decided here,
+        // so a network drop does not end the dose
+        EventBits_t progress_flags = progress_reporter_poll();
 
-        // Log server response for continue=false case
-        if (!should_continue)
+        if (progress_flags & PROGRESS_STOP_BIT)
         {
             ESP_LOGI(TAG, "Server responded with continue=false - stopping pump");
+            should_continue = false;
         }
 
-        // Small delay to avoid overwhelming the system
-        if (should_continue)
+        // If target weight reached, stop the loop regardless of server response
+        if (cutoff_reached)
         {
-            vTaskDelay(pdMS_TO_TICKS(100)); // 100ms delay between measurements
+            ESP_LOGI(TAG, "Target weight reached - stopping loop");
+            should_continue = false;
         }
     }
 
@@ -232,6 +307,57 @@ bool handle_pump(device_action_t *action)
         vTaskDelay(pdMS_TO_TICKS(1000)); // 1000ms delay between doses
     }
 
+    // Step 5b: Let the drip tail land, then learn from the overshoot of this pour
+    if (success && cutoff_reached)
+    {
+        vTaskDelay(pdMS_TO_TICKS(POUR_SETTLE_MS));
+
+        float final_weight;
+        int32_t final_raw;
+        if (measure_weight_until_stable(TARE_TOLERANCE_G, TARE_MAX_MS, &final_weight, &final_raw, NULL))
+        {
+            current_progress = initial_progress + (final_weight - initial_weight);
+            float overshoot = current_progress - target_weight;
+
+            if (cutoff_rate > FLOW_MIN_RATE)
+            {
+                float new_drip_s = drip_s + DRIP_LEARNING_RATE * (overshoot - DRIP_TARGET_OVERSHOOT_G) / cutoff_rate;
+                new_drip_s = fminf(fmaxf(new_drip_s, 0.0f), DRIP_MAX_S);
+                if (fabsf(new_drip_s - drip_s) >= 0.01f)
+                {
+                    store_pump_drip(pump_gpio, new_drip_s);
+                }
+                ESP_LOGI(TAG, "Pour overshoot %.2fg, drip compensation %.2fs -> %.2fs", overshoot, drip_s, new_drip_s);
+            }
+            else
+            {
+                ESP_LOGI(TAG, "Pour overshoot %.2fg", overshoot);
+            }
+
+            if (stream_progress)
+            {
+                progress_reporter_publish(current_progress);
+            }
+        }
+    }
+
+    // Step 6: Make sure the final progress is delivered, or queued in the outbox, before asking for the next action
+    if (success && stream_progress && !progress_reporter_flush(PROGRESS_FLUSH_TIMEOUT_MS))
+    {
+        ESP_LOGI(TAG, "Final progress not delivered yet - left to the outbox");
+    }
+
+    // Sent with the queued progress once the pour is over, never blocks the control loop
+    if (error_code != ERROR_CODE_UNKNOWN)
+    {
+        outbox_add_error(order_id, error_code, error_msg);
+    }
+
+    // The outcome is with the server or in the outbox, nothing left to resume
+    journal_dose_end();
+
+    *delivered_progress = current_progress;
+
     if (success)
     {
         ESP_LOGI(TAG, "Pump action completed successfully");
@@ -243,3 +369,57 @@ bool handle_pump(device_action_t *action)
 
     return success;
 }
+
+bool handle_pump(device_action_t *action)
+{
+    if (!action || action->type != ACTION_PUMP)
+    {
+        ESP_LOGE(TAG, "Invalid pump action");
+        return false;
+    }
+
+    float delivered_progress;
+    return pour_dose(action->data.pump.order_id, action->data.pump.dose_id, action->data.pump.pump_gpio,
+                     action->data.pump.dose_weight, action->data.pump.dose_weight_progress, true, &delivered_progress);
+}
+
+bool handle_plan(device_action_t *action)
+{
+    if (!action || action->type != ACTION_PLAN)
+    {
+        ESP_LOGE(TAG, "Invalid plan action");
+        return false;
+    }
+
+    const char *order_id = action->data.plan.order_id;
+    ESP_LOGI(TAG, "Starting plan for order %s with %d doses", order_id, action->data.plan.dose_count);
+
+    // Doses run back to back: no progress while pouring, one summary per dose in between
+    for (int i = 0; i < action->data.plan.dose_count; i++)
+    {
+        planned_dose_t *dose = &action->data.plan.doses[i];
+        float delivered_progress;
+
+        ESP_LOGI(TAG, "Plan dose %d/%d: %s", i + 1, action->data.plan.dose_count, dose->dose_id);
+        if (!pour_dose(order_id, dose->dose_id, dose->pump_gpio, dose->dose_weight, dose->dose_weight_progress, false,
+                       &delivered_progress))
+        {
+            return false;
+        }
+
+        bool should_continue = false;
+        if (!report_dose_complete(order_id, dose->dose_id, delivered_progress, &should_continue))
+        {
+            ESP_LOGE(TAG, "Failed to report dose completion, asking the server for a new plan");
+            return false;
+        }
+        if (!should_continue)
+        {
+            // Cancelled, or the dose is short: the next plan will resume from the server state
+            ESP_LOGI(TAG, "Server stopped the plan after dose %d/%d", i + 1, action->data.plan.dose_count);
+            break;
+        }
+    }
+
+    return true;
+}
@@ -16,4 +16,6 @@ bool handle_action(device_action_t *action);
 
 bool handle_pump(device_action_t *action);
 
+bool handle_plan(device_action_t *action);
+
 #endif // ACTION_H
@@ -1,5 +1,6 @@
 #include "ap_server.h"
 #include "storage.h"
+#include "wifi_config.h"
 #include "esp_wifi.h"
 #include "esp_log.h"
 #include "esp_netif.h"
@@ -166,21 +167,21 @@ static esp_err_t save_handler(httpd_req_t *req)
 
 void start_config_portal(void)
 {
-    // Clean shutdown of any existing WiFi
-    esp_wifi_stop();
-    esp_wifi_deinit();
-    
-    // Initialize fresh WiFi for AP mode
-    ESP_ERROR_CHECK(esp_netif_init());
-    ESP_ERROR_CHECK(esp_event_loop_create_default());
-    
-    // Create AP network interface
-    esp_netif_t *ap_netif = esp_netif_create_default_wifi_ap();
-    
-    // Initialize WiFi
-    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
-    ESP_ERROR_CHECK(esp_wifi_init(&cfg));
-    
+    if (server)
+    {
+        return;
+    }
+
+    // The station keeps its driver and its supervisor, it retries the stored network next to the portal
+    wifi_init_driver();
+
+    // Create AP network interface, kept for the next time the portal starts
+    static esp_netif_t *ap_netif = NULL;
+    if (!ap_netif)
+    {
+        ap_netif = esp_netif_create_default_wifi_ap();
+    }
+
     // Configure default IP for AP mode
     esp_netif_ip_info_t ip_info;
     IP4_ADDR(&ip_info.ip, 192, 168, 4, 1);
@@ -198,10 +199,15 @@ void start_config_portal(void)
             .max_connection = 1,
             .authmode = WIFI_AUTH_WPA2_PSK}};
 
-    ESP_ERROR_CHECK(esp_wifi_stop());
-    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_AP));
+    // In APSTA the access point follows the channel of the station, no restart of the driver needed
+    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_APSTA));
     ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_AP, &ap_config));
-    ESP_ERROR_CHECK(esp_wifi_start());
+    esp_err_t err = esp_wifi_start();
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to start WiFi: %s", esp_err_to_name(err));
+    }
+    wifi_retry_now();
 
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
     config.max_uri_handlers = 16;
@@ -235,3 +241,18 @@ void start_config_portal(void)
         ESP_LOGI(TAG, "Connect to this network and visit http://192.168.4.1");
     }
 }
+
+void stop_config_portal(void)
+{
+    if (!server)
+    {
+        return;
+    }
+
+    httpd_stop(server);
+    server = NULL;
+
+    // Back to a plain station, the connection to the stored network is kept
+    esp_wifi_set_mode(WIFI_MODE_STA);
+    ESP_LOGI(TAG, "Configuration portal stopped");
+}
@@ -7,6 +7,11 @@
 #define AP_SSID "RobotCocktail"
 #define AP_PASS "configure"
 
+// Serve the configuration page on our own access point, next to the station that keeps
+// trying the stored network. Saving the form restarts the device
 void start_config_portal(void);
 
+// Back to station only, once the stored network and server settings work again
+void stop_config_portal(void);
+
 #endif // AP_SERVER_H
@@ -2,24 +2,43 @@
 #include "api.h"
 #include "esp_log.h"
 #include "esp_http_client.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "storage.h"
+#include "ws_channel.h"
+#include "json_stream.h"
+#include "request_arena.h"
+#include "retry_policy.h"
 #include "cJSON.h"
 #include <string.h>
+#include <stdio.h>
 
 static const char *TAG = "api";
-#define MAX_RETRIES 4
-#define RETRY_DELAY_MS 30000
+#define HTTP_TIMEOUT_MS 10000
+#define ACTION_WAIT_MS 25000 // Long-poll duration asked to the server when idle
+#define HTTP_POOL_SIZE 2        // Progress reports run alongside the main task calls
+#define HTTP_IDLE_TIMEOUT_MS 55000 // Below the keep-alive timeout of the server and its proxy
+#define API_KEY_SIZE 32           // Longer keys are truncated, none of the decoded ones is
+#define API_MESSAGE_SIZE 384      // Requests of the allocation-free calls, token included
+#define API_RESPONSE_SIZE 512     // Responses of the allocation-free calls, except the action
+#define ACTION_RESPONSE_SIZE 2048 // A plan of MAX_PLAN_DOSES doses
 
 extern const uint8_t server_cert_pem_start[] asm("_binary_server_cert_pem_start");
 extern const uint8_t server_cert_pem_end[] asm("_binary_server_cert_pem_end");
 
-// Structure to store response data
+// Structure to store response data, grown on the heap unless `capacity` gives fixed storage
 typedef struct
 {
     char *buffer;
     size_t size;
+    size_t capacity;
+    bool overflow;
 } response_buffer_t;
 
+// Called with the NUL-terminated body of a 200 response, false to retry the request
+typedef bool (*response_handler_t)(const char *body, size_t length, void *context);
+
 static esp_err_t http_event_handler(esp_http_client_event_t *evt)
 {
     response_buffer_t *resp = (response_buffer_t *)evt->user_data;
@@ -30,10 +49,22 @@ static esp_err_t http_event_handler(esp_http_client_event_t *evt)
         ESP_LOGI(TAG, "HTTP_EVENT_ERROR");
         break;
     case HTTP_EVENT_ON_DATA:
-        if (evt->data_len)
+        if (evt->data_len && resp->capacity)
+        {
+            // Fixed storage, a response that does not fit is rejected as a whole
+            if (resp->size + evt->data_len + 1 > resp->capacity)
+            {
+                resp->overflow = true;
+                break;
+            }
+            memcpy(resp->buffer + resp->size, evt->data, evt->data_len);
+            resp->size += evt->data_len;
+            resp->buffer[resp->size] = '\0';
+        }
+        else if (evt->data_len)
         {
-            // Reallocate buffer to fit new data
-            char *new_buffer = realloc(resp->buffer, resp->size + evt->data_len + 1);
+            // Grows in place in the request arena
+            char *new_buffer = request_arena_realloc(resp->buffer, resp->size + evt->data_len + 1);
             if (new_buffer == NULL)
             {
                 ESP_LOGE(TAG, "Failed to allocate memory for response buffer");
@@ -53,78 +84,221 @@ static esp_err_t http_event_handler(esp_http_client_event_t *evt)
     return ESP_OK;
 }
 
-// Generic HTTP request function
-static cJSON *make_http_request(const char *url, const char *post_data, bool is_api_call)
+// Long-lived connections to the server, reused across calls so only the first one pays the TLS handshake
+typedef struct
 {
-    // Initialize response buffer
-    response_buffer_t resp = {
-        .buffer = NULL,
-        .size = 0};
+    esp_http_client_handle_t handle;
+    char origin[MAX_URL_LEN]; // scheme://host[:port] the connection is open to
+    int64_t last_used_us;
+    bool busy;
+    bool reused; // The request goes over a connection kept alive from a previous call
+} http_connection_t;
+
+static http_connection_t connections[HTTP_POOL_SIZE];
+static SemaphoreHandle_t connections_lock = NULL;
+static SemaphoreHandle_t connections_free = NULL; // Counts idle slots
+
+// Copy the scheme://host[:port] part of `url`
+static void url_origin(const char *url, char *origin, size_t origin_size)
+{
+    const char *host = strstr(url, "://");
+    host = host ? host + 3 : url;
+    size_t length = strcspn(host, "/?#") + (host - url);
+    if (length >= origin_size)
+    {
+        length = origin_size - 1;
+    }
+    memcpy(origin, url, length);
+    origin[length] = '\0';
+}
 
-    esp_http_client_config_t config = {
-        .url = url,
-        .method = post_data ? HTTP_METHOD_POST : HTTP_METHOD_GET,
-        .cert_pem = (char *)server_cert_pem_start,
-        .transport_type = HTTP_TRANSPORT_OVER_SSL,
-        .buffer_size = 2048,
-        .buffer_size_tx = 1024,
-        .disable_auto_redirect = true,
-        .timeout_ms = 10000,
-        .keep_alive_enable = true,
-        .event_handler = http_event_handler,
-        .user_data = &resp};
+// Take a connection slot for `url`, preferring one already open to the same origin
+static http_connection_t *acquire_connection(const char *url, int timeout_ms, response_buffer_t *resp)
+{
+    // The first call comes from app_main, before any other task uses the API
+    if (!connections_lock)
+    {
+        connections_lock = xSemaphoreCreateMutex();
+        connections_free = xSemaphoreCreateCounting(HTTP_POOL_SIZE, HTTP_POOL_SIZE);
+    }
 
-    esp_http_client_handle_t client = esp_http_client_init(&config);
+    char origin[MAX_URL_LEN];
+    url_origin(url, origin, sizeof(origin));
 
-    if (post_data)
+    xSemaphoreTake(connections_free, portMAX_DELAY);
+    xSemaphoreTake(connections_lock, portMAX_DELAY);
+    http_connection_t *conn = NULL;
+    for (int i = 0; i < HTTP_POOL_SIZE; i++)
     {
-        esp_http_client_set_header(client, "Content-Type", "application/json");
+        if (connections[i].busy)
+        {
+            continue;
+        }
+        if (!conn || (connections[i].handle && strcmp(connections[i].origin, origin) == 0))
+        {
+            conn = &connections[i];
+        }
     }
+    conn->busy = true;
+    xSemaphoreGive(connections_lock);
 
-    cJSON *parsed_response = NULL;
-    int retry_count = 0;
+    if (conn->handle && strcmp(conn->origin, origin) != 0)
+    {
+        esp_http_client_cleanup(conn->handle);
+        conn->handle = NULL;
+    }
 
-    while (retry_count < MAX_RETRIES && !parsed_response)
+    conn->reused = false;
+    if (!conn->handle)
+    {
+        esp_http_client_config_t config = {
+            .url = url,
+            .cert_pem = (char *)server_cert_pem_start,
+            .transport_type = HTTP_TRANSPORT_OVER_SSL,
+            .buffer_size = 2048,
+            .buffer_size_tx = 1024,
+            .disable_auto_redirect = true,
+            .timeout_ms = timeout_ms,
+            .keep_alive_enable = true,
+#if CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+            .save_client_session = true, // Reconnections resume the TLS session instead of a full handshake
+#endif
+            .event_handler = http_event_handler,
+            .user_data = resp};
+
+        conn->handle = esp_http_client_init(&config);
+        strcpy(conn->origin, origin);
+    }
+    else
     {
-        if (retry_count > 0)
+        // The proxy drops idle connections, reconnect rather than write to a half-closed socket
+        if ((esp_timer_get_time() - conn->last_used_us) / 1000 > HTTP_IDLE_TIMEOUT_MS)
         {
-            ESP_LOGI(TAG, "Retrying HTTP request (attempt %d/%d)", retry_count + 1, MAX_RETRIES);
-            vTaskDelay(pdMS_TO_TICKS(RETRY_DELAY_MS));
+            ESP_LOGI(TAG, "Connection idle for too long, reconnecting");
+            esp_http_client_close(conn->handle);
         }
+        else
+        {
+            conn->reused = true;
+        }
+        esp_http_client_set_url(conn->handle, url);
+        esp_http_client_set_timeout_ms(conn->handle, timeout_ms);
+        esp_http_client_set_user_data(conn->handle, resp);
+    }
+
+    return conn;
+}
+
+// Give the slot back, a connection in an unknown state is dropped
+static void release_connection(http_connection_t *conn, bool reusable)
+{
+    if (!reusable && conn->handle)
+    {
+        esp_http_client_cleanup(conn->handle);
+        conn->handle = NULL;
+    }
+    conn->last_used_us = esp_timer_get_time();
+
+    xSemaphoreTake(connections_lock, portMAX_DELAY);
+    conn->busy = false;
+    xSemaphoreGive(connections_lock);
+    xSemaphoreGive(connections_free);
+}
 
+// Empty the response before another attempt, heap storage is released
+static void reset_response(response_buffer_t *resp)
+{
+    if (!resp->capacity)
+    {
+        request_arena_free(resp->buffer);
+        resp->buffer = NULL;
+    }
+    resp->size = 0;
+    resp->overflow = false;
+}
+
+// Send `url` with retries until `handler` accepts a 200 response, within the deadline of `retry`.
+// The body goes to `storage` if given, so the call allocates nothing, or to a heap buffer otherwise.
+// On failure `retry->failure` tells why the last attempt failed.
+static bool http_request(const char *url, const char *post_data, int timeout_ms, retry_state_t *retry,
+                         char *storage, size_t storage_size, response_handler_t handler, void *context)
+{
+    // Initialize response buffer
+    response_buffer_t resp = {
+        .buffer = storage,
+        .size = 0,
+        .capacity = storage ? storage_size : 0};
+
+    bool handled = false;
+    bool retrying = true;
+
+    while (retrying)
+    {
+        // Never wait on the server past the deadline of the call
+        int attempt_timeout_ms = timeout_ms;
+        if (!retry_attempt(retry, &attempt_timeout_ms))
+        {
+            break;
+        }
+
+        // Taken per attempt so the retry delay does not hold a connection
+        http_connection_t *conn = acquire_connection(url, attempt_timeout_ms, &resp);
+        esp_http_client_handle_t client = conn->handle;
+        if (!client)
+        {
+            ESP_LOGE(TAG, "Failed to create HTTP client");
+            release_connection(conn, false);
+            retrying = retry_next(retry, RETRY_FAILURE_CONNECT);
+            continue;
+        }
+
+        esp_http_client_set_method(client, post_data ? HTTP_METHOD_POST : HTTP_METHOD_GET);
         if (post_data)
         {
+            esp_http_client_set_header(client, "Content-Type", "application/json");
             esp_http_client_set_post_field(client, post_data, strlen(post_data));
         }
+        else
+        {
+            esp_http_client_set_post_field(client, NULL, 0); // Also drops the Content-Type header
+        }
 
         esp_err_t err = esp_http_client_perform(client);
 
+        // The server may have closed a kept-alive connection since the last call, reconnect once right away
+        if (err != ESP_OK && conn->reused)
+        {
+            ESP_LOGI(TAG, "Request on reused connection failed (%s), reconnecting", esp_err_to_name(err));
+            esp_http_client_close(client);
+            reset_response(&resp);
+            err = esp_http_client_perform(client);
+        }
+
+        retry_failure_t failure = RETRY_FAILURE_NONE;
         if (err == ESP_OK)
         {
             int status_code = esp_http_client_get_status_code(client);
             ESP_LOGI(TAG, "HTTP Status Code: %d", status_code);
+            retry->status_code = status_code;
+            failure = retry_failure_from_status(status_code);
 
             if (status_code == 200)
             {
-                if (resp.buffer && resp.size > 0)
+                if (resp.overflow)
                 {
-                    parsed_response = cJSON_Parse(resp.buffer);
-                    if (!parsed_response)
-                    {
-                        ESP_LOGE(TAG, "Failed to parse JSON response");
-                    }
+                    ESP_LOGE(TAG, "Server response larger than %d bytes", resp.capacity);
+                }
+                else if (resp.buffer && resp.size > 0)
+                {
+                    handled = handler(resp.buffer, resp.size, context);
                 }
                 else
                 {
                     ESP_LOGE(TAG, "Empty server response (buffer size: %d bytes)", resp.size);
                 }
-
-                // Clean up response buffer for next retry
-                if (resp.buffer && !parsed_response)
+                if (!handled)
                 {
-                    free(resp.buffer);
-                    resp.buffer = NULL;
-                    resp.size = 0;
+                    failure = RETRY_FAILURE_SERVER;
                 }
             }
             else
@@ -139,32 +313,62 @@ static cJSON *make_http_request(const char *url, const char *post_data, bool is_
             if (err == ESP_ERR_HTTP_CONNECT)
             {
                 ESP_LOGE(TAG, "Connection failed - check server URL and connectivity");
+                failure = RETRY_FAILURE_CONNECT;
             }
             else if (err == ESP_ERR_HTTP_CONNECTING)
             {
                 ESP_LOGE(TAG, "Client connecting to server");
+                failure = RETRY_FAILURE_CONNECT;
             }
             else if (err == ESP_ERR_HTTP_EAGAIN)
             {
                 ESP_LOGE(TAG, "HTTP client error: ESP_ERR_HTTP_EAGAIN - try again later");
+                failure = RETRY_FAILURE_TRANSPORT;
+            }
+            else
+            {
+                failure = RETRY_FAILURE_TRANSPORT;
             }
         }
 
-        retry_count++;
+        release_connection(conn, err == ESP_OK);
+
+        // Clean up response buffer for next retry
+        reset_response(&resp);
+
+        retrying = retry_next(retry, failure);
     }
 
-    // Clean up
-    if (resp.buffer)
+    if (!handled)
     {
-        free(resp.buffer);
+        ESP_LOGE(TAG, "HTTP request failed after %u attempts: %s", retry->attempt, retry_failure_name(retry->failure));
     }
-    esp_http_client_cleanup(client);
 
-    if (!parsed_response)
+    return handled;
+}
+
+static bool parse_json_response(const char *body, size_t length, void *context)
+{
+    cJSON **parsed_response = (cJSON **)context;
+    *parsed_response = cJSON_Parse(body);
+    if (!*parsed_response)
     {
-        ESP_LOGE(TAG, "HTTP request failed after %d attempts", MAX_RETRIES);
-        // Clear stored token for API verification failures
-        if (is_api_call && strstr(url, "/verify"))
+        ESP_LOGE(TAG, "Failed to parse JSON response");
+    }
+    return *parsed_response != NULL;
+}
+
+// Generic HTTP request function
+static cJSON *make_http_request(const char *url, const char *post_data, bool is_api_call, int timeout_ms, api_call_class_t call_class)
+{
+    cJSON *parsed_response = NULL;
+    retry_state_t retry;
+    retry_begin(&retry, call_class);
+
+    if (!http_request(url, post_data, timeout_ms, &retry, NULL, 0, parse_json_response, &parsed_response))
+    {
+        // Clear stored token when the server refuses the verification, not when it cannot be reached
+        if (is_api_call && strstr(url, "/verify") && retry.failure == RETRY_FAILURE_CLIENT)
         {
             store_api_token("");
         }
@@ -173,7 +377,7 @@ static cJSON *make_http_request(const char *url, const char *post_data, bool is_
     return parsed_response;
 }
 
-cJSON *api_contact_server(char *api_path, cJSON *payload)
+static cJSON *contact_server(const char *api_path, cJSON *payload, int timeout_ms, api_call_class_t call_class)
 {
     char server_url[MAX_URL_LEN] = {0};
     char api_token[MAX_TOKEN_LEN] = {0};
@@ -192,12 +396,68 @@ cJSON *api_contact_server(char *api_path, cJSON *payload)
     cJSON_AddStringToObject(payload, "token", api_token);
     char *post_data = cJSON_PrintUnformatted(payload);
 
-    cJSON *response = make_http_request(api_url, post_data, true);
+    cJSON *response = make_http_request(api_url, post_data, true, timeout_ms, call_class);
 
     cJSON_free(post_data);
     return response;
 }
 
+cJSON *api_contact_server(char *api_path, cJSON *payload, api_call_class_t call_class)
+{
+    return contact_server(api_path, payload, HTTP_TIMEOUT_MS, call_class);
+}
+
+// Start a message for the allocation-free calls in `buffer`, with the token every endpoint needs
+static bool begin_api_message(json_writer_t *writer, char *buffer, size_t size)
+{
+    char api_token[MAX_TOKEN_LEN] = {0};
+    if (!get_stored_api_token(api_token))
+    {
+        ESP_LOGE(TAG, "Missing API token");
+        return false;
+    }
+
+    json_writer_init(writer, buffer, size);
+    json_write_object_begin(writer, NULL);
+    json_write_string(writer, "token", api_token);
+    return true;
+}
+
+// Close the message and send it, the response is decoded by `handler` straight from `response`.
+// `retry` was begun by the caller, it tells why the call failed.
+static bool post_api_request(const char *api_path, json_writer_t *writer, int timeout_ms, retry_state_t *retry,
+                             char *response, size_t response_size, response_handler_t handler, void *context)
+{
+    char server_url[MAX_URL_LEN] = {0};
+    char api_url[MAX_URL_LEN + 64] = {0};
+
+    if (!get_stored_server_url(server_url))
+    {
+        ESP_LOGE(TAG, "Missing server URL");
+        return false;
+    }
+
+    json_write_object_end(writer);
+    if (!json_writer_finish(writer))
+    {
+        ESP_LOGE(TAG, "Request for %s does not fit in %d bytes", api_path, writer->size);
+        return false;
+    }
+
+    snprintf(api_url, sizeof(api_url), "%s%s", server_url, api_path);
+    ESP_LOGI(TAG, "API call at URL: %s", api_url);
+
+    return http_request(api_url, writer->buffer, timeout_ms, retry, response, response_size, handler, context);
+}
+
+static bool post_api_message(const char *api_path, json_writer_t *writer, int timeout_ms, api_call_class_t call_class,
+                             char *response, size_t response_size, response_handler_t handler, void *context)
+{
+    retry_state_t retry;
+    retry_begin(&retry, call_class);
+    return post_api_request(api_path, writer, timeout_ms, &retry, response, response_size, handler, context);
+}
+
 bool verify_device(bool device_needs_calibration, bool *server_needs_calibration)
 {
     const char *api_path = "/api/devices/verify";
@@ -209,6 +469,8 @@ bool verify_device(bool device_needs_calibration, bool *server_needs_calibration
         *server_needs_calibration = false;
     }
 
+    request_arena_begin();
+
     // Prepare JSON payload
     cJSON *payload = cJSON_CreateObject();
     cJSON_AddStringToObject(payload, "firmwareVersion", FIRMWARE_VERSION);
@@ -219,13 +481,14 @@ bool verify_device(bool device_needs_calibration, bool *server_needs_calibration
         cJSON_AddBoolToObject(payload, "needsCalibration", true);
     }
 
-    cJSON *response = api_contact_server((char *)api_path, payload);
+    cJSON *response = api_contact_server((char *)api_path, payload, API_CALL_CONTROL);
 
     if (response)
     {
         cJSON *token_valid = cJSON_GetObjectItem(response, "tokenValid");
         cJSON *message = cJSON_GetObjectItem(response, "message");
         cJSON *need_cal = cJSON_GetObjectItem(response, "needCalibration");
+        cJSON *websocket_path = cJSON_GetObjectItem(response, "websocketPath");
 
         if (message)
         {
@@ -247,10 +510,21 @@ bool verify_device(bool device_needs_calibration, bool *server_needs_calibration
                 *server_needs_calibration = cJSON_IsTrue(need_cal);
                 ESP_LOGI(TAG, "Server says calibration needed: %s", *server_needs_calibration ? "true" : "false");
             }
+
+            // Keep a WebSocket open when the server offers one, HTTP remains the fallback
+            if (websocket_path && cJSON_IsString(websocket_path))
+            {
+                ws_channel_start(websocket_path->valuestring);
+            }
+            else
+            {
+                ws_channel_stop();
+            }
         }
         else
         {
             ESP_LOGE(TAG, "Token verification failed - server rejected token");
+            store_api_token("");
         }
     }
     else
@@ -261,21 +535,40 @@ bool verify_device(bool device_needs_calibration, bool *server_needs_calibration
     cJSON_Delete(payload);
     cJSON_Delete(response);
 
+    request_arena_end(api_path);
+
     return verification_success;
 }
 
-bool fetch_manifest(char *version_buffer, size_t buffer_size)
+// 64 hex digits to 32 bytes
+static bool parse_sha256(const char *hex, uint8_t *sha256)
+{
+    if (strlen(hex) != 64)
+    {
+        return false;
+    }
+    for (int i = 0; i < 32; i++)
+    {
+        unsigned int byte;
+        if (sscanf(hex + 2 * i, "%2x", &byte) != 1)
+        {
+            return false;
+        }
+        sha256[i] = byte;
+    }
+    return true;
+}
+
+bool fetch_manifest(firmware_manifest_t *firmware)
 {
     const char *manifest_path = "/firmware/manifest.json";
     char server_url[MAX_URL_LEN] = {0};
     char manifest_url[MAX_URL_LEN + 64] = {0};
     bool success = false;
 
-    // Initialize output buffer
-    if (version_buffer && buffer_size > 0)
-    {
-        version_buffer[0] = '\0';
-    }
+    // Servers without an `ota` entry only have the raw image
+    memset(firmware, 0, sizeof(firmware_manifest_t));
+    strcpy(firmware->ota_path, "autobar3.bin");
 
     if (!get_stored_server_url(server_url))
     {
@@ -285,17 +578,18 @@ bool fetch_manifest(char *version_buffer, size_t buffer_size)
 
     snprintf(manifest_url, sizeof(manifest_url), "%s%s", server_url, manifest_path);
 
-    cJSON *manifest = make_http_request(manifest_url, NULL, false);
+    request_arena_begin();
+    cJSON *manifest = make_http_request(manifest_url, NULL, false, HTTP_TIMEOUT_MS, API_CALL_CONTROL);
 
     if (manifest)
     {
         cJSON *version_item = cJSON_GetObjectItem(manifest, "version");
         if (version_item && cJSON_IsString(version_item))
         {
-            if (version_buffer && buffer_size > strlen(version_item->valuestring))
+            if (sizeof(firmware->version) > strlen(version_item->valuestring))
             {
-                strcpy(version_buffer, version_item->valuestring);
-                ESP_LOGI(TAG, "Manifest version: %s", version_buffer);
+                strcpy(firmware->version, version_item->valuestring);
+                ESP_LOGI(TAG, "Manifest version: %s", firmware->version);
                 success = true;
             }
             else
@@ -307,6 +601,47 @@ bool fetch_manifest(char *version_buffer, size_t buffer_size)
         {
             ESP_LOGE(TAG, "No version field found in manifest");
         }
+
+        cJSON *ota_item = cJSON_GetObjectItem(manifest, "ota");
+        cJSON *path_item = cJSON_GetObjectItem(ota_item, "path");
+        cJSON *format_item = cJSON_GetObjectItem(ota_item, "format");
+        if (path_item && cJSON_IsString(path_item) && format_item && cJSON_IsString(format_item) &&
+            sizeof(firmware->ota_path) > strlen(path_item->valuestring))
+        {
+            if (strcmp(format_item->valuestring, "zlib-blocks") == 0 || strcmp(format_item->valuestring, "raw") == 0)
+            {
+                strcpy(firmware->ota_path, path_item->valuestring);
+                firmware->ota_compressed = strcmp(format_item->valuestring, "zlib-blocks") == 0;
+
+                cJSON *sha256_item = cJSON_GetObjectItem(ota_item, "sha256");
+                firmware->has_ota_sha256 = cJSON_IsString(sha256_item) && parse_sha256(sha256_item->valuestring, firmware->ota_sha256);
+            }
+            else
+            {
+                ESP_LOGW(TAG, "Unsupported OTA format %s, using the raw image", format_item->valuestring);
+            }
+        }
+
+        // Patches are listed by the version they apply to, only ours is of any use
+        cJSON *patch_item = NULL;
+        cJSON_ArrayForEach(patch_item, cJSON_GetObjectItem(ota_item, "patches"))
+        {
+            cJSON *from_item = cJSON_GetObjectItem(patch_item, "from");
+            if (!cJSON_IsString(from_item) || strcmp(from_item->valuestring, FIRMWARE_VERSION) != 0)
+            {
+                continue;
+            }
+            cJSON *patch_path_item = cJSON_GetObjectItem(patch_item, "path");
+            cJSON *sha256_item = cJSON_GetObjectItem(patch_item, "sha256");
+            if (cJSON_IsString(patch_path_item) && sizeof(firmware->patch_path) > strlen(patch_path_item->valuestring) &&
+                cJSON_IsString(sha256_item) && parse_sha256(sha256_item->valuestring, firmware->patch_base_sha256))
+            {
+                strcpy(firmware->patch_path, patch_path_item->valuestring);
+                firmware->has_patch = true;
+                ESP_LOGI(TAG, "Delta patch from %s: %s", FIRMWARE_VERSION, firmware->patch_path);
+            }
+            break;
+        }
         cJSON_Delete(manifest);
     }
     else
@@ -314,12 +649,55 @@ bool fetch_manifest(char *version_buffer, size_t buffer_size)
         ESP_LOGE(TAG, "Failed to fetch or parse manifest");
     }
 
+    request_arena_end(manifest_path);
+
     return success;
 }
 
-bool report_progress(const char *order_id, const char *dose_id, float weight_progress, bool *should_continue, char *message, size_t message_size)
+typedef struct
+{
+    char message[128];
+    bool has_message;
+    bool should_continue;
+    bool has_continue;
+} progress_response_t;
+
+static bool decode_progress_response(const char *body, size_t length, void *context)
+{
+    progress_response_t *response = (progress_response_t *)context;
+    json_reader_t reader;
+    char key[API_KEY_SIZE];
+
+    json_reader_init(&reader, body, length);
+    json_read_object_begin(&reader);
+    while (json_read_next_key(&reader, key, sizeof(key)))
+    {
+        if (strcmp(key, "message") == 0)
+        {
+            response->has_message = json_read_string(&reader, response->message, sizeof(response->message));
+        }
+        else if (strcmp(key, "continue") == 0)
+        {
+            response->has_continue = json_read_bool(&reader, &response->should_continue);
+        }
+        else
+        {
+            json_skip_value(&reader);
+        }
+    }
+
+    if (reader.error)
+    {
+        ESP_LOGE(TAG, "Failed to parse JSON response");
+        return false;
+    }
+    return true;
+}
+
+bool report_progress_batch(const char *order_id, const char *dose_id, const progress_sample_t *samples, int count,
+                           bool *should_continue, char *message, size_t message_size)
 {
-    const char *api_path = "/api/devices/progress";
+    const char *api_path = "/api/devices/progress/batch";
     bool success = false;
 
     // Initialize output parameters
@@ -332,19 +710,104 @@ bool report_progress(const char *order_id, const char *dose_id, float weight_pro
         message[0] = '\0';
     }
 
+    if (!order_id || !dose_id || count <= 0)
+    {
+        ESP_LOGE(TAG, "Order ID, dose ID and samples cannot be empty");
+        return false;
+    }
+
+    // A WebSocket frame is cheap, the latest sample is enough there. Without an ack it goes over HTTP
+    bool ws_continue = true;
+    if (ws_channel_send_progress(order_id, dose_id, samples[count - 1].weight_progress, &ws_continue))
+    {
+        if (should_continue)
+        {
+            *should_continue = ws_continue;
+        }
+        return true;
+    }
+
+    // Prepare JSON payload, everything stays on the stack of the reporter task
+    char request[API_MESSAGE_SIZE + MAX_PROGRESS_SAMPLES * 48];
+    char response_body[API_RESPONSE_SIZE];
+    progress_response_t response = {0};
+    json_writer_t writer;
+
+    if (!begin_api_message(&writer, request, sizeof(request)))
+    {
+        return false;
+    }
+    json_write_string(&writer, "orderId", order_id);
+    json_write_string(&writer, "doseId", dose_id);
+    json_write_array_begin(&writer, "samples");
+    for (int i = 0; i < count; i++)
+    {
+        json_write_object_begin(&writer, NULL);
+        json_write_int(&writer, "t", (long)samples[i].t_ms);
+        json_write_float(&writer, "weightProgress", samples[i].weight_progress);
+        json_write_object_end(&writer);
+    }
+    json_write_array_end(&writer);
+
+    if (post_api_message(api_path, &writer, HTTP_TIMEOUT_MS, API_CALL_POUR, response_body, sizeof(response_body),
+                         decode_progress_response, &response))
+    {
+        if (response.has_message)
+        {
+            ESP_LOGI(TAG, "Progress batch of %d samples: %s", count, response.message);
+            success = true;
+
+            // Copy message to output buffer if provided
+            if (message && message_size > 0)
+            {
+                strncpy(message, response.message, message_size - 1);
+                message[message_size - 1] = '\0';
+            }
+
+            // The decision follows the latest sample
+            if (should_continue && response.has_continue)
+            {
+                *should_continue = response.should_continue;
+            }
+        }
+        else
+        {
+            ESP_LOGE(TAG, "No message field found in progress response");
+        }
+    }
+    else
+    {
+        ESP_LOGE(TAG, "Failed to report progress batch to server");
+    }
+
+    return success;
+}
+
+bool report_dose_complete(const char *order_id, const char *dose_id, float weight_progress, bool *should_continue)
+{
+    const char *api_path = "/api/devices/complete/dose";
+    bool success = false;
+
+    if (should_continue)
+    {
+        *should_continue = false;
+    }
+
     if (!order_id || !dose_id)
     {
         ESP_LOGE(TAG, "Order ID and dose ID cannot be NULL");
         return false;
     }
 
+    request_arena_begin();
+
     // Prepare JSON payload
     cJSON *payload = cJSON_CreateObject();
     cJSON_AddStringToObject(payload, "orderId", order_id);
     cJSON_AddStringToObject(payload, "doseId", dose_id);
     cJSON_AddNumberToObject(payload, "weightProgress", weight_progress);
 
-    cJSON *response = api_contact_server((char *)api_path, payload);
+    cJSON *response = api_contact_server((char *)api_path, payload, API_CALL_REPORT);
 
     if (response)
     {
@@ -353,36 +816,29 @@ bool report_progress(const char *order_id, const char *dose_id, float weight_pro
 
         if (message_item && cJSON_IsString(message_item))
         {
-            ESP_LOGI(TAG, "Progress report response: %s", message_item->valuestring);
+            ESP_LOGI(TAG, "Dose completion response: %s", message_item->valuestring);
             success = true;
 
-            // Copy message to output buffer if provided
-            if (message && message_size > 0)
-            {
-                strncpy(message, message_item->valuestring, message_size - 1);
-                message[message_size - 1] = '\0';
-            }
-
-            // Check if we should continue
             if (should_continue && continue_item && cJSON_IsBool(continue_item))
             {
                 *should_continue = cJSON_IsTrue(continue_item);
-                ESP_LOGI(TAG, "Should continue: %s", *should_continue ? "true" : "false");
             }
         }
         else
         {
-            ESP_LOGE(TAG, "No message field found in progress response");
+            ESP_LOGE(TAG, "No message field found in dose completion response");
         }
     }
     else
     {
-        ESP_LOGE(TAG, "Failed to report progress to server");
+        ESP_LOGE(TAG, "Failed to report dose completion to server");
     }
 
     cJSON_Delete(payload);
     cJSON_Delete(response);
 
+    request_arena_end(api_path);
+
     return success;
 }
 
@@ -397,13 +853,15 @@ bool report_error(const char *order_id, error_code_t error_code, const char *mes
         return false;
     }
 
+    request_arena_begin();
+
     // Prepare JSON payload
     cJSON *payload = cJSON_CreateObject();
     cJSON_AddStringToObject(payload, "orderId", order_id);
     cJSON_AddNumberToObject(payload, "errorCode", error_code);
     cJSON_AddStringToObject(payload, "message", message);
 
-    cJSON *response = api_contact_server((char *)api_path, payload);
+    cJSON *response = api_contact_server((char *)api_path, payload, API_CALL_REPORT);
 
     if (response)
     {
@@ -427,6 +885,8 @@ bool report_error(const char *order_id, error_code_t error_code, const char *mes
     cJSON_Delete(payload);
     cJSON_Delete(response);
 
+    request_arena_end(api_path);
+
     return success;
 }
 
@@ -441,11 +901,13 @@ bool cancel_order(const char *order_id)
         return false;
     }
 
+    request_arena_begin();
+
     // Prepare JSON payload
     cJSON *payload = cJSON_CreateObject();
     cJSON_AddStringToObject(payload, "orderId", order_id);
 
-    cJSON *response = api_contact_server((char *)api_path, payload);
+    cJSON *response = api_contact_server((char *)api_path, payload, API_CALL_REPORT);
 
     if (response)
     {
@@ -484,115 +946,417 @@ bool cancel_order(const char *order_id)
     cJSON_Delete(payload);
     cJSON_Delete(response);
 
+    request_arena_end(api_path);
+
     return success;
 }
 
-bool ask_server_for_action(device_action_t *action)
+typedef struct
 {
-    const char *api_path = "/api/devices/action";
-    bool success = false;
+    double acked_seq;
+    bool has_acked_seq;
+} report_batch_response_t;
 
-    if (!action)
+static bool decode_report_batch_response(const char *body, size_t length, void *context)
+{
+    report_batch_response_t *response = (report_batch_response_t *)context;
+    json_reader_t reader;
+    char key[API_KEY_SIZE];
+
+    json_reader_init(&reader, body, length);
+    json_read_object_begin(&reader);
+    while (json_read_next_key(&reader, key, sizeof(key)))
     {
-        ESP_LOGE(TAG, "Action parameter cannot be NULL");
+        if (strcmp(key, "ackedSeq") == 0)
+        {
+            response->has_acked_seq = json_read_number(&reader, &response->acked_seq);
+        }
+        else
+        {
+            json_skip_value(&reader);
+        }
+    }
+
+    if (reader.error)
+    {
+        ESP_LOGE(TAG, "Failed to parse JSON response");
         return false;
     }
+    return true;
+}
 
-    // Initialize action structure
-    memset(action, 0, sizeof(device_action_t));
-    action->type = ACTION_ERROR;
+bool send_report_batch(uint32_t epoch, const outbox_event_t *events, int count, uint32_t *acked_seq, int *status_code)
+{
+    const char *api_path = "/api/devices/reports";
+    // Static: only the main task replays the outbox
+    static char request[API_MESSAGE_SIZE + OUTBOX_CAPACITY * (OUTBOX_MESSAGE_SIZE + 256)];
+    char response_body[API_RESPONSE_SIZE];
+    report_batch_response_t response = {0};
+    json_writer_t writer;
+    char epoch_hex[9];
+
+    *acked_seq = 0;
+    *status_code = 0;
+    if (!begin_api_message(&writer, request, sizeof(request)))
+    {
+        return false;
+    }
 
-    // Prepare JSON payload (just needs token, which is added by api_contact_server)
-    cJSON *payload = cJSON_CreateObject();
+    // The epoch changes on every boot without pending events, with `seq` it makes each event unique
+    snprintf(epoch_hex, sizeof(epoch_hex), "%08lx", (unsigned long)epoch);
+    json_write_string(&writer, "epoch", epoch_hex);
+    json_write_array_begin(&writer, "events");
+    for (int i = 0; i < count; i++)
+    {
+        const outbox_event_t *event = &events[i];
+        json_write_object_begin(&writer, NULL);
+        json_write_int(&writer, "seq", (long)event->seq);
+        json_write_string(&writer, "orderId", event->order_id);
+        if (event->type == OUTBOX_PROGRESS)
+        {
+            json_write_string(&writer, "type", "progress");
+            json_write_string(&writer, "doseId", event->data.progress.dose_id);
+            json_write_float(&writer, "weightProgress", event->data.progress.weight_progress);
+        }
+        else
+        {
+            json_write_string(&writer, "type", "error");
+            json_write_int(&writer, "errorCode", event->data.error.error_code);
+            json_write_string(&writer, "message", event->data.error.message);
+        }
+        json_write_object_end(&writer);
+    }
+    json_write_array_end(&writer);
+
+    retry_state_t retry;
+    retry_begin(&retry, API_CALL_REPORT);
+    bool sent = post_api_request(api_path, &writer, HTTP_TIMEOUT_MS, &retry, response_body, sizeof(response_body),
+                                 decode_report_batch_response, &response);
+    *status_code = retry.status_code;
+    if (!sent)
+    {
+        ESP_LOGE(TAG, "Failed to send reports to server");
+        return false;
+    }
+    if (!response.has_acked_seq)
+    {
+        ESP_LOGE(TAG, "No ackedSeq field found in reports response");
+        return false;
+    }
 
-    cJSON *response = api_contact_server((char *)api_path, payload);
+    *acked_seq = (uint32_t)response.acked_seq;
+    ESP_LOGI(TAG, "Server acknowledged reports up to %lu", (unsigned long)*acked_seq);
+    return true;
+}
 
-    if (response)
-    {
-        cJSON *action_item = cJSON_GetObjectItem(response, "action");
+// Read one dose of a plan straight into `dose`, false if a field is missing
+static bool decode_planned_dose(json_reader_t *reader, planned_dose_t *dose)
+{
+    char key[API_KEY_SIZE];
+    double number;
+    bool has_dose_id = false, has_gpio = false, has_weight = false, has_progress = false;
 
-        if (action_item && cJSON_IsString(action_item))
+    if (!json_read_object_begin(reader))
+    {
+        return false;
+    }
+    while (json_read_next_key(reader, key, sizeof(key)))
+    {
+        if (strcmp(key, "doseId") == 0)
         {
-            const char *action_str = action_item->valuestring;
-
-            if (strcmp(action_str, "standby") == 0)
+            has_dose_id = json_read_string(reader, dose->dose_id, sizeof(dose->dose_id));
+        }
+        else if (strcmp(key, "pumpGpio") == 0)
+        {
+            if ((has_gpio = json_read_number(reader, &number)))
             {
-                action->type = ACTION_STANDBY;
-                cJSON *idle = cJSON_GetObjectItem(response, "idle");
-                if (idle && cJSON_IsNumber(idle))
-                {
-                    action->data.standby.idle_ms = idle->valueint;
-                }
-                else
-                {
-                    action->data.standby.idle_ms = 1000; // Default 1000ms if missing
-                }
-                success = true;
-                ESP_LOGI(TAG, "Received standby action, idle for %d ms", action->data.standby.idle_ms);
-            }
-            else if (strcmp(action_str, "pump") == 0)
-            {
-                action->type = ACTION_PUMP;
-                cJSON *order_id = cJSON_GetObjectItem(response, "orderId");
-                cJSON *dose_id = cJSON_GetObjectItem(response, "doseId");
-                cJSON *pump_gpio = cJSON_GetObjectItem(response, "pumpGpio");
-                cJSON *dose_weight = cJSON_GetObjectItem(response, "doseWeight");
-                cJSON *dose_weight_progress = cJSON_GetObjectItem(response, "doseWeightProgress");
-
-                if (order_id && cJSON_IsString(order_id) &&
-                    dose_id && cJSON_IsString(dose_id) &&
-                    pump_gpio && cJSON_IsNumber(pump_gpio) &&
-                    dose_weight && cJSON_IsNumber(dose_weight) &&
-                    dose_weight_progress && cJSON_IsNumber(dose_weight_progress))
-                {
-                    strncpy(action->data.pump.order_id, order_id->valuestring, sizeof(action->data.pump.order_id) - 1);
-                    strncpy(action->data.pump.dose_id, dose_id->valuestring, sizeof(action->data.pump.dose_id) - 1);
-                    action->data.pump.pump_gpio = pump_gpio->valueint;
-                    action->data.pump.dose_weight = (float)dose_weight->valuedouble;
-                    action->data.pump.dose_weight_progress = (float)dose_weight_progress->valuedouble;
-                    success = true;
-                    ESP_LOGI(TAG, "Received pump action for order %s, dose %s, GPIO %d",
-                             action->data.pump.order_id, action->data.pump.dose_id, action->data.pump.pump_gpio);
-                }
+                dose->pump_gpio = (int)number;
             }
-            else if (strcmp(action_str, "completed") == 0)
+        }
+        else if (strcmp(key, "doseWeight") == 0)
+        {
+            if ((has_weight = json_read_number(reader, &number)))
             {
-                action->type = ACTION_COMPLETED;
-                cJSON *order_id = cJSON_GetObjectItem(response, "orderId");
-                cJSON *message = cJSON_GetObjectItem(response, "message");
+                dose->dose_weight = (float)number;
+            }
+        }
+        else if (strcmp(key, "doseWeightProgress") == 0)
+        {
+            if ((has_progress = json_read_number(reader, &number)))
+            {
+                dose->dose_weight_progress = (float)number;
+            }
+        }
+        else
+        {
+            json_skip_value(reader);
+        }
+    }
+    return has_dose_id && has_gpio && has_weight && has_progress;
+}
 
-                if (order_id && cJSON_IsString(order_id) &&
-                    message && cJSON_IsString(message))
-                {
-                    strncpy(action->data.completed.order_id, order_id->valuestring, sizeof(action->data.completed.order_id) - 1);
-                    strncpy(action->data.completed.message, message->valuestring, sizeof(action->data.completed.message) - 1);
-                    success = true;
-                    ESP_LOGI(TAG, "Received completed action for order %s: %s",
-                             action->data.completed.order_id, action->data.completed.message);
-                }
+typedef struct
+{
+    device_action_t *action;
+    bool success;
+} action_response_t;
+
+// Fill the action from an action API response or WebSocket action frame, keys come in any order
+static bool decode_action(const char *body, size_t length, void *context)
+{
+    action_response_t *response = (action_response_t *)context;
+    device_action_t *action = response->action;
+    json_reader_t reader;
+    char key[API_KEY_SIZE];
+    double number;
+
+    // Fields land in locals first, the union members overlap
+    char action_str[16] = {0};
+    char order_id[64] = {0};
+    char dose_id[64] = {0};
+    char message[256] = {0};
+    double idle = -1, pump_gpio = -1, dose_weight = -1, dose_weight_progress = -1;
+    bool has_doses = false, doses_valid = true;
+    int dose_count = 0;
+
+    json_reader_init(&reader, body, length);
+    json_read_object_begin(&reader);
+    while (json_read_next_key(&reader, key, sizeof(key)))
+    {
+        if (strcmp(key, "action") == 0)
+        {
+            json_read_string(&reader, action_str, sizeof(action_str));
+        }
+        else if (strcmp(key, "orderId") == 0)
+        {
+            json_read_string(&reader, order_id, sizeof(order_id));
+        }
+        else if (strcmp(key, "doseId") == 0)
+        {
+            json_read_string(&reader, dose_id, sizeof(dose_id));
+        }
+        else if (strcmp(key, "message") == 0)
+        {
+            json_read_string(&reader, message, sizeof(message));
+        }
+        else if (strcmp(key, "idle") == 0)
+        {
+            if (json_read_number(&reader, &number))
+            {
+                idle = number;
             }
-            else
+        }
+        else if (strcmp(key, "pumpGpio") == 0)
+        {
+            if (json_read_number(&reader, &number))
+            {
+                pump_gpio = number;
+            }
+        }
+        else if (strcmp(key, "doseWeight") == 0)
+        {
+            if (json_read_number(&reader, &number))
+            {
+                dose_weight = number;
+            }
+        }
+        else if (strcmp(key, "doseWeightProgress") == 0)
+        {
+            if (json_read_number(&reader, &number))
             {
-                ESP_LOGE(TAG, "Unknown action type: %s", action_str);
+                dose_weight_progress = number;
+            }
+        }
+        else if (strcmp(key, "doses") == 0)
+        {
+            // Only a plan has doses, decode them in place
+            has_doses = json_read_array_begin(&reader);
+            while (json_read_array_next(&reader))
+            {
+                if (dose_count >= MAX_PLAN_DOSES)
+                {
+                    ESP_LOGI(TAG, "Plan truncated to %d doses", MAX_PLAN_DOSES);
+                    json_skip_value(&reader);
+                    continue;
+                }
+                if (!decode_planned_dose(&reader, &action->data.plan.doses[dose_count++]))
+                {
+                    doses_valid = false;
+                }
             }
         }
         else
         {
-            ESP_LOGE(TAG, "No action field found in server response");
+            json_skip_value(&reader);
+        }
+    }
+
+    if (reader.error)
+    {
+        ESP_LOGE(TAG, "Failed to parse JSON response");
+        return false;
+    }
+
+    response->success = false;
+    if (action_str[0] == '\0')
+    {
+        ESP_LOGE(TAG, "No action field found in server response");
+    }
+    else if (strcmp(action_str, "standby") == 0)
+    {
+        action->type = ACTION_STANDBY;
+        action->data.standby.idle_ms = idle >= 0 ? (int)idle : 1000; // Default 1000ms if missing
+        response->success = true;
+        ESP_LOGI(TAG, "Received standby action, idle for %d ms", action->data.standby.idle_ms);
+    }
+    else if (strcmp(action_str, "pump") == 0)
+    {
+        action->type = ACTION_PUMP;
+        if (order_id[0] && dose_id[0] && pump_gpio >= 0 && dose_weight >= 0 && dose_weight_progress >= 0)
+        {
+            strcpy(action->data.pump.order_id, order_id);
+            strcpy(action->data.pump.dose_id, dose_id);
+            action->data.pump.pump_gpio = (int)pump_gpio;
+            action->data.pump.dose_weight = (float)dose_weight;
+            action->data.pump.dose_weight_progress = (float)dose_weight_progress;
+            response->success = true;
+            ESP_LOGI(TAG, "Received pump action for order %s, dose %s, GPIO %d",
+                     action->data.pump.order_id, action->data.pump.dose_id, action->data.pump.pump_gpio);
+        }
+    }
+    else if (strcmp(action_str, "completed") == 0)
+    {
+        action->type = ACTION_COMPLETED;
+        if (order_id[0] && message[0])
+        {
+            strcpy(action->data.completed.order_id, order_id);
+            strcpy(action->data.completed.message, message);
+            response->success = true;
+            ESP_LOGI(TAG, "Received completed action for order %s: %s",
+                     action->data.completed.order_id, action->data.completed.message);
+        }
+    }
+    else if (strcmp(action_str, "plan") == 0)
+    {
+        action->type = ACTION_PLAN;
+        if (!doses_valid)
+        {
+            ESP_LOGE(TAG, "Invalid dose in plan");
+        }
+        else if (order_id[0] && has_doses)
+        {
+            strcpy(action->data.plan.order_id, order_id);
+            action->data.plan.dose_count = dose_count;
+            response->success = true;
+            ESP_LOGI(TAG, "Received plan for order %s with %d doses",
+                     action->data.plan.order_id, action->data.plan.dose_count);
         }
     }
     else
+    {
+        ESP_LOGE(TAG, "Unknown action type: %s", action_str);
+    }
+
+    return true;
+}
+
+bool ask_server_for_action(device_action_t *action)
+{
+    const char *api_path = "/api/devices/action";
+    // Only the main task asks for actions, a plan is too large for its stack
+    static char response_body[ACTION_RESPONSE_SIZE];
+
+    if (!action)
+    {
+        ESP_LOGE(TAG, "Action parameter cannot be NULL");
+        return false;
+    }
+
+    // Initialize action structure
+    memset(action, 0, sizeof(device_action_t));
+    action->type = ACTION_ERROR;
+
+    action_response_t response = {
+        .action = action,
+        .success = false};
+    size_t length = 0;
+    bool received = false;
+
+    // Over the WebSocket the server pushes the action once available, HTTP is the fallback
+    if (ws_channel_request_action(true, ACTION_WAIT_MS + HTTP_TIMEOUT_MS, response_body, sizeof(response_body), &length))
+    {
+        received = decode_action(response_body, length, &response);
+    }
+
+    if (!received)
+    {
+        char request[API_MESSAGE_SIZE];
+        json_writer_t writer;
+        if (begin_api_message(&writer, request, sizeof(request)))
+        {
+            json_write_bool(&writer, "plan", true); // This firmware can run whole-order plans
+            // Server holds the request until an order arrives, the read timeout must outlast the wait
+            json_write_int(&writer, "wait", ACTION_WAIT_MS);
+
+            received = post_api_message(api_path, &writer, ACTION_WAIT_MS + HTTP_TIMEOUT_MS, API_CALL_POLL,
+                                        response_body, sizeof(response_body), decode_action, &response);
+        }
+    }
+
+    if (!received)
     {
         ESP_LOGE(TAG, "Failed to get action from server");
     }
 
-    cJSON_Delete(payload);
-    cJSON_Delete(response);
+    return response.success;
+}
 
-    return success;
+typedef struct
+{
+    bool need_calibration;
+    bool has_need_calibration;
+    double dt_pin, sck_pin, offset, scale, filter_type, median_size;
+    bool has_dt_pin, has_sck_pin, has_offset, has_scale, has_filter_type, has_median_size;
+} weight_response_t;
+
+static bool decode_weight_response(const char *body, size_t length, void *context)
+{
+    weight_response_t *response = (weight_response_t *)context;
+    json_reader_t reader;
+    char key[API_KEY_SIZE];
+
+    json_reader_init(&reader, body, length);
+    json_read_object_begin(&reader);
+    while (json_read_next_key(&reader, key, sizeof(key)))
+    {
+        if (strcmp(key, "needCalibration") == 0)
+            response->has_need_calibration = json_read_bool(&reader, &response->need_calibration);
+        else if (strcmp(key, "hx711Dt") == 0)
+            response->has_dt_pin = json_read_number(&reader, &response->dt_pin);
+        else if (strcmp(key, "hx711Sck") == 0)
+            response->has_sck_pin = json_read_number(&reader, &response->sck_pin);
+        else if (strcmp(key, "hx711Offset") == 0)
+            response->has_offset = json_read_number(&reader, &response->offset);
+        else if (strcmp(key, "hx711Scale") == 0)
+            response->has_scale = json_read_number(&reader, &response->scale);
+        else if (strcmp(key, "hx711Filter") == 0)
+            response->has_filter_type = json_read_number(&reader, &response->filter_type);
+        else if (strcmp(key, "hx711MedianSize") == 0)
+            response->has_median_size = json_read_number(&reader, &response->median_size);
+        else
+            json_skip_value(&reader);
+    }
+
+    if (reader.error)
+    {
+        ESP_LOGE(TAG, "Failed to parse JSON response");
+        return false;
+    }
+    return true;
 }
 
-bool send_weight_measurement(float weight, int raw_measure, bool *need_calibration, unsigned int *dt_pin, unsigned int *sck_pin, int *offset, float *scale)
+bool send_weight_measurement(float weight, int raw_measure, bool *need_calibration, unsigned int *dt_pin, unsigned int *sck_pin, int *offset, float *scale,
+                             int *filter_type, int *median_size)
 {
     const char *api_path = "/api/devices/weight";
     bool success = false;
@@ -610,45 +1374,56 @@ bool send_weight_measurement(float weight, int raw_measure, bool *need_calibrati
         *scale = 0.0;
 
     // Prepare JSON payload
-    cJSON *payload = cJSON_CreateObject();
-    cJSON_AddNumberToObject(payload, "weight", weight);
-    cJSON_AddNumberToObject(payload, "rawMeasure", raw_measure);
-
-    cJSON *response = api_contact_server((char *)api_path, payload);
+    char request[API_MESSAGE_SIZE];
+    char response_body[API_RESPONSE_SIZE];
+    weight_response_t response = {0};
+    json_writer_t writer;
 
-    if (response)
+    if (!begin_api_message(&writer, request, sizeof(request)))
     {
-        cJSON *need_cal = cJSON_GetObjectItem(response, "needCalibration");
-        cJSON *dt = cJSON_GetObjectItem(response, "hx711Dt");
-        cJSON *sck = cJSON_GetObjectItem(response, "hx711Sck");
-        cJSON *offs = cJSON_GetObjectItem(response, "hx711Offset");
-        cJSON *sc = cJSON_GetObjectItem(response, "hx711Scale");
+        return false;
+    }
+    json_write_float(&writer, "weight", weight);
+    json_write_int(&writer, "rawMeasure", raw_measure);
 
-        if (need_cal && cJSON_IsBool(need_cal))
+    if (post_api_message(api_path, &writer, HTTP_TIMEOUT_MS, API_CALL_POLL, response_body, sizeof(response_body),
+                         decode_weight_response, &response))
+    {
+        if (response.has_need_calibration)
         {
             if (need_calibration)
-                *need_calibration = cJSON_IsTrue(need_cal);
+                *need_calibration = response.need_calibration;
             success = true;
         }
 
-        if (dt && cJSON_IsNumber(dt) && dt_pin)
+        if (response.has_dt_pin && dt_pin)
+        {
+            *dt_pin = (unsigned int)response.dt_pin;
+        }
+
+        if (response.has_sck_pin && sck_pin)
         {
-            *dt_pin = (unsigned int)dt->valueint;
+            *sck_pin = (unsigned int)response.sck_pin;
         }
 
-        if (sck && cJSON_IsNumber(sck) && sck_pin)
+        if (response.has_offset && offset)
         {
-            *sck_pin = (unsigned int)sck->valueint;
+            *offset = (int)response.offset;
         }
 
-        if (offs && cJSON_IsNumber(offs) && offset)
+        if (response.has_scale && scale)
         {
-            *offset = offs->valueint;
+            *scale = (float)response.scale;
         }
 
-        if (sc && cJSON_IsNumber(sc) && scale)
+        if (response.has_filter_type && filter_type)
         {
-            *scale = (float)sc->valuedouble;
+            *filter_type = (int)response.filter_type;
+        }
+
+        if (response.has_median_size && median_size)
+        {
+            *median_size = (int)response.median_size;
         }
 
         ESP_LOGI(TAG, "Weight measurement sent successfully");
@@ -658,8 +1433,5 @@ bool send_weight_measurement(float weight, int raw_measure, bool *need_calibrati
         ESP_LOGE(TAG, "Failed to send weight measurement to server");
     }
 
-    cJSON_Delete(payload);
-    cJSON_Delete(response);
-
     return success;
 }
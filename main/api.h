@@ -3,6 +3,8 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include "outbox.h"
 
 // Error codes for device error reporting
 typedef enum
@@ -18,11 +20,26 @@ typedef enum
 // Function to verify device state with the server at `POST /api/devices/verify`
 bool verify_device(bool device_needs_calibration, bool *server_needs_calibration);
 
-// Function to fetch manifest from server static files and return version in provided buffer
-bool fetch_manifest(char *version_buffer, size_t buffer_size);
+// Firmware served by the server, from `/firmware/manifest.json`
+typedef struct
+{
+    char version[64];
+    char ota_path[64];   // Under `/firmware/`, `autobar3.bin` if the manifest does not say
+    bool ota_compressed; // zlib blocks, inflated while flashing
+    bool has_ota_sha256; // Downloads only resume, and are only checked against the manifest, with it
+    uint8_t ota_sha256[32]; // Hash appended to the image, as esp_partition_get_sha256 reports it
+    bool has_patch;      // A delta patch from the running version is available
+    char patch_path[64];
+    uint8_t patch_base_sha256[32]; // Image the patch applies to, as esp_partition_get_sha256 reports it
+} firmware_manifest_t;
+
+// Function to fetch manifest from server static files
+bool fetch_manifest(firmware_manifest_t *manifest);
 
 // Function to send weight measurement and get calibration parameters at `POST /api/devices/weight`
-bool send_weight_measurement(float weight, int raw_measure, bool *need_calibration, unsigned int *dt_pin, unsigned int *sck_pin, int *offset, float *scale);
+// `filter_type` and `median_size` are left untouched if the server does not send them
+bool send_weight_measurement(float weight, int raw_measure, bool *need_calibration, unsigned int *dt_pin, unsigned int *sck_pin, int *offset, float *scale,
+                             int *filter_type, int *median_size);
 
 // Calls the `POST /api/devices/action` API
 typedef enum
@@ -30,9 +47,21 @@ typedef enum
     ACTION_STANDBY,
     ACTION_PUMP,
     ACTION_COMPLETED,
+    ACTION_PLAN,
     ACTION_ERROR
 } action_type_t;
 
+// Largest number of doses accepted in a single plan, longer orders take several plans
+#define MAX_PLAN_DOSES 8
+
+typedef struct
+{
+    char dose_id[64];
+    int pump_gpio;
+    float dose_weight;
+    float dose_weight_progress;
+} planned_dose_t;
+
 typedef struct
 {
     action_type_t type;
@@ -55,13 +84,32 @@ typedef struct
             char order_id[64];
             char message[256];
         } completed;
+        struct
+        {
+            char order_id[64];
+            int dose_count;
+            planned_dose_t doses[MAX_PLAN_DOSES];
+        } plan;
     } data;
 } device_action_t;
 
 bool ask_server_for_action(device_action_t *action);
 
-// Function to report progress on a dose being poured at `POST /api/devices/progress`
-bool report_progress(const char *order_id, const char *dose_id, float weight_progress, bool *should_continue, char *message, size_t message_size);
+// Largest number of samples sent in one progress batch
+#define MAX_PROGRESS_SAMPLES 16
+
+typedef struct
+{
+    uint32_t t_ms; // Since the start of the dose
+    float weight_progress;
+} progress_sample_t;
+
+// Function to report the samples measured since the last report at `POST /api/devices/progress/batch`, oldest first
+bool report_progress_batch(const char *order_id, const char *dose_id, const progress_sample_t *samples, int count,
+                           bool *should_continue, char *message, size_t message_size);
+
+// Function to report the final progress of a dose from a plan at `POST /api/devices/complete/dose`
+bool report_dose_complete(const char *order_id, const char *dose_id, float weight_progress, bool *should_continue);
 
 // Function to report an error during order processing at `POST /api/devices/error`
 bool report_error(const char *order_id, error_code_t error_code, const char *message);
@@ -69,4 +117,8 @@ bool report_error(const char *order_id, error_code_t error_code, const char *mes
 // Function to cancel an in-progress order at `POST /api/devices/cancel/order`
 bool cancel_order(const char *order_id);
 
+// Replay outbox events in order at `POST /api/devices/reports`, `acked_seq` is the last one the server has applied.
+// `status_code` is the HTTP status of the last answer, 0 if the server was not reached.
+bool send_report_batch(uint32_t epoch, const outbox_event_t *events, int count, uint32_t *acked_seq, int *status_code);
+
 #endif // API_H
@@ -0,0 +1,60 @@
+#include <string.h>
+
+#include "flow_estimator.h"
+
+// Below this the slope is mostly noise
+#define FLOW_MIN_SAMPLES 5
+
+void flow_estimator_reset(flow_estimator_t *estimator, int64_t start_us)
+{
+    memset(estimator, 0, sizeof(flow_estimator_t));
+    estimator->start_us = start_us;
+}
+
+void flow_estimator_add(flow_estimator_t *estimator, int64_t timestamp_us, float weight)
+{
+    estimator->t[estimator->next] = (float)(timestamp_us - estimator->start_us) / 1e6f;
+    estimator->w[estimator->next] = weight;
+    estimator->next = (estimator->next + 1) % FLOW_WINDOW_SIZE;
+    if (estimator->count < FLOW_WINDOW_SIZE)
+    {
+        estimator->count++;
+    }
+}
+
+bool flow_estimator_fit(const flow_estimator_t *estimator, int64_t at_us, float *rate, float *weight)
+{
+    int n = estimator->count;
+    if (n < FLOW_MIN_SAMPLES)
+    {
+        return false;
+    }
+
+    // Center on the means to keep the float sums well conditioned
+    float mean_t = 0, mean_w = 0;
+    for (int i = 0; i < n; i++)
+    {
+        mean_t += estimator->t[i];
+        mean_w += estimator->w[i];
+    }
+    mean_t /= n;
+    mean_w /= n;
+
+    float stt = 0, stw = 0;
+    for (int i = 0; i < n; i++)
+    {
+        float dt = estimator->t[i] - mean_t;
+        stt += dt * dt;
+        stw += dt * (estimator->w[i] - mean_w);
+    }
+    if (stt <= 0)
+    {
+        return false;
+    }
+
+    float slope = stw / stt;
+    float at = (float)(at_us - estimator->start_us) / 1e6f;
+    *rate = slope;
+    *weight = mean_w + slope * (at - mean_t);
+    return true;
+}
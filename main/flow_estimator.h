@@ -0,0 +1,27 @@
+#ifndef FLOW_ESTIMATOR_H
+#define FLOW_ESTIMATOR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// About 1.5 s of conversions at the HX711 10 Hz rate
+#define FLOW_WINDOW_SIZE 16
+
+// Sliding window least squares fit of weight against time while a pump is running
+typedef struct
+{
+    float t[FLOW_WINDOW_SIZE]; // seconds since start_us
+    float w[FLOW_WINDOW_SIZE]; // grams
+    int count;
+    int next;
+    int64_t start_us;
+} flow_estimator_t;
+
+void flow_estimator_reset(flow_estimator_t *estimator, int64_t start_us);
+
+void flow_estimator_add(flow_estimator_t *estimator, int64_t timestamp_us, float weight);
+
+// Flow rate in g/s and fitted weight at `at_us`, false until the window holds enough samples
+bool flow_estimator_fit(const flow_estimator_t *estimator, int64_t at_us, float *rate, float *weight);
+
+#endif // FLOW_ESTIMATOR_H
@@ -0,0 +1,260 @@
+#include <string.h>
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+
+#include "journal.h"
+
+static const char *TAG = "journal";
+
+#define JOURNAL_MAGIC 0xA55A
+#define JOURNAL_MAX_CHECKPOINTS 600 // A 5 minute pour at one checkpoint every 500 ms
+
+typedef enum
+{
+    RECORD_DOSE_START = 1,
+    RECORD_CHECKPOINT = 2,
+    RECORD_DOSE_END = 3,
+} record_type_t;
+
+// Records are a header and a payload padded to 4 bytes, erased flash (0xFF) marks the end
+typedef struct
+{
+    uint16_t magic;
+    uint8_t type;
+    uint8_t length; // Payload length before padding
+    uint32_t crc;   // Of the header with crc at 0, then the payload
+} record_header_t;
+
+typedef struct
+{
+    char order_id[64];
+    char dose_id[64];
+    int32_t pump_gpio;
+    float target_weight;
+    float initial_progress;
+    int32_t tare_raw;
+} dose_start_record_t;
+
+// Room for the longest dose, otherwise the journal is erased when it starts
+#define RECORD_SIZE(payload) (sizeof(record_header_t) + (((payload) + 3) & ~3))
+#define JOURNAL_MIN_FREE \
+    (RECORD_SIZE(sizeof(dose_start_record_t)) + JOURNAL_MAX_CHECKPOINTS * RECORD_SIZE(sizeof(float)) + RECORD_SIZE(0))
+
+static const esp_partition_t *partition = NULL;
+static size_t write_offset = 0;
+static bool checkpoints_dropped = false;
+
+static journal_dose_t interrupted;
+static bool has_interrupted = false;
+
+static uint32_t record_crc(record_header_t header, const void *payload)
+{
+    header.crc = 0;
+    uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *)&header, sizeof(header));
+    return esp_rom_crc32_le(crc, payload, header.length);
+}
+
+// False if the record does not fit with `reserve` bytes left after it
+static bool append_record(record_type_t type, const void *payload, uint8_t length, size_t reserve)
+{
+    if (!partition)
+    {
+        return true;
+    }
+
+    size_t padded = (length + 3) & ~3;
+    if (write_offset + sizeof(record_header_t) + padded + reserve > partition->size)
+    {
+        return false;
+    }
+
+    uint8_t record[sizeof(record_header_t) + sizeof(dose_start_record_t)] = {0};
+    record_header_t header = {.magic = JOURNAL_MAGIC, .type = type, .length = length};
+    header.crc = record_crc(header, payload);
+    memcpy(record, &header, sizeof(header));
+    if (length > 0)
+    {
+        memcpy(record + sizeof(header), payload, length);
+    }
+
+    // A write cut by a power loss leaves a record with a bad CRC, the scan stops there.
+    // Programming a few bytes of erased flash holds the cache for tens of microseconds, unlike a sector erase.
+    esp_err_t err = esp_partition_write(partition, write_offset, record, sizeof(header) + padded);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to write journal record: %s", esp_err_to_name(err));
+        return true;
+    }
+    write_offset += sizeof(header) + padded;
+    return true;
+}
+
+static void erase_journal()
+{
+    esp_err_t err = esp_partition_erase_range(partition, 0, partition->size);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to erase journal: %s", esp_err_to_name(err));
+    }
+    write_offset = 0;
+}
+
+// Replay the records of the previous boot, a dose started and not ended was interrupted.
+// False if the journal does not end on erased flash, after a torn record.
+static bool scan_journal()
+{
+    size_t offset = 0;
+    bool in_dose = false;
+    bool blank_end = false;
+
+    while (offset + sizeof(record_header_t) <= partition->size)
+    {
+        record_header_t header;
+        dose_start_record_t payload;
+
+        if (esp_partition_read(partition, offset, &header, sizeof(header)) != ESP_OK ||
+            header.magic != JOURNAL_MAGIC || header.length > sizeof(payload) ||
+            offset + sizeof(header) + header.length > partition->size ||
+            esp_partition_read(partition, offset + sizeof(header), &payload, header.length) != ESP_OK ||
+            header.crc != record_crc(header, &payload))
+        {
+            // End of the journal, or a record torn by the reboot
+            blank_end = header.magic == 0xFFFF && header.type == 0xFF && header.length == 0xFF;
+            break;
+        }
+
+        switch (header.type)
+        {
+        case RECORD_DOSE_START:
+            if (header.length == sizeof(dose_start_record_t))
+            {
+                memset(&interrupted, 0, sizeof(interrupted));
+                memcpy(interrupted.order_id, payload.order_id, sizeof(interrupted.order_id) - 1);
+                memcpy(interrupted.dose_id, payload.dose_id, sizeof(interrupted.dose_id) - 1);
+                interrupted.pump_gpio = payload.pump_gpio;
+                interrupted.target_weight = payload.target_weight;
+                interrupted.initial_progress = payload.initial_progress;
+                interrupted.tare_raw = payload.tare_raw;
+                interrupted.progress = payload.initial_progress;
+                in_dose = true;
+            }
+            break;
+        case RECORD_CHECKPOINT:
+            if (in_dose && header.length == sizeof(float))
+            {
+                memcpy(&interrupted.progress, &payload, sizeof(float));
+            }
+            break;
+        case RECORD_DOSE_END:
+            in_dose = false;
+            break;
+        }
+
+        offset += sizeof(header) + ((header.length + 3) & ~3);
+    }
+
+    has_interrupted = in_dose;
+    write_offset = offset;
+    return blank_end || offset + sizeof(record_header_t) > partition->size;
+}
+
+bool journal_init()
+{
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_UNDEFINED, "journal");
+    if (!partition)
+    {
+        ESP_LOGW(TAG, "No journal partition, pours will not resume after a reboot");
+        return false;
+    }
+
+    bool clean = scan_journal();
+    if (has_interrupted)
+    {
+        ESP_LOGW(TAG, "Dose %s of order %s was interrupted at %.2fg/%.2fg", interrupted.dose_id, interrupted.order_id,
+                 interrupted.progress, interrupted.target_weight);
+    }
+
+    // Start over, with the interrupted dose first so it survives another reboot before it resumes
+    if (write_offset > 0 || !clean)
+    {
+        erase_journal();
+    }
+    if (has_interrupted)
+    {
+        journal_dose_start(&interrupted);
+        journal_checkpoint(interrupted.progress);
+    }
+    return true;
+}
+
+bool journal_interrupted(journal_dose_t *dose)
+{
+    if (has_interrupted)
+    {
+        *dose = interrupted;
+    }
+    return has_interrupted;
+}
+
+bool journal_take_interrupted(const char *order_id, const char *dose_id, journal_dose_t *dose)
+{
+    if (!has_interrupted)
+    {
+        return false;
+    }
+
+    // Whatever the server asks now, the interrupted dose is not going to be resumed later
+    has_interrupted = false;
+    if (strcmp(interrupted.order_id, order_id) != 0 || strcmp(interrupted.dose_id, dose_id) != 0)
+    {
+        ESP_LOGI(TAG, "Interrupted dose %s not resumed, server asked for %s", interrupted.dose_id, dose_id);
+        return false;
+    }
+
+    *dose = interrupted;
+    return true;
+}
+
+void journal_dose_start(const journal_dose_t *dose)
+{
+    if (!partition)
+    {
+        return;
+    }
+
+    // Erasing takes a few sectors worth of time, done before the pump starts rather than during the pour
+    if (partition->size - write_offset < JOURNAL_MIN_FREE)
+    {
+        erase_journal();
+    }
+    checkpoints_dropped = false;
+
+    dose_start_record_t record = {0};
+    strncpy(record.order_id, dose->order_id, sizeof(record.order_id) - 1);
+    strncpy(record.dose_id, dose->dose_id, sizeof(record.dose_id) - 1);
+    record.pump_gpio = dose->pump_gpio;
+    record.target_weight = dose->target_weight;
+    record.initial_progress = dose->initial_progress;
+    record.tare_raw = dose->tare_raw;
+    append_record(RECORD_DOSE_START, &record, sizeof(record), RECORD_SIZE(0));
+}
+
+void journal_checkpoint(float progress)
+{
+    // The end of the dose always keeps its room, a resume then starts from an older checkpoint
+    if (!append_record(RECORD_CHECKPOINT, &progress, sizeof(progress), RECORD_SIZE(0)) && !checkpoints_dropped)
+    {
+        ESP_LOGW(TAG, "Journal full, no more checkpoints for this dose");
+        checkpoints_dropped = true;
+    }
+}
+
+void journal_dose_end()
+{
+    // Only reached if the dose started on a full journal: nothing in it is worth keeping once the dose is over
+    if (!append_record(RECORD_DOSE_END, NULL, 0, 0))
+    {
+        erase_journal();
+    }
+}
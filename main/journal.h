@@ -0,0 +1,33 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Dose in flight, as written to the `journal` partition when the pump starts
+typedef struct
+{
+    char order_id[64];
+    char dose_id[64];
+    int32_t pump_gpio;
+    float target_weight;
+    float initial_progress; // Progress at the tare, in grams
+    int32_t tare_raw;       // HX711 reading of the glass before the pump started
+    float progress;         // Last checkpoint, `initial_progress` if none
+} journal_dose_t;
+
+// Scan the journal left by the previous boot, then start a fresh one
+bool journal_init();
+
+// Dose interrupted by a reboot, kept until a pour claims it or another dose starts
+bool journal_interrupted(journal_dose_t *dose);
+
+// Hand over the interrupted dose if it is this one, so it resumes against the original tare
+bool journal_take_interrupted(const char *order_id, const char *dose_id, journal_dose_t *dose);
+
+// Append-only records of the dose being poured, no-ops without a journal partition
+void journal_dose_start(const journal_dose_t *dose);
+void journal_checkpoint(float progress);
+void journal_dose_end();
+
+#endif // JOURNAL_H
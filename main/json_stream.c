@@ -0,0 +1,464 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "json_stream.h"
+
+#define JSON_NUMBER_MAX_LENGTH 32
+#define JSON_MAX_DEPTH 16
+
+static void put_raw(json_writer_t *writer, const char *text, size_t length)
+{
+    // Keep one byte for the terminating NUL
+    if (writer->overflow || writer->length + length >= writer->size)
+    {
+        writer->overflow = true;
+        return;
+    }
+    memcpy(writer->buffer + writer->length, text, length);
+    writer->length += length;
+}
+
+static void put_char(json_writer_t *writer, char c)
+{
+    put_raw(writer, &c, 1);
+}
+
+static void put_escaped(json_writer_t *writer, const char *text)
+{
+    put_char(writer, '"');
+    for (const char *p = text; *p; p++)
+    {
+        unsigned char c = (unsigned char)*p;
+        switch (c)
+        {
+        case '"':
+            put_raw(writer, "\\\"", 2);
+            break;
+        case '\\':
+            put_raw(writer, "\\\\", 2);
+            break;
+        case '\n':
+            put_raw(writer, "\\n", 2);
+            break;
+        case '\r':
+            put_raw(writer, "\\r", 2);
+            break;
+        case '\t':
+            put_raw(writer, "\\t", 2);
+            break;
+        default:
+            if (c < 0x20)
+            {
+                char escaped[7];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                put_raw(writer, escaped, 6);
+            }
+            else
+            {
+                put_char(writer, (char)c);
+            }
+            break;
+        }
+    }
+    put_char(writer, '"');
+}
+
+// Separator and key in front of a new value
+static void put_key(json_writer_t *writer, const char *key)
+{
+    if (writer->need_comma)
+    {
+        put_char(writer, ',');
+    }
+    if (key)
+    {
+        put_escaped(writer, key);
+        put_char(writer, ':');
+    }
+    writer->need_comma = true;
+}
+
+void json_writer_init(json_writer_t *writer, char *buffer, size_t size)
+{
+    writer->buffer = buffer;
+    writer->size = size;
+    writer->length = 0;
+    writer->need_comma = false;
+    writer->overflow = size == 0;
+}
+
+void json_write_object_begin(json_writer_t *writer, const char *key)
+{
+    put_key(writer, key);
+    put_char(writer, '{');
+    writer->need_comma = false;
+}
+
+void json_write_object_end(json_writer_t *writer)
+{
+    put_char(writer, '}');
+    writer->need_comma = true;
+}
+
+void json_write_array_begin(json_writer_t *writer, const char *key)
+{
+    put_key(writer, key);
+    put_char(writer, '[');
+    writer->need_comma = false;
+}
+
+void json_write_array_end(json_writer_t *writer)
+{
+    put_char(writer, ']');
+    writer->need_comma = true;
+}
+
+void json_write_string(json_writer_t *writer, const char *key, const char *value)
+{
+    put_key(writer, key);
+    put_escaped(writer, value ? value : "");
+}
+
+void json_write_int(json_writer_t *writer, const char *key, long value)
+{
+    char number[JSON_NUMBER_MAX_LENGTH];
+    int length = snprintf(number, sizeof(number), "%ld", value);
+    put_key(writer, key);
+    put_raw(writer, number, length);
+}
+
+void json_write_float(json_writer_t *writer, const char *key, double value)
+{
+    char number[JSON_NUMBER_MAX_LENGTH];
+    int length = snprintf(number, sizeof(number), "%.7g", value);
+    put_key(writer, key);
+    // NaN and infinities are not JSON
+    if (strpbrk(number, "ni"))
+    {
+        put_raw(writer, "null", 4);
+    }
+    else
+    {
+        put_raw(writer, number, length);
+    }
+}
+
+void json_write_bool(json_writer_t *writer, const char *key, bool value)
+{
+    put_key(writer, key);
+    put_raw(writer, value ? "true" : "false", value ? 4 : 5);
+}
+
+bool json_writer_finish(json_writer_t *writer)
+{
+    if (writer->size > 0)
+    {
+        writer->buffer[writer->overflow ? 0 : writer->length] = '\0';
+    }
+    return !writer->overflow;
+}
+
+static void skip_whitespace(json_reader_t *reader)
+{
+    while (reader->pos < reader->end &&
+           (*reader->pos == ' ' || *reader->pos == '\t' || *reader->pos == '\n' || *reader->pos == '\r'))
+    {
+        reader->pos++;
+    }
+}
+
+// Next significant character, '\0' at the end of the input or after an error
+static char peek(json_reader_t *reader)
+{
+    skip_whitespace(reader);
+    return (!reader->error && reader->pos < reader->end) ? *reader->pos : '\0';
+}
+
+static bool fail(json_reader_t *reader)
+{
+    reader->error = true;
+    return false;
+}
+
+static bool expect(json_reader_t *reader, char c)
+{
+    if (peek(reader) != c)
+    {
+        return fail(reader);
+    }
+    reader->pos++;
+    return true;
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+// Append to a bounded output, dropping what does not fit
+static void append(char *value, size_t size, size_t *length, char c)
+{
+    if (value && *length + 1 < size)
+    {
+        value[(*length)++] = c;
+    }
+}
+
+// Decode a string token, `value` may be NULL to only skip it
+static bool read_string_token(json_reader_t *reader, char *value, size_t size)
+{
+    size_t length = 0;
+    if (!expect(reader, '"'))
+    {
+        return false;
+    }
+
+    while (reader->pos < reader->end && *reader->pos != '"')
+    {
+        char c = *reader->pos++;
+        if (c != '\\')
+        {
+            append(value, size, &length, c);
+            continue;
+        }
+        if (reader->pos >= reader->end)
+        {
+            return fail(reader);
+        }
+
+        char escape = *reader->pos++;
+        switch (escape)
+        {
+        case 'b':
+            append(value, size, &length, '\b');
+            break;
+        case 'f':
+            append(value, size, &length, '\f');
+            break;
+        case 'n':
+            append(value, size, &length, '\n');
+            break;
+        case 'r':
+            append(value, size, &length, '\r');
+            break;
+        case 't':
+            append(value, size, &length, '\t');
+            break;
+        case 'u':
+        {
+            if (reader->end - reader->pos < 4)
+            {
+                return fail(reader);
+            }
+            unsigned int code = 0;
+            for (int i = 0; i < 4; i++)
+            {
+                int digit = hex_value(*reader->pos++);
+                if (digit < 0)
+                {
+                    return fail(reader);
+                }
+                code = (code << 4) | digit;
+            }
+            // UTF-8 encode, surrogate pairs are not expected in API messages
+            if (code < 0x80)
+            {
+                append(value, size, &length, (char)code);
+            }
+            else if (code < 0x800)
+            {
+                append(value, size, &length, (char)(0xC0 | (code >> 6)));
+                append(value, size, &length, (char)(0x80 | (code & 0x3F)));
+            }
+            else
+            {
+                append(value, size, &length, (char)(0xE0 | (code >> 12)));
+                append(value, size, &length, (char)(0x80 | ((code >> 6) & 0x3F)));
+                append(value, size, &length, (char)(0x80 | (code & 0x3F)));
+            }
+            break;
+        }
+        default: // '"', '\\' and '/'
+            append(value, size, &length, escape);
+            break;
+        }
+    }
+
+    if (reader->pos >= reader->end)
+    {
+        return fail(reader);
+    }
+    reader->pos++; // Closing quote
+    if (value && size > 0)
+    {
+        value[length] = '\0';
+    }
+    return true;
+}
+
+void json_reader_init(json_reader_t *reader, const char *text, size_t length)
+{
+    reader->pos = text;
+    reader->end = text + length;
+    reader->error = text == NULL;
+}
+
+bool json_read_object_begin(json_reader_t *reader)
+{
+    return expect(reader, '{');
+}
+
+bool json_read_next_key(json_reader_t *reader, char *key, size_t key_size)
+{
+    char c = peek(reader);
+    if (c == '}')
+    {
+        reader->pos++;
+        return false;
+    }
+    if (c == ',')
+    {
+        reader->pos++;
+    }
+    return read_string_token(reader, key, key_size) && expect(reader, ':');
+}
+
+bool json_read_array_begin(json_reader_t *reader)
+{
+    return expect(reader, '[');
+}
+
+bool json_read_array_next(json_reader_t *reader)
+{
+    char c = peek(reader);
+    if (c == ']')
+    {
+        reader->pos++;
+        return false;
+    }
+    if (c == ',')
+    {
+        reader->pos++;
+    }
+    return !reader->error && peek(reader) != '\0';
+}
+
+bool json_read_string(json_reader_t *reader, char *value, size_t size)
+{
+    if (peek(reader) != '"')
+    {
+        json_skip_value(reader);
+        return false;
+    }
+    return read_string_token(reader, value, size);
+}
+
+bool json_read_number(json_reader_t *reader, double *value)
+{
+    char c = peek(reader);
+    if (c != '-' && (c < '0' || c > '9'))
+    {
+        json_skip_value(reader);
+        return false;
+    }
+
+    char number[JSON_NUMBER_MAX_LENGTH];
+    size_t length = 0;
+    while (reader->pos < reader->end && strchr("+-0123456789.eE", *reader->pos))
+    {
+        if (length + 1 >= sizeof(number))
+        {
+            return fail(reader);
+        }
+        number[length++] = *reader->pos++;
+    }
+    number[length] = '\0';
+
+    char *parsed_end;
+    *value = strtod(number, &parsed_end);
+    if (parsed_end != number + length)
+    {
+        return fail(reader);
+    }
+    return true;
+}
+
+bool json_read_bool(json_reader_t *reader, bool *value)
+{
+    char c = peek(reader);
+    if (c == 't' && reader->end - reader->pos >= 4 && strncmp(reader->pos, "true", 4) == 0)
+    {
+        reader->pos += 4;
+        *value = true;
+        return true;
+    }
+    if (c == 'f' && reader->end - reader->pos >= 5 && strncmp(reader->pos, "false", 5) == 0)
+    {
+        reader->pos += 5;
+        *value = false;
+        return true;
+    }
+    json_skip_value(reader);
+    return false;
+}
+
+bool json_skip_value(json_reader_t *reader)
+{
+    int depth = 0;
+
+    do
+    {
+        char c = peek(reader);
+        switch (c)
+        {
+        case '"':
+            if (!read_string_token(reader, NULL, 0))
+            {
+                return false;
+            }
+            break;
+        case '{':
+        case '[':
+            if (++depth > JSON_MAX_DEPTH)
+            {
+                return fail(reader);
+            }
+            reader->pos++;
+            break;
+        case '}':
+        case ']':
+            if (--depth < 0)
+            {
+                return fail(reader);
+            }
+            reader->pos++;
+            break;
+        case ',':
+        case ':':
+            if (depth == 0)
+            {
+                return fail(reader);
+            }
+            reader->pos++;
+            break;
+        case '\0':
+            return fail(reader);
+        default:
+            // Scalar: number, true, false or null
+            while (reader->pos < reader->end && !strchr(",:]} \t\r\n", *reader->pos))
+            {
+                reader->pos++;
+            }
+            break;
+        }
+    } while (depth > 0);
+
+    return true;
+}
@@ -0,0 +1,59 @@
+#ifndef JSON_STREAM_H
+#define JSON_STREAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Allocation-free JSON for the device API hot path: the writer fills a caller buffer,
+// the reader walks the text once and copies values straight into the caller's structs.
+
+typedef struct
+{
+    char *buffer;
+    size_t size;
+    size_t length;
+    bool need_comma;
+    bool overflow; // Output truncated, the message must not be sent
+} json_writer_t;
+
+void json_writer_init(json_writer_t *writer, char *buffer, size_t size);
+
+// `key` is NULL for the root object and for array elements
+void json_write_object_begin(json_writer_t *writer, const char *key);
+void json_write_object_end(json_writer_t *writer);
+void json_write_array_begin(json_writer_t *writer, const char *key);
+void json_write_array_end(json_writer_t *writer);
+void json_write_string(json_writer_t *writer, const char *key, const char *value);
+void json_write_int(json_writer_t *writer, const char *key, long value);
+void json_write_float(json_writer_t *writer, const char *key, double value);
+void json_write_bool(json_writer_t *writer, const char *key, bool value);
+
+// NUL-terminates the buffer, false if the message did not fit
+bool json_writer_finish(json_writer_t *writer);
+
+typedef struct
+{
+    const char *pos;
+    const char *end;
+    bool error; // Malformed input, every following read fails
+} json_reader_t;
+
+void json_reader_init(json_reader_t *reader, const char *text, size_t length);
+
+bool json_read_object_begin(json_reader_t *reader);
+
+// Read the next key of the current object, false once its closing brace is consumed or on error
+bool json_read_next_key(json_reader_t *reader, char *key, size_t key_size);
+
+bool json_read_array_begin(json_reader_t *reader);
+
+// True if another element follows, false once the closing bracket is consumed or on error
+bool json_read_array_next(json_reader_t *reader);
+
+// Values: false (and the value skipped) on a type mismatch, strings are truncated to `size`
+bool json_read_string(json_reader_t *reader, char *value, size_t size);
+bool json_read_number(json_reader_t *reader, double *value);
+bool json_read_bool(json_reader_t *reader, bool *value);
+bool json_skip_value(json_reader_t *reader);
+
+#endif // JSON_STREAM_H
@@ -6,7 +6,10 @@
 #include "esp_event.h"
 #include "esp_netif.h"
 #include "esp_http_client.h"
+#include "esp_timer.h"
 #include "lwip/ip4_addr.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
 
 // local files
 #include "storage.h"
@@ -17,9 +20,91 @@
 #include "ota.h"
 #include "weight_scale.h"
 #include "action.h"
+#include "request_arena.h"
+#include "outbox.h"
+#include "journal.h"
+#include "power.h"
 
 static const char *TAG = "autobar3";
 
+// The scale comes up on the core of the sampling task while this one connects
+#define SCALE_INIT_TASK_CORE 1
+#define SCALE_INIT_TASK_STACK_SIZE 4096
+#define SCALE_WARMUP_TOLERANCE_G 0.5f
+#define SCALE_WARMUP_MAX_MS 2000
+
+#define BOOT_SCALE_READY_BIT BIT0
+
+// Durations of the boot phases, in esp_timer microseconds
+typedef struct
+{
+    int64_t nvs_us;
+    int64_t scale_init_us;   // HX711 setup, on the other core
+    int64_t scale_warmup_us; // First stable measure, on the other core
+    int64_t manifest_us;     // Includes the TLS handshake the verify call reuses
+    int64_t scale_wait_us;   // Left waiting for the scale once connected
+    int64_t verify_us;
+} boot_phases_t;
+
+static boot_phases_t boot_phases;
+static EventGroupHandle_t boot_events;
+static bool scale_init_success = false;
+
+// Where the time from power-on to the first answered order poll goes
+static void log_boot_timing(void)
+{
+    wifi_timing_t wifi;
+    wifi_get_timing(&wifi);
+    ESP_LOGI(TAG, "Boot timing: Wi-Fi start at %lld ms, associated +%lld ms (%s), IP +%lld ms, first poll at %lld ms",
+             wifi.start_us / 1000, (wifi.connected_us - wifi.start_us) / 1000, wifi.fast ? "fast connect" : "scan",
+             (wifi.got_ip_us - wifi.connected_us) / 1000, esp_timer_get_time() / 1000);
+    ESP_LOGI(TAG, "Boot phases: NVS %lld ms, scale init %lld ms + warm-up %lld ms, manifest %lld ms, scale wait %lld ms, verify %lld ms",
+             boot_phases.nvs_us / 1000, boot_phases.scale_init_us / 1000, boot_phases.scale_warmup_us / 1000,
+             boot_phases.manifest_us / 1000, boot_phases.scale_wait_us / 1000, boot_phases.verify_us / 1000);
+}
+
+// HX711 setup and a first stable measure, so the filter has settled by the time verify and calibration need it
+static void scale_init_task(void *arg)
+{
+    int64_t start_us = esp_timer_get_time();
+    scale_init_success = weight_interface_init();
+    boot_phases.scale_init_us = esp_timer_get_time() - start_us;
+
+    if (scale_init_success)
+    {
+        float measure;
+        int32_t raw_measure;
+        start_us = esp_timer_get_time();
+        measure_weight_until_stable(SCALE_WARMUP_TOLERANCE_G, SCALE_WARMUP_MAX_MS, &measure, &raw_measure, NULL);
+        boot_phases.scale_warmup_us = esp_timer_get_time() - start_us;
+    }
+
+    xEventGroupSetBits(boot_events, BOOT_SCALE_READY_BIT);
+    vTaskDelete(NULL);
+}
+
+// Serve the configuration portal until the stored network and settings work again, the Wi-Fi
+// supervisor keeps retrying meanwhile. Saving the portal form restarts the device instead
+static void run_config_portal(void)
+{
+    ESP_LOGI(TAG, "Starting configuration portal...");
+    start_config_portal();
+
+    // Main loop - wait for configuration or for the stored network to come back
+    char server_url[MAX_URL_LEN] = {0};
+    char api_token[MAX_TOKEN_LEN] = {0};
+    while (1)
+    {
+        if (wifi_link_up() && get_stored_server_url(server_url) && get_stored_api_token(api_token))
+        {
+            ESP_LOGI(TAG, "Stored network reachable again, leaving the configuration portal");
+            stop_config_portal();
+            return;
+        }
+        vTaskDelay(pdMS_TO_TICKS(1000));
+    }
+}
+
 void app_main(void)
 {
     // Configuration variables
@@ -27,7 +112,29 @@ void app_main(void)
     char api_token[MAX_TOKEN_LEN] = {0};
 
     // Initialize NVS
+    int64_t phase_us = esp_timer_get_time();
     initialize_nvs();
+    boot_phases.nvs_us = esp_timer_get_time() - phase_us;
+
+    // Everything below overlaps with the scale setup until verify, the first call that needs it
+    boot_events = xEventGroupCreate();
+    if (xTaskCreatePinnedToCore(scale_init_task, "scale_init", SCALE_INIT_TASK_STACK_SIZE, NULL, tskIDLE_PRIORITY + 1, NULL,
+                                SCALE_INIT_TASK_CORE) != pdPASS)
+    {
+        ESP_LOGE(TAG, "Failed to start the scale init task, initializing in place");
+        scale_init_success = weight_interface_init();
+        xEventGroupSetBits(boot_events, BOOT_SCALE_READY_BIT);
+    }
+
+    power_init();
+    outbox_init(); // Reports spilled before a reboot are replayed once the server is reachable
+
+    // A pour cut by a reboot: tell the server how far it went, the dose resumes when it is sent again
+    journal_dose_t interrupted;
+    if (journal_init() && journal_interrupted(&interrupted))
+    {
+        outbox_add_progress(interrupted.order_id, interrupted.dose_id, interrupted.progress);
+    }
 
     // Check if we have all required configuration
     bool has_api_config = (get_stored_server_url(server_url) && get_stored_api_token(api_token));
@@ -54,54 +161,77 @@ void app_main(void)
         ESP_LOGI(TAG, "Missing server and token parameters");
     }
 
-    // Start configuration portal if we don't have config or WiFi failed
+    // Start configuration portal if we don't have config or the WiFi credentials are wrong.
+    // A known network that is down is waited for by wifi_connect_success
     if (!has_api_config || !wifi_connected)
     {
-        ESP_LOGI(TAG, "Starting configuration portal...");
-        start_config_portal();
-
-        // Main loop - wait for configuration
-        while (1)
-        {
-            vTaskDelay(pdMS_TO_TICKS(1000));
-        }
+        run_config_portal();
     }
-    // If we're here, we're connected to WiFi
+    // If we're here, we're connected to WiFi, the supervisor keeps it that way
+
+    // The manifest is a static file, it needs neither the scale nor a verified device. Fetched while the
+    // scale settles, it pays the TLS handshake and verify follows over the same kept-alive connection
+    firmware_manifest_t boot_manifest;
+    phase_us = esp_timer_get_time();
+    bool has_boot_manifest = fetch_manifest(&boot_manifest);
+    boot_phases.manifest_us = esp_timer_get_time() - phase_us;
 
     // This boolean holds if weight scale init went well, we share this value
     // to the server in verify_device
-    bool success_weight_scale_init = weight_interface_init();
+    phase_us = esp_timer_get_time();
+    xEventGroupWaitBits(boot_events, BOOT_SCALE_READY_BIT, pdFALSE, pdTRUE, portMAX_DELAY);
+    boot_phases.scale_wait_us = esp_timer_get_time() - phase_us;
+    bool success_weight_scale_init = scale_init_success;
     bool server_needs_calibration = false;
 
     // Main loop - start from device verification
+    bool first_poll = true;
     TickType_t last_verify_time = 0;
     const TickType_t verify_interval = pdMS_TO_TICKS(5 * 60 * 1000); // 5 minutes
 
     while (1)
     {
         ESP_LOGI(TAG, "Verifying device and reporting firmware version...");
-        if (verify_device(!success_weight_scale_init, &server_needs_calibration))
+        phase_us = esp_timer_get_time();
+        bool verified = verify_device(!success_weight_scale_init, &server_needs_calibration);
+        if (first_poll)
+        {
+            boot_phases.verify_us = esp_timer_get_time() - phase_us;
+        }
+
+        if (verified)
         {
             ESP_LOGI(TAG, "Device verified successfully");
             last_verify_time = xTaskGetTickCount();
 
-            // Verify if the firmware version matches with the server
-            ESP_LOGI(TAG, "Fetching manifest...");
-            char manifest_version[64] = {0};
-            if (fetch_manifest(manifest_version, sizeof(manifest_version)))
+            // Verify if the firmware version matches with the server, the first time with the manifest of the boot
+            firmware_manifest_t manifest;
+            bool has_manifest = has_boot_manifest;
+            if (has_boot_manifest)
+            {
+                manifest = boot_manifest;
+                has_boot_manifest = false;
+            }
+            else
+            {
+                ESP_LOGI(TAG, "Fetching manifest...");
+                has_manifest = fetch_manifest(&manifest);
+            }
+
+            if (has_manifest)
             {
                 ESP_LOGI(TAG, "Current firmware version: %s", FIRMWARE_VERSION);
-                ESP_LOGI(TAG, "Available firmware version: %s", manifest_version);
+                ESP_LOGI(TAG, "Available firmware version: %s", manifest.version);
 
-                if (strcmp(FIRMWARE_VERSION, manifest_version) == 0)
+                if (strcmp(FIRMWARE_VERSION, manifest.version) == 0)
                 {
                     ESP_LOGI(TAG, "Firmware is up to date");
                 }
                 else
                 {
                     ESP_LOGI(TAG, "Firmware update available");
-                    do_firmware_upgrade();
-                    // Here the device will reboot
+                    // Orders keep being served while it downloads, the reboot waits for an idle point
+                    ota_start_update(&manifest);
                 }
             }
             else
@@ -118,7 +248,10 @@ void app_main(void)
                     vTaskDelay(pdMS_TO_TICKS(100));
                 }
                 ESP_LOGI(TAG, "Weight scale is calibrated");
-            } else {
+            }
+            else if (!first_poll || !success_weight_scale_init)
+            {
+                // At boot the scale was just initialized and warmed up, a new init would drop its samples
                 weight_interface_init();
             }
 
@@ -126,25 +259,76 @@ void app_main(void)
             while (1)
             {
                 device_action_t action;
-                
+
+                // The server decides the next action from the reported progress, it must have all of it
+                outbox_flush_result_t flushed = outbox_flush();
+                if (flushed == OUTBOX_UNAUTHORIZED)
+                {
+                    ESP_LOGE(TAG, "Reports refused with this token, re-verifying device...");
+                    break;
+                }
+                if (flushed == OUTBOX_PENDING)
+                {
+                    ESP_LOGE(TAG, "Pending reports not delivered");
+                    if (wifi_credentials_invalid())
+                    {
+                        run_config_portal();
+                        break;
+                    }
+                    if ((xTaskGetTickCount() - last_verify_time) >= verify_interval)
+                    {
+                        break; // The outbox is replayed again once verified
+                    }
+                    vTaskDelay(pdMS_TO_TICKS(5000)); // Wait 5 seconds before retrying
+                    continue;
+                }
+
                 if (ask_server_for_action(&action))
                 {
+                    if (first_poll)
+                    {
+                        log_boot_timing();
+                        first_poll = false;
+                    }
+
                     // Check if we need to re-verify instead of handling standby
                     if (action.type == ACTION_STANDBY)
                     {
+                        // No order in progress and every report delivered, a downloaded update can boot
+                        ota_reboot_if_ready();
+
                         TickType_t current_time = xTaskGetTickCount();
                         if ((current_time - last_verify_time) >= verify_interval)
                         {
                             ESP_LOGI(TAG, "5 minutes elapsed, re-verifying device...");
+                            request_arena_log_stats();
                             break; // Break out of action loop to restart from verify_device
                         }
                     }
-                    
+
+                    // Full speed and an awake radio only while a pump may run
+                    bool pouring = action.type == ACTION_PUMP || action.type == ACTION_PLAN;
+                    if (pouring)
+                    {
+                        power_set_mode(POWER_MODE_POURING);
+                    }
+
                     // Handle the action normally
                     if (!handle_action(&action))
                     {
                         ESP_LOGE(TAG, "Failed to handle action");
                     }
+
+                    if (pouring)
+                    {
+                        power_set_mode(POWER_MODE_IDLE);
+                    }
+                }
+                else if (wifi_credentials_invalid())
+                {
+                    ESP_LOGE(TAG, "WiFi credentials refused by the access point");
+                    run_config_portal();
+                    break; // Verify again once the network is back
                 }
                 else
                 {
@@ -153,14 +337,16 @@ void app_main(void)
                 }
             }
         }
+        else if (!wifi_credentials_invalid() && get_stored_api_token(api_token))
+        {
+            // The server kept the token, it or the link could not be reached: no reason to reconfigure
+            ESP_LOGE(TAG, "Device verification failed, retrying in 10 seconds");
+            vTaskDelay(pdMS_TO_TICKS(10000));
+        }
         else
         {
             ESP_LOGE(TAG, "Device verification failed - needs re-enrollment");
-            start_config_portal();
-            while (1)
-            {
-                vTaskDelay(pdMS_TO_TICKS(1000));
-            }
+            run_config_portal();
         }
     }
 }
@@ -5,24 +5,381 @@
 #include "esp_event.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/event_groups.h"
 #include "esp_http_client.h"
+#include "esp_system.h"
+#include "rom/miniz.h"
+#include "esp_delta_ota.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "version.h"
 #include "storage.h"
+#include "ota.h"
 
 static const char *TAG = "ota";
 extern const uint8_t server_cert_pem_start[] asm("_binary_server_cert_pem_start");
 
+#define FLASH_SECTOR_SIZE 4096
+#define OTA_BLOCK_SIZE (64 * 1024)    // Image bytes per compressed block, a download resumes at a block boundary
+#define OTA_MAX_STALLED_ATTEMPTS 3    // Downloads in a row that did not move the resume point before giving up
+#define OTA_RETRY_DELAY_MS 5000
+
+// The update runs behind the orders: the download and the flash writes are two tasks below the main one,
+// sharing two chunks so the network and the SPI flash work at the same time
+#define OTA_TASK_STACK_SIZE 8192    // TLS handshake happens in this task
+#define OTA_WRITER_STACK_SIZE 6144  // Inflate and patching happen in this task
+#define OTA_TASK_PRIORITY tskIDLE_PRIORITY
+#define OTA_CHUNK_SIZE 4096
+#define OTA_CHUNK_COUNT 2
+#define OTA_MIN_FREE_HEAP (96 * 1024) // A second TLS session and the inflate window, next to the API ones
+
+#define OTA_WRITES_ALLOWED_BIT BIT0
+
+typedef enum {
+    OTA_IMAGE_RAW,
+    OTA_IMAGE_ZLIB_BLOCKS,
+    OTA_IMAGE_PATCH, // detools patch against the running partition
+} ota_image_format_t;
+
+static const char *format_names[] = {"raw", "zlib-blocks", "patch"};
+
+// Where a download stopped, stored in NVS after each block
+typedef struct {
+    uint8_t image_sha256[32]; // Of the image being downloaded, another build starts over
+    uint32_t format;
+    uint32_t partition_address;
+    uint32_t download_offset; // Range of the next request
+    uint32_t image_offset;    // Bytes already in flash, sector aligned
+} ota_checkpoint_t;
+
+// Streaming inflate of the compressed blocks, the window doubles as the output buffer written to flash.
+// Each block is a little endian 32 bits length and an independent zlib stream.
+typedef struct {
+    tinfl_decompressor decompressor;
+    uint8_t window[TINFL_LZ_DICT_SIZE];
+    size_t window_pos;
+    uint8_t header[4];
+    size_t header_len;      // Bytes of the block length received
+    size_t block_remaining; // Compressed bytes of the current block not received yet
+    bool block_done;        // The stream ended, the next byte starts a new block
+} ota_inflate_t;
+
+typedef struct {
+    size_t length;
+    uint8_t data[OTA_CHUNK_SIZE];
+} ota_chunk_t;
+
 // Structure for streaming OTA context
 typedef struct {
-    esp_ota_handle_t ota_handle;
+    const firmware_manifest_t *manifest;
+    ota_image_format_t format;
     const esp_partition_t *update_partition;
+    int status_code;
+    esp_err_t error;              // First write failure, the rest of the download is ignored
+    size_t content_length;
     size_t total_size;
-    size_t written;
-    bool ota_started;
+    size_t written;               // Bytes of the download received, resumed ones included
+    size_t consumed;              // Bytes of the download handled by the writer
+    ota_chunk_t *filling;         // Chunk the download is copying into
+    size_t image_written;         // Bytes written to flash, after inflate or patching
+    size_t erased_until;
+    size_t resume_offset;         // Image offset the download resumed from
+    size_t checkpoint_offset;     // Image offset of the last checkpoint
+    ota_inflate_t *inflate;       // Only for compressed blocks
+    esp_delta_ota_handle_t delta; // Only for a patch
 } streaming_ota_t;
 
-// New streaming event handler that writes directly to flash
+// Patches copy most of the new image from the one running, read back from flash
+static const esp_partition_t *delta_source = NULL;
+
+static streaming_ota_t update_ctx;
+static firmware_manifest_t update_manifest;
+static atomic_bool update_running = false;
+static atomic_bool update_ready = false; // The boot partition was switched, the reboot waits for an idle point
+
+static EventGroupHandle_t ota_flags = NULL;
+static QueueHandle_t filled_chunks = NULL; // Downloaded, in order, NULL ends the writer task
+static QueueHandle_t free_chunks = NULL;
+static ota_chunk_t *chunks = NULL;
+static TaskHandle_t update_task = NULL;
+
+static void ota_store_checkpoint(streaming_ota_t *ota_ctx, size_t download_offset, size_t image_offset)
+{
+    if (!ota_ctx->manifest->has_ota_sha256 || image_offset <= ota_ctx->checkpoint_offset) {
+        return;
+    }
+
+    ota_checkpoint_t checkpoint = {
+        .format = ota_ctx->format,
+        .partition_address = ota_ctx->update_partition->address,
+        .download_offset = download_offset,
+        .image_offset = image_offset,
+    };
+    memcpy(checkpoint.image_sha256, ota_ctx->manifest->ota_sha256, sizeof(checkpoint.image_sha256));
+    store_ota_checkpoint(&checkpoint, sizeof(checkpoint));
+    ota_ctx->checkpoint_offset = image_offset;
+}
+
+static void ota_clear_checkpoint()
+{
+    ota_checkpoint_t checkpoint;
+    size_t size = sizeof(checkpoint);
+    if (get_stored_ota_checkpoint(&checkpoint, &size)) {
+        store_ota_checkpoint(NULL, 0);
+    }
+}
+
+// A full image download of this release was interrupted, its flash content is worth more than a patch
+static bool ota_has_checkpoint(const firmware_manifest_t *manifest)
+{
+    ota_checkpoint_t checkpoint;
+    size_t size = sizeof(checkpoint);
+    return manifest->has_ota_sha256 && get_stored_ota_checkpoint(&checkpoint, &size) && size == sizeof(checkpoint) &&
+           checkpoint.format != OTA_IMAGE_PATCH &&
+           memcmp(checkpoint.image_sha256, manifest->ota_sha256, sizeof(checkpoint.image_sha256)) == 0;
+}
+
+// Pick up a previous download of the same image into the same partition
+static bool ota_load_checkpoint(streaming_ota_t *ota_ctx)
+{
+    ota_checkpoint_t checkpoint;
+    size_t size = sizeof(checkpoint);
+    if (!get_stored_ota_checkpoint(&checkpoint, &size)) {
+        return false;
+    }
+
+    if (size != sizeof(checkpoint) || !ota_ctx->manifest->has_ota_sha256 || ota_ctx->format == OTA_IMAGE_PATCH ||
+        memcmp(checkpoint.image_sha256, ota_ctx->manifest->ota_sha256, sizeof(checkpoint.image_sha256)) != 0 ||
+        checkpoint.format != ota_ctx->format || checkpoint.partition_address != ota_ctx->update_partition->address ||
+        checkpoint.image_offset % FLASH_SECTOR_SIZE != 0) {
+        ESP_LOGI(TAG, "Previous download is of another image, starting over");
+        store_ota_checkpoint(NULL, 0);
+        return false;
+    }
+
+    ota_ctx->written = checkpoint.download_offset;
+    ota_ctx->consumed = checkpoint.download_offset;
+    ota_ctx->image_written = checkpoint.image_offset;
+    ota_ctx->erased_until = checkpoint.image_offset;
+    ota_ctx->resume_offset = checkpoint.image_offset;
+    ota_ctx->checkpoint_offset = checkpoint.image_offset;
+    return true;
+}
+
+static void ota_inflate_reset(ota_inflate_t *inflate)
+{
+    inflate->window_pos = 0;
+    inflate->header_len = 0;
+    inflate->block_remaining = 0;
+    inflate->block_done = true;
+}
+
+// The server ignored the Range, the whole image comes again
+static void ota_restart(streaming_ota_t *ota_ctx)
+{
+    ESP_LOGW(TAG, "Server cannot resume the download, starting over");
+    ota_ctx->written = 0;
+    ota_ctx->consumed = 0;
+    ota_ctx->image_written = 0;
+    ota_ctx->erased_until = 0;
+    ota_ctx->checkpoint_offset = 0;
+    if (ota_ctx->inflate) {
+        ota_inflate_reset(ota_ctx->inflate);
+    }
+}
+
+static esp_err_t ota_write_image(streaming_ota_t *ota_ctx, const void *data, size_t length)
+{
+    const esp_partition_t *partition = ota_ctx->update_partition;
+    size_t end = ota_ctx->image_written + length;
+
+    if (ota_ctx->image_written == 0 && ((const uint8_t *)data)[0] != ESP_IMAGE_HEADER_MAGIC) {
+        ESP_LOGE(TAG, "Not a firmware image");
+        return ESP_ERR_OTA_VALIDATE_FAILED;
+    }
+    if (end > partition->size) {
+        ESP_LOGE(TAG, "Image larger than the %d bytes partition", partition->size);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    // Sectors are erased as the image reaches them, flash past a checkpoint may hold an earlier attempt
+    if (end > ota_ctx->erased_until) {
+        size_t erase_end = (end + FLASH_SECTOR_SIZE - 1) & ~(FLASH_SECTOR_SIZE - 1);
+        esp_err_t err = esp_partition_erase_range(partition, ota_ctx->erased_until, erase_end - ota_ctx->erased_until);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Flash erase failed: %s", esp_err_to_name(err));
+            return err;
+        }
+        ota_ctx->erased_until = erase_end;
+    }
+
+    esp_err_t err = esp_partition_write(partition, ota_ctx->image_written, data, length);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Flash write failed: %s", esp_err_to_name(err));
+        return err;
+    }
+    ota_ctx->image_written = end;
+    return ESP_OK;
+}
+
+static esp_err_t ota_write_raw(streaming_ota_t *ota_ctx, const uint8_t *data, size_t length)
+{
+    esp_err_t err = ota_write_image(ota_ctx, data, length);
+    if (err == ESP_OK) {
+        // The download and the image are the same bytes
+        size_t offset = ota_ctx->image_written & ~(OTA_BLOCK_SIZE - 1);
+        ota_store_checkpoint(ota_ctx, offset, offset);
+    }
+    return err;
+}
+
+// Inflate a chunk of the download, flushing the window to flash whenever it fills
+static esp_err_t ota_inflate_chunk(streaming_ota_t *ota_ctx, const uint8_t *data, size_t length)
+{
+    ota_inflate_t *inflate = ota_ctx->inflate;
+    const uint8_t *start = data;
+
+    while (true) {
+        // Block length first, it may be split across chunks
+        if (inflate->block_done) {
+            while (inflate->header_len < sizeof(inflate->header) && length > 0) {
+                inflate->header[inflate->header_len++] = *data++;
+                length--;
+            }
+            if (inflate->header_len < sizeof(inflate->header)) {
+                break;
+            }
+            inflate->block_remaining = inflate->header[0] | inflate->header[1] << 8 | inflate->header[2] << 16 |
+                                       (size_t)inflate->header[3] << 24;
+            inflate->header_len = 0;
+            inflate->block_done = false;
+            tinfl_init(&inflate->decompressor);
+        }
+
+        // Never hand tinfl bytes of the next block, it could read ahead into them
+        size_t in_bytes = length < inflate->block_remaining ? length : inflate->block_remaining;
+        size_t out_bytes = TINFL_LZ_DICT_SIZE - inflate->window_pos;
+        tinfl_status status = tinfl_decompress(&inflate->decompressor, data, &in_bytes, inflate->window,
+                                               inflate->window + inflate->window_pos, &out_bytes,
+                                               TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_HAS_MORE_INPUT);
+        data += in_bytes;
+        length -= in_bytes;
+        inflate->block_remaining -= in_bytes;
+
+        if (out_bytes > 0) {
+            esp_err_t err = ota_write_image(ota_ctx, inflate->window + inflate->window_pos, out_bytes);
+            if (err != ESP_OK) {
+                return err;
+            }
+            inflate->window_pos = (inflate->window_pos + out_bytes) & (TINFL_LZ_DICT_SIZE - 1);
+        }
+
+        if (status == TINFL_STATUS_DONE) {
+            if (inflate->block_remaining != 0) {
+                ESP_LOGE(TAG, "Compressed block ends %d bytes early", inflate->block_remaining);
+                return ESP_FAIL;
+            }
+            inflate->block_done = true;
+            ota_store_checkpoint(ota_ctx, ota_ctx->consumed + (data - start), ota_ctx->image_written);
+        } else if (status < TINFL_STATUS_DONE || (status == TINFL_STATUS_NEEDS_MORE_INPUT && inflate->block_remaining == 0)) {
+            ESP_LOGE(TAG, "Corrupted compressed image (inflate status %d)", status);
+            return ESP_FAIL;
+        } else if (status == TINFL_STATUS_NEEDS_MORE_INPUT) {
+            break;
+        }
+        // TINFL_STATUS_HAS_MORE_OUTPUT: the window was full, go on flushing it
+    }
+    return ESP_OK;
+}
+
+static esp_err_t delta_read_source(uint8_t *buf, size_t size, int src_offset)
+{
+    return esp_partition_read(delta_source, src_offset, buf, size);
+}
+
+static esp_err_t delta_write_image(const uint8_t *buf, size_t size, void *user_data)
+{
+    return ota_write_image((streaming_ota_t *)user_data, buf, size);
+}
+
+static esp_err_t ota_process_chunk(streaming_ota_t *ota_ctx, const uint8_t *data, size_t length)
+{
+    esp_err_t err;
+    if (ota_ctx->inflate) {
+        err = ota_inflate_chunk(ota_ctx, data, length);
+    } else if (ota_ctx->delta) {
+        err = esp_delta_ota_feed_patch(ota_ctx->delta, data, length);
+    } else {
+        err = ota_write_raw(ota_ctx, data, length);
+    }
+    ota_ctx->consumed += length;
+    return err;
+}
+
+static void ota_writer_task(void *param)
+{
+    streaming_ota_t *ota_ctx = param;
+    ota_chunk_t *chunk;
+
+    while (xQueueReceive(filled_chunks, &chunk, portMAX_DELAY) == pdTRUE && chunk) {
+        // Flash erases and writes stall both cores, they wait for the pour to be over
+        xEventGroupWaitBits(ota_flags, OTA_WRITES_ALLOWED_BIT, pdFALSE, pdTRUE, portMAX_DELAY);
+        if (ota_ctx->error == ESP_OK) {
+            ota_ctx->error = ota_process_chunk(ota_ctx, chunk->data, chunk->length);
+        }
+        xQueueSend(free_chunks, &chunk, portMAX_DELAY);
+    }
+
+    xTaskNotifyGive(update_task);
+    vTaskDelete(NULL);
+}
+
+// Copy downloaded bytes into the free chunk, handing it to the writer once full
+static void ota_queue_data(streaming_ota_t *ota_ctx, const uint8_t *data, size_t length)
+{
+    while (length > 0) {
+        if (!ota_ctx->filling) {
+            xQueueReceive(free_chunks, &ota_ctx->filling, portMAX_DELAY);
+            ota_ctx->filling->length = 0;
+        }
+
+        size_t copied = OTA_CHUNK_SIZE - ota_ctx->filling->length;
+        if (copied > length) {
+            copied = length;
+        }
+        memcpy(ota_ctx->filling->data + ota_ctx->filling->length, data, copied);
+        ota_ctx->filling->length += copied;
+        data += copied;
+        length -= copied;
+
+        if (ota_ctx->filling->length == OTA_CHUNK_SIZE) {
+            xQueueSend(filled_chunks, &ota_ctx->filling, portMAX_DELAY);
+            ota_ctx->filling = NULL;
+        }
+    }
+}
+
+// Wait for the writer to be done with everything downloaded, the partial chunk included
+static void ota_drain(streaming_ota_t *ota_ctx)
+{
+    if (ota_ctx->filling) {
+        xQueueSend(ota_ctx->filling->length > 0 ? filled_chunks : free_chunks, &ota_ctx->filling, portMAX_DELAY);
+        ota_ctx->filling = NULL;
+    }
+
+    ota_chunk_t *drained[OTA_CHUNK_COUNT];
+    for (int i = 0; i < OTA_CHUNK_COUNT; i++) {
+        xQueueReceive(free_chunks, &drained[i], portMAX_DELAY);
+    }
+    for (int i = 0; i < OTA_CHUNK_COUNT; i++) {
+        xQueueSend(free_chunks, &drained[i], portMAX_DELAY);
+    }
+}
+
+// New streaming event handler that hands the download to the flash writer
 static esp_err_t streaming_ota_handler(esp_http_client_event_t *evt)
 {
     streaming_ota_t *ota_ctx = (streaming_ota_t *)evt->user_data;
@@ -33,43 +390,35 @@ static esp_err_t streaming_ota_handler(esp_http_client_event_t *evt)
         break;
     case HTTP_EVENT_ON_HEADER:
         if (strcasecmp(evt->header_key, "Content-Length") == 0) {
-            ota_ctx->total_size = atoi(evt->header_value);
-            ESP_LOGI(TAG, "Firmware size: %d bytes", ota_ctx->total_size);
+            ota_ctx->content_length = atoi(evt->header_value);
         }
         break;
     case HTTP_EVENT_ON_DATA:
         if (evt->data_len) {
-            // Initialize OTA on first data chunk
-            if (!ota_ctx->ota_started) {
-                ota_ctx->update_partition = esp_ota_get_next_update_partition(NULL);
-                if (!ota_ctx->update_partition) {
-                    ESP_LOGE(TAG, "No OTA update partition found");
-                    return ESP_FAIL;
-                }
-
-                esp_err_t err = esp_ota_begin(ota_ctx->update_partition, ota_ctx->total_size, &ota_ctx->ota_handle);
-                if (err != ESP_OK) {
-                    ESP_LOGE(TAG, "esp_ota_begin failed: %s", esp_err_to_name(err));
-                    return ESP_FAIL;
+            // The status is known with the first chunk, the body of an error page is not an image
+            if (ota_ctx->status_code == 0) {
+                ota_ctx->status_code = esp_http_client_get_status_code(evt->client);
+                if (ota_ctx->status_code == 200 && ota_ctx->written > 0) {
+                    ota_restart(ota_ctx);
                 }
-                ota_ctx->ota_started = true;
-                ESP_LOGI(TAG, "OTA started, writing to partition at offset 0x%lx", ota_ctx->update_partition->address);
+                ota_ctx->total_size = ota_ctx->written + ota_ctx->content_length;
+                ESP_LOGI(TAG, "Firmware size: %d bytes, from %d", ota_ctx->total_size, ota_ctx->written);
             }
-
-            // Write data directly to flash
-            esp_err_t err = esp_ota_write(ota_ctx->ota_handle, evt->data, evt->data_len);
-            if (err != ESP_OK) {
-                ESP_LOGE(TAG, "esp_ota_write failed: %s", esp_err_to_name(err));
-                return ESP_FAIL;
+            if ((ota_ctx->status_code != 200 && ota_ctx->status_code != 206) || ota_ctx->error != ESP_OK) {
+                break;
             }
 
+            // Blocks only while the writer is busy with both chunks
+            ota_queue_data(ota_ctx, evt->data, evt->data_len);
+
+            size_t previous = ota_ctx->written;
             ota_ctx->written += evt->data_len;
 
             // Log progress every 64KB
-            if (ota_ctx->written % (64 * 1024) == 0 || ota_ctx->written == ota_ctx->total_size) {
+            if (previous / (64 * 1024) != ota_ctx->written / (64 * 1024) || ota_ctx->written == ota_ctx->total_size) {
                 float progress = (float)ota_ctx->written * 100.0 / ota_ctx->total_size;
-                ESP_LOGI(TAG, "Downloaded and written: %d/%d bytes (%.1f%%)", 
-                         ota_ctx->written, ota_ctx->total_size, progress);
+                ESP_LOGI(TAG, "Downloaded: %d/%d bytes (%.1f%%), written: %d bytes",
+                         ota_ctx->written, ota_ctx->total_size, progress, ota_ctx->image_written);
             }
         }
         break;
@@ -79,22 +428,83 @@ static esp_err_t streaming_ota_handler(esp_http_client_event_t *evt)
     return ESP_OK;
 }
 
+// The patch only rebuilds the new image from the exact image it was made against
+static bool patch_applies(const firmware_manifest_t *manifest)
+{
+    uint8_t sha256[32];
+    delta_source = esp_ota_get_running_partition();
+    esp_err_t err = esp_partition_get_sha256(delta_source, sha256);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to hash the running image: %s", esp_err_to_name(err));
+        return false;
+    }
+    if (memcmp(sha256, manifest->patch_base_sha256, sizeof(sha256)) != 0) {
+        ESP_LOGW(TAG, "Running image differs from the %s release, patch skipped", FIRMWARE_VERSION);
+        return false;
+    }
+    return true;
+}
 
-esp_err_t do_firmware_upgrade()
+// esp_partition_get_sha256 checks the image against the hash appended to it, which the manifest also lists
+static esp_err_t verify_image(streaming_ota_t *ota_ctx)
+{
+    uint8_t sha256[32];
+    esp_err_t err = esp_partition_get_sha256(ota_ctx->update_partition, sha256);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Downloaded image is corrupted: %s", esp_err_to_name(err));
+        return ESP_ERR_OTA_VALIDATE_FAILED;
+    }
+    if (ota_ctx->manifest->has_ota_sha256 && memcmp(sha256, ota_ctx->manifest->ota_sha256, sizeof(sha256)) != 0) {
+        ESP_LOGE(TAG, "Downloaded image is not version %s", ota_ctx->manifest->version);
+        return ESP_ERR_OTA_VALIDATE_FAILED;
+    }
+    return ESP_OK;
+}
+
+// Download an image into the next OTA partition, complete and verified when this returns ESP_OK.
+// Compressed and raw images resume from the checkpoint stored by a previous attempt.
+static esp_err_t download_image(const char *server_url, const firmware_manifest_t *manifest, const char *path,
+                                ota_image_format_t format, streaming_ota_t *ota_ctx)
 {
-    char server_url[MAX_URL_LEN] = {0};
     char firmware_url[MAX_URL_LEN + 64] = {0};
 
-    if (!get_stored_server_url(server_url)) {
-        ESP_LOGE(TAG, "Missing server URL");
+    snprintf(firmware_url, sizeof(firmware_url), "%s/firmware/%s", server_url, path);
+    ESP_LOGI(TAG, "Will attempt OTA update at URL: %s (%s)", firmware_url, format_names[format]);
+
+    memset(ota_ctx, 0, sizeof(streaming_ota_t));
+    ota_ctx->manifest = manifest;
+    ota_ctx->format = format;
+    ota_ctx->update_partition = esp_ota_get_next_update_partition(NULL);
+    if (!ota_ctx->update_partition) {
+        ESP_LOGE(TAG, "No OTA update partition found");
         return ESP_FAIL;
     }
+    ESP_LOGI(TAG, "Writing to partition at offset 0x%lx", ota_ctx->update_partition->address);
 
-    snprintf(firmware_url, sizeof(firmware_url), "%s/firmware/autobar3.bin", server_url);
-    ESP_LOGI(TAG, "Will attempt OTA update at URL: %s", firmware_url);
+    if (!ota_load_checkpoint(ota_ctx)) {
+        ota_clear_checkpoint();
+    }
 
-    streaming_ota_t ota_ctx = {0};
-    esp_err_t err = ESP_OK;
+    // About 43KB of heap, only while updating
+    if (format == OTA_IMAGE_ZLIB_BLOCKS) {
+        ota_ctx->inflate = malloc(sizeof(ota_inflate_t));
+        if (!ota_ctx->inflate) {
+            ESP_LOGE(TAG, "Not enough memory to inflate the image");
+            return ESP_ERR_NO_MEM;
+        }
+        ota_inflate_reset(ota_ctx->inflate);
+    } else if (format == OTA_IMAGE_PATCH) {
+        esp_delta_ota_cfg_t delta_config = {
+            .user_data = ota_ctx,
+            .read_cb = delta_read_source,
+            .write_cb = delta_write_image,
+        };
+        ota_ctx->delta = esp_delta_ota_init(&delta_config);
+        if (!ota_ctx->delta) {
+            ESP_LOGE(TAG, "Failed to start patching");
+            return ESP_ERR_NO_MEM;
+        }
+    }
 
     esp_http_client_config_t config = {
         .url = firmware_url,
@@ -104,51 +514,204 @@ esp_err_t do_firmware_upgrade()
         .timeout_ms = 30000,
         .keep_alive_enable = true,
         .event_handler = streaming_ota_handler,
-        .user_data = &ota_ctx
+        .user_data = ota_ctx
     };
 
     esp_http_client_handle_t client = esp_http_client_init(&config);
-    err = esp_http_client_perform(client);
-    
+    if (ota_ctx->written > 0) {
+        char range[32];
+        snprintf(range, sizeof(range), "bytes=%d-", ota_ctx->written);
+        esp_http_client_set_header(client, "Range", range);
+        ESP_LOGI(TAG, "Resuming download at %d bytes, image at %d bytes", ota_ctx->written, ota_ctx->image_written);
+    }
+    esp_err_t err = esp_http_client_perform(client);
+    ota_drain(ota_ctx);
+
     if (err == ESP_OK) {
         int status_code = esp_http_client_get_status_code(client);
         ESP_LOGI(TAG, "Firmware download HTTP Status: %d", status_code);
-        
-        if (status_code != 200) {
+
+        if (status_code != 200 && status_code != 206) {
             ESP_LOGE(TAG, "Firmware download failed with status: %d", status_code);
             err = ESP_FAIL;
-        } else if (ota_ctx.ota_started) {
-            ESP_LOGI(TAG, "Firmware download completed: %d bytes", ota_ctx.written);
-            
-            // Finish OTA
-            err = esp_ota_end(ota_ctx.ota_handle);
-            if (err != ESP_OK) {
-                ESP_LOGE(TAG, "esp_ota_end failed: %s", esp_err_to_name(err));
-            } else {
-                err = esp_ota_set_boot_partition(ota_ctx.update_partition);
-                if (err != ESP_OK) {
-                    ESP_LOGE(TAG, "esp_ota_set_boot_partition failed: %s", esp_err_to_name(err));
-                } else {
-                    ESP_LOGI(TAG, "OTA upgrade successful. Rebooting...");
-                    esp_http_client_cleanup(client);
-                    vTaskDelay(pdMS_TO_TICKS(1000));
-                    esp_restart();
-                }
-            }
+        } else if (ota_ctx->error != ESP_OK) {
+            err = ota_ctx->error;
+        } else if (ota_ctx->inflate && !ota_ctx->inflate->block_done) {
+            ESP_LOGE(TAG, "Compressed image truncated after %d bytes", ota_ctx->written);
+            err = ESP_FAIL;
+        } else if (ota_ctx->delta && (err = esp_delta_ota_finalize(ota_ctx->delta)) != ESP_OK) {
+            ESP_LOGE(TAG, "Patch incomplete after %d bytes: %s", ota_ctx->written, esp_err_to_name(err));
+        } else if (ota_ctx->image_written > 0) {
+            ESP_LOGI(TAG, "Firmware download completed: %d bytes, image %d bytes", ota_ctx->written, ota_ctx->image_written);
+
+            // Whatever the outcome, the next attempt starts over
+            err = verify_image(ota_ctx);
+            ota_clear_checkpoint();
         } else {
             ESP_LOGE(TAG, "OTA never started - no data received");
             err = ESP_FAIL;
         }
     } else {
-        ESP_LOGE(TAG, "Firmware download failed: %s", esp_err_to_name(err));
+        ESP_LOGE(TAG, "Firmware download failed after %d bytes: %s", ota_ctx->written, esp_err_to_name(err));
     }
 
-    // Cleanup on error
-    if (ota_ctx.ota_started) {
-        esp_ota_abort(ota_ctx.ota_handle);
-    }
     esp_http_client_cleanup(client);
-    
-    ESP_LOGE(TAG, "OTA upgrade failed: %s", esp_err_to_name(err));
+    free(ota_ctx->inflate);
+    if (ota_ctx->delta) {
+        esp_delta_ota_deinit(ota_ctx->delta);
+    }
     return err;
 }
+
+// Download and verify the update, then switch the boot partition to it
+static esp_err_t do_firmware_upgrade(const firmware_manifest_t *manifest)
+{
+    char server_url[MAX_URL_LEN] = {0};
+    esp_err_t err = ESP_FAIL;
+
+    if (!get_stored_server_url(server_url)) {
+        ESP_LOGE(TAG, "Missing server URL");
+        return ESP_FAIL;
+    }
+
+    // Tens of kilobytes instead of the whole image, the full image remains the fallback.
+    // The patch writes over the same partition, so an interrupted full download resumes instead.
+    if (manifest->has_patch && ota_has_checkpoint(manifest)) {
+        ESP_LOGI(TAG, "Resuming the full image download, patch skipped");
+    } else if (manifest->has_patch && patch_applies(manifest)) {
+        err = download_image(server_url, manifest, manifest->patch_path, OTA_IMAGE_PATCH, &update_ctx);
+        if (err != ESP_OK) {
+            ESP_LOGW(TAG, "Delta update failed, downloading the full image");
+            err = ESP_FAIL;
+        }
+    }
+
+    // A dropped connection resumes from the last block, give up once attempts stop getting further
+    ota_image_format_t format = manifest->ota_compressed ? OTA_IMAGE_ZLIB_BLOCKS : OTA_IMAGE_RAW;
+    int stalled_attempts = 0;
+    while (err != ESP_OK && err != ESP_ERR_OTA_VALIDATE_FAILED && stalled_attempts < OTA_MAX_STALLED_ATTEMPTS) {
+        if (stalled_attempts > 0) {
+            vTaskDelay(pdMS_TO_TICKS(OTA_RETRY_DELAY_MS));
+        }
+        err = download_image(server_url, manifest, manifest->ota_path, format, &update_ctx);
+        if (update_ctx.checkpoint_offset > update_ctx.resume_offset) {
+            stalled_attempts = 0;
+        } else {
+            stalled_attempts++;
+        }
+    }
+
+    if (err == ESP_OK) {
+        err = esp_ota_set_boot_partition(update_ctx.update_partition);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "esp_ota_set_boot_partition failed: %s", esp_err_to_name(err));
+        }
+    }
+    return err;
+}
+
+static void ota_update_task(void *param)
+{
+    esp_err_t err = ESP_ERR_NO_MEM;
+
+    chunks = malloc(OTA_CHUNK_COUNT * sizeof(ota_chunk_t));
+    filled_chunks = xQueueCreate(OTA_CHUNK_COUNT + 1, sizeof(ota_chunk_t *));
+    free_chunks = xQueueCreate(OTA_CHUNK_COUNT, sizeof(ota_chunk_t *));
+    if (chunks && filled_chunks && free_chunks &&
+        xTaskCreate(ota_writer_task, "ota_writer", OTA_WRITER_STACK_SIZE, &update_ctx, OTA_TASK_PRIORITY, NULL) == pdPASS) {
+        for (int i = 0; i < OTA_CHUNK_COUNT; i++) {
+            ota_chunk_t *chunk = &chunks[i];
+            xQueueSend(free_chunks, &chunk, 0);
+        }
+
+        err = do_firmware_upgrade(&update_manifest);
+
+        // Stop the writer and wait for it before its queues go
+        ota_chunk_t *end = NULL;
+        xQueueSend(filled_chunks, &end, portMAX_DELAY);
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+
+    if (filled_chunks) {
+        vQueueDelete(filled_chunks);
+        filled_chunks = NULL;
+    }
+    if (free_chunks) {
+        vQueueDelete(free_chunks);
+        free_chunks = NULL;
+    }
+    free(chunks);
+    chunks = NULL;
+
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "Firmware %s ready, rebooting once no order is in progress", update_manifest.version);
+        atomic_store(&update_ready, true);
+    } else {
+        ESP_LOGE(TAG, "OTA upgrade failed: %s", esp_err_to_name(err));
+    }
+
+    update_task = NULL;
+    atomic_store(&update_running, false);
+    vTaskDelete(NULL);
+}
+
+static bool ota_flags_init()
+{
+    if (!ota_flags) {
+        ota_flags = xEventGroupCreate();
+        if (!ota_flags) {
+            return false;
+        }
+        xEventGroupSetBits(ota_flags, OTA_WRITES_ALLOWED_BIT);
+    }
+    return true;
+}
+
+bool ota_start_update(const firmware_manifest_t *manifest)
+{
+    if (atomic_load(&update_ready) || atomic_load(&update_running)) {
+        return true;
+    }
+
+    if (esp_get_free_heap_size() < OTA_MIN_FREE_HEAP) {
+        ESP_LOGW(TAG, "Only %lu bytes of heap, update postponed", esp_get_free_heap_size());
+        return false;
+    }
+
+    if (!ota_flags_init()) {
+        ESP_LOGE(TAG, "Failed to create OTA flags");
+        return false;
+    }
+
+    update_manifest = *manifest;
+    atomic_store(&update_running, true);
+    if (xTaskCreate(ota_update_task, "ota_update", OTA_TASK_STACK_SIZE, NULL, OTA_TASK_PRIORITY, &update_task) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to start OTA task");
+        atomic_store(&update_running, false);
+        return false;
+    }
+    ESP_LOGI(TAG, "Updating to %s in the background", manifest->version);
+    return true;
+}
+
+void ota_hold_flash_writes(bool hold)
+{
+    if (!ota_flags_init()) {
+        return;
+    }
+
+    if (hold) {
+        xEventGroupClearBits(ota_flags, OTA_WRITES_ALLOWED_BIT);
+    } else {
+        xEventGroupSetBits(ota_flags, OTA_WRITES_ALLOWED_BIT);
+    }
+}
+
+void ota_reboot_if_ready()
+{
+    if (atomic_load(&update_ready)) {
+        ESP_LOGI(TAG, "OTA upgrade successful. Rebooting...");
+        vTaskDelay(pdMS_TO_TICKS(1000));
+        esp_restart();
+    }
+}
@@ -3,8 +3,16 @@
 
 #include "esp_https_ota.h"
 #include <stdbool.h>
+#include "api.h"
 
-// Function to verify device with the server
-esp_err_t do_firmware_upgrade();
+// Download the image named in the manifest into the next OTA partition from a background task, and boot
+// from it at the next reboot. Returns at once, nothing is started while an update runs or waits for its reboot
+bool ota_start_update(const firmware_manifest_t *manifest);
+
+// Flash erases stall both cores, the update holds its writes while the pumps and the scale need them
+void ota_hold_flash_writes(bool hold);
+
+// Reboot into the downloaded firmware if there is one, only called with no order in progress
+void ota_reboot_if_ready();
 
 #endif // OTA_H
@@ -0,0 +1,204 @@
+#include <stddef.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_random.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+#include "api.h"
+#include "storage.h"
+#include "outbox.h"
+#include "retry_policy.h"
+
+static const char *TAG = "outbox";
+
+// Layout of the NVS spill, only the first `count` events are written
+typedef struct
+{
+    uint32_t epoch;
+    uint32_t next_seq;
+    uint32_t count;
+    outbox_event_t events[OUTBOX_CAPACITY];
+} outbox_t;
+
+static outbox_t outbox;
+static outbox_t sending; // Snapshot sent by outbox_flush, only the main task flushes
+static SemaphoreHandle_t outbox_lock = NULL;
+static bool spilled = false; // NVS holds events that may since have been acknowledged
+
+static size_t spill_size(const outbox_t *box)
+{
+    return offsetof(outbox_t, events) + box->count * sizeof(outbox_event_t);
+}
+
+bool outbox_init()
+{
+    outbox_lock = xSemaphoreCreateMutex();
+    if (!outbox_lock)
+    {
+        ESP_LOGE(TAG, "Failed to create outbox lock");
+        return false;
+    }
+
+    size_t size = sizeof(outbox);
+    if (get_stored_outbox(&outbox, &size) && size == spill_size(&outbox) && outbox.count <= OUTBOX_CAPACITY)
+    {
+        ESP_LOGI(TAG, "%lu reports spilled before reboot, epoch %08lx", outbox.count, outbox.epoch);
+        spilled = true;
+        return true;
+    }
+
+    // A fresh epoch per boot, the sequence does not need to survive reboots
+    memset(&outbox, 0, sizeof(outbox));
+    outbox.epoch = esp_random();
+    outbox.next_seq = 1;
+    return true;
+}
+
+// Caller holds the lock. Progress is absolute, so a newer value of the same dose replaces the
+// last queued one, as long as no other event was queued after it
+static outbox_event_t *append_event(outbox_event_type_t type, const char *order_id, const char *dose_id)
+{
+    if (type == OUTBOX_PROGRESS && outbox.count > 0)
+    {
+        outbox_event_t *last = &outbox.events[outbox.count - 1];
+        if (last->type == OUTBOX_PROGRESS && strcmp(last->order_id, order_id) == 0 &&
+            strcmp(last->data.progress.dose_id, dose_id) == 0)
+        {
+            last->seq = outbox.next_seq++;
+            return last;
+        }
+    }
+
+    if (outbox.count == OUTBOX_CAPACITY)
+    {
+        ESP_LOGE(TAG, "Outbox full, dropping report %lu", outbox.events[0].seq);
+        memmove(&outbox.events[0], &outbox.events[1], (OUTBOX_CAPACITY - 1) * sizeof(outbox_event_t));
+        outbox.count--;
+    }
+
+    outbox_event_t *event = &outbox.events[outbox.count++];
+    memset(event, 0, sizeof(outbox_event_t));
+    event->type = type;
+    event->seq = outbox.next_seq++;
+    strncpy(event->order_id, order_id, sizeof(event->order_id) - 1);
+    return event;
+}
+
+void outbox_add_progress(const char *order_id, const char *dose_id, float weight_progress)
+{
+    xSemaphoreTake(outbox_lock, portMAX_DELAY);
+    outbox_event_t *event = append_event(OUTBOX_PROGRESS, order_id, dose_id);
+    strncpy(event->data.progress.dose_id, dose_id, sizeof(event->data.progress.dose_id) - 1);
+    event->data.progress.weight_progress = weight_progress;
+    uint32_t seq = event->seq;
+    xSemaphoreGive(outbox_lock);
+
+    ESP_LOGI(TAG, "Queued progress %.2fg of dose %s (seq %lu)", weight_progress, dose_id, seq);
+}
+
+void outbox_add_error(const char *order_id, int error_code, const char *message)
+{
+    xSemaphoreTake(outbox_lock, portMAX_DELAY);
+    outbox_event_t *event = append_event(OUTBOX_ERROR, order_id, NULL);
+    event->data.error.error_code = error_code;
+    strncpy(event->data.error.message, message, sizeof(event->data.error.message) - 1);
+    uint32_t seq = event->seq;
+    xSemaphoreGive(outbox_lock);
+
+    ESP_LOGI(TAG, "Queued error %d of order %s (seq %lu)", error_code, order_id, seq);
+}
+
+void outbox_supersede_progress(const char *order_id, const char *dose_id)
+{
+    xSemaphoreTake(outbox_lock, portMAX_DELAY);
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < outbox.count; i++)
+    {
+        outbox_event_t *event = &outbox.events[i];
+        if (event->type == OUTBOX_PROGRESS && strcmp(event->order_id, order_id) == 0 &&
+            strcmp(event->data.progress.dose_id, dose_id) == 0)
+        {
+            continue;
+        }
+        if (kept != i)
+        {
+            outbox.events[kept] = *event;
+        }
+        kept++;
+    }
+    outbox.count = kept;
+    xSemaphoreGive(outbox_lock);
+}
+
+outbox_flush_result_t outbox_flush()
+{
+    xSemaphoreTake(outbox_lock, portMAX_DELAY);
+    memcpy(&sending, &outbox, spill_size(&outbox));
+    xSemaphoreGive(outbox_lock);
+
+    if (sending.count == 0)
+    {
+        if (spilled)
+        {
+            store_outbox(NULL, 0);
+            spilled = false;
+        }
+        return OUTBOX_FLUSHED;
+    }
+
+    ESP_LOGI(TAG, "Replaying %lu reports", sending.count);
+    uint32_t acked_seq = 0;
+    int status_code = 0;
+    bool sent = send_report_batch(sending.epoch, sending.events, sending.count, &acked_seq, &status_code);
+    bool unauthorized = !sent && status_code == 401;
+
+    // Not found or malformed: the same batch would be refused forever, it must not block the action loop
+    if (!sent && !unauthorized && retry_failure_from_status(status_code) == RETRY_FAILURE_CLIENT)
+    {
+        ESP_LOGE(TAG, "Server refused the reports (HTTP %d), dropping %lu", status_code, sending.count);
+        acked_seq = sending.events[sending.count - 1].seq;
+        sent = true;
+    }
+
+    // Events queued while sending stay, acknowledged ones go
+    xSemaphoreTake(outbox_lock, portMAX_DELAY);
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < outbox.count; i++)
+    {
+        if ((int32_t)(outbox.events[i].seq - acked_seq) <= 0 && acked_seq != 0)
+        {
+            continue;
+        }
+        if (kept != i)
+        {
+            outbox.events[kept] = outbox.events[i];
+        }
+        kept++;
+    }
+    outbox.count = kept;
+    bool empty = outbox.count == 0;
+
+    // Survive a reboot while the server is unreachable, flash is only written on failure
+    if (!sent && !empty)
+    {
+        store_outbox(&outbox, spill_size(&outbox));
+        spilled = true;
+    }
+    else if (empty && spilled)
+    {
+        store_outbox(NULL, 0);
+        spilled = false;
+    }
+    xSemaphoreGive(outbox_lock);
+
+    if (!sent)
+    {
+        ESP_LOGE(TAG, "Failed to replay reports, %lu pending", sending.count);
+    }
+    if (unauthorized)
+    {
+        return OUTBOX_UNAUTHORIZED;
+    }
+    return empty ? OUTBOX_FLUSHED : OUTBOX_PENDING;
+}
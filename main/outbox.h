@@ -0,0 +1,58 @@
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define OUTBOX_CAPACITY 8
+#define OUTBOX_MESSAGE_SIZE 192
+
+typedef enum
+{
+    OUTBOX_PROGRESS = 1,
+    OUTBOX_ERROR = 2,
+} outbox_event_type_t;
+
+// Report the server has not acknowledged yet, replayed in `seq` order
+typedef struct
+{
+    uint8_t type; // outbox_event_type_t
+    uint32_t seq; // With the epoch, the idempotency key of the event
+    char order_id[64];
+    union
+    {
+        struct
+        {
+            char dose_id[64];
+            float weight_progress;
+        } progress;
+        struct
+        {
+            int error_code; // error_code_t
+            char message[OUTBOX_MESSAGE_SIZE];
+        } error;
+    } data;
+} outbox_event_t;
+
+// Load the events spilled to NVS before a reboot, their epoch is kept so the server can skip the known ones
+bool outbox_init();
+
+// Never block on the network: queue the event for the next outbox_flush
+void outbox_add_progress(const char *order_id, const char *dose_id, float weight_progress);
+void outbox_add_error(const char *order_id, int error_code, const char *message);
+
+// A newer progress of this dose reached the server, the queued one would only move it backwards
+void outbox_supersede_progress(const char *order_id, const char *dose_id);
+
+typedef enum
+{
+    OUTBOX_FLUSHED,      // Nothing left to send
+    OUTBOX_PENDING,      // Server unreachable, events kept for the next flush
+    OUTBOX_UNAUTHORIZED, // Token refused, events kept until the device is verified again
+} outbox_flush_result_t;
+
+// Send the queued events as one batch. Events still pending after a failure are spilled to NVS,
+// a batch the server refuses (other 4xx) is dropped since a replay would be refused again.
+outbox_flush_result_t outbox_flush();
+
+#endif // OUTBOX_H
@@ -0,0 +1,80 @@
+#include "esp_log.h"
+#include "esp_pm.h"
+#include "esp_wifi.h"
+
+#include "power.h"
+
+static const char *TAG = "power";
+
+// The APB clock stays at 80 MHz from the lowest frequency up, peripherals and TLS do not slow to a crawl
+#define POWER_MIN_CPU_FREQ_MHZ 80
+#define POWER_MAX_CPU_FREQ_MHZ 240
+
+// Between polls every task is blocked, with tickless idle the chip sleeps until the next timer or packet
+#if CONFIG_FREERTOS_USE_TICKLESS_IDLE
+#define POWER_LIGHT_SLEEP true
+#else
+#define POWER_LIGHT_SLEEP false
+#endif
+
+static esp_pm_lock_handle_t pouring_lock = NULL;
+static power_mode_t current_mode = POWER_MODE_IDLE;
+
+bool power_init()
+{
+    esp_pm_config_t config = {
+        .max_freq_mhz = POWER_MAX_CPU_FREQ_MHZ,
+        .min_freq_mhz = POWER_MIN_CPU_FREQ_MHZ,
+        .light_sleep_enable = POWER_LIGHT_SLEEP,
+    };
+
+    esp_err_t err = esp_pm_configure(&config);
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Frequency scaling not available: %s", esp_err_to_name(err));
+        return false;
+    }
+
+    // Held during a pour, it also keeps the chip out of light sleep
+    err = esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "pouring", &pouring_lock);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to create the pouring lock: %s", esp_err_to_name(err));
+        pouring_lock = NULL;
+    }
+
+    ESP_LOGI(TAG, "CPU between %d and %d MHz, light sleep %s", POWER_MIN_CPU_FREQ_MHZ, POWER_MAX_CPU_FREQ_MHZ,
+             POWER_LIGHT_SLEEP ? "on" : "off");
+    return true;
+}
+
+void power_set_mode(power_mode_t mode)
+{
+    if (mode == current_mode)
+    {
+        return;
+    }
+    current_mode = mode;
+
+    // Modem sleep wakes the radio at each DTIM beacon, every progress report would wait for one
+    wifi_ps_type_t ps = mode == POWER_MODE_POURING ? WIFI_PS_NONE : WIFI_PS_MIN_MODEM;
+    esp_err_t err = esp_wifi_set_ps(ps);
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(TAG, "Failed to set Wi-Fi power save: %s", esp_err_to_name(err));
+    }
+
+    if (pouring_lock)
+    {
+        if (mode == POWER_MODE_POURING)
+        {
+            esp_pm_lock_acquire(pouring_lock);
+        }
+        else
+        {
+            esp_pm_lock_release(pouring_lock);
+        }
+    }
+
+    ESP_LOGI(TAG, "%s mode", mode == POWER_MODE_POURING ? "Pouring" : "Idle");
+}
@@ -0,0 +1,20 @@
+#ifndef POWER_H
+#define POWER_H
+
+#include <stdbool.h>
+
+typedef enum
+{
+    POWER_MODE_IDLE,    // Standby between polls: frequency scaling, modem sleep, light sleep if tickless idle is on
+    POWER_MODE_POURING, // A pump may run: CPU at its maximum frequency and the radio always awake
+} power_mode_t;
+
+// Configure frequency scaling, false if power management is not enabled in sdkconfig.
+// The device starts in POWER_MODE_IDLE
+bool power_init();
+
+// Called by the action loop around pump and plan actions: POURING before, IDLE once they return.
+// Setting the current mode again does nothing
+void power_set_mode(power_mode_t mode);
+
+#endif // POWER_H
@@ -0,0 +1,219 @@
+#include <stdatomic.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/event_groups.h"
+
+#include "api.h"
+#include "outbox.h"
+#include "progress_reporter.h"
+
+static const char *TAG = "progress";
+
+#define REPORTER_TASK_STACK_SIZE 8192 // TLS handshake happens in this task
+#define REPORTER_TASK_PRIORITY 5
+#define PROGRESS_BATCH_MS 1000 // Samples measured during this window share one request
+
+typedef struct
+{
+    char order_id[64];
+    char dose_id[64];
+    progress_sample_t sample;
+    unsigned int seq;
+    bool flush; // No sample, ends the current batch window early
+} progress_message_t;
+
+// Samples not sent yet, oldest first. When full the oldest is dropped: progress is cumulative
+static QueueHandle_t mailbox = NULL;
+static EventGroupHandle_t flags = NULL;
+static TaskHandle_t reporter_task = NULL;
+
+static char current_order_id[64];
+static char current_dose_id[64];
+static int64_t dose_start_us = 0;
+static atomic_uint published_seq = 0;
+static atomic_uint handled_seq = 0;
+static atomic_uint dose_start_seq = 0; // Messages below belong to a previous dose
+
+static void send_batch(const progress_message_t *last, const progress_sample_t *samples, int count)
+{
+    bool should_continue = false;
+    char server_message[256] = {0};
+    bool success = report_progress_batch(last->order_id, last->dose_id, samples, count,
+                                         &should_continue, server_message, sizeof(server_message));
+
+    // Undelivered progress is replayed later, a delivered one makes any queued value of the dose stale
+    if (success)
+    {
+        outbox_supersede_progress(last->order_id, last->dose_id);
+    }
+    else
+    {
+        outbox_add_progress(last->order_id, last->dose_id, last->sample.weight_progress);
+    }
+
+    // The control loop may have moved on to another dose while we were sending
+    if (last->seq > atomic_load(&dose_start_seq))
+    {
+        if (!success)
+        {
+            ESP_LOGW(TAG, "Failed to report progress to server, queued in the outbox");
+        }
+        else
+        {
+            if (strlen(server_message) > 0)
+            {
+                ESP_LOGI(TAG, "Server message: %s", server_message);
+            }
+            if (!should_continue)
+            {
+                ESP_LOGI(TAG, "Server responded with continue=false");
+                xEventGroupSetBits(flags, PROGRESS_STOP_BIT);
+            }
+        }
+    }
+    atomic_store(&handled_seq, last->seq);
+}
+
+static void progress_reporter_task(void *arg)
+{
+    static progress_message_t message;
+    static progress_message_t last;
+    progress_sample_t samples[MAX_PROGRESS_SAMPLES];
+    bool has_next = false; // `message` holds the first sample of the next batch
+
+    while (1)
+    {
+        if (!has_next && (xQueueReceive(mailbox, &message, portMAX_DELAY) != pdTRUE || message.flush))
+        {
+            continue;
+        }
+        has_next = false;
+
+        // Collect the samples of the same dose measured during the batch window
+        last = message;
+        samples[0] = message.sample;
+        int count = 1;
+        TickType_t window_end = xTaskGetTickCount() + pdMS_TO_TICKS(PROGRESS_BATCH_MS);
+        while (count < MAX_PROGRESS_SAMPLES)
+        {
+            TickType_t now = xTaskGetTickCount();
+            if ((int32_t)(window_end - now) <= 0 || xQueueReceive(mailbox, &message, window_end - now) != pdTRUE ||
+                message.flush)
+            {
+                break;
+            }
+            if (strcmp(message.order_id, last.order_id) != 0 || strcmp(message.dose_id, last.dose_id) != 0)
+            {
+                has_next = true;
+                break;
+            }
+            last = message;
+            samples[count++] = message.sample;
+        }
+
+        send_batch(&last, samples, count);
+    }
+}
+
+bool progress_reporter_begin(const char *order_id, const char *dose_id)
+{
+    if (!reporter_task)
+    {
+        // Kept across failed attempts, only the task is created again
+        if (!mailbox)
+        {
+            mailbox = xQueueCreate(MAX_PROGRESS_SAMPLES, sizeof(progress_message_t));
+        }
+        if (!flags)
+        {
+            flags = xEventGroupCreate();
+        }
+        if (!mailbox || !flags ||
+            xTaskCreate(progress_reporter_task, "progress_reporter", REPORTER_TASK_STACK_SIZE, NULL,
+                        REPORTER_TASK_PRIORITY, &reporter_task) != pdPASS)
+        {
+            ESP_LOGE(TAG, "Failed to start progress reporter task");
+            reporter_task = NULL;
+            return false;
+        }
+    }
+
+    strncpy(current_order_id, order_id, sizeof(current_order_id) - 1);
+    strncpy(current_dose_id, dose_id, sizeof(current_dose_id) - 1);
+    dose_start_us = esp_timer_get_time();
+    atomic_store(&dose_start_seq, atomic_load(&published_seq));
+    xQueueReset(mailbox);
+    xEventGroupClearBits(flags, PROGRESS_STOP_BIT);
+    return true;
+}
+
+// Only full while a request is slow, the oldest sample is the least useful one
+static void mailbox_push(const progress_message_t *message)
+{
+    if (xQueueSend(mailbox, message, 0) != pdTRUE)
+    {
+        progress_message_t dropped;
+        xQueueReceive(mailbox, &dropped, 0);
+        if (xQueueSend(mailbox, message, 0) != pdTRUE)
+        {
+            ESP_LOGW(TAG, "Progress mailbox full, %s dropped", message->flush ? "flush" : "sample");
+        }
+    }
+}
+
+void progress_reporter_publish(float weight_progress)
+{
+    progress_message_t message = {
+        .sample = {
+            .t_ms = (uint32_t)((esp_timer_get_time() - dose_start_us) / 1000),
+            .weight_progress = weight_progress},
+        .seq = atomic_fetch_add(&published_seq, 1) + 1};
+    strcpy(message.order_id, current_order_id);
+    strcpy(message.dose_id, current_dose_id);
+
+    mailbox_push(&message);
+}
+
+EventBits_t progress_reporter_poll(void)
+{
+    return flags ? xEventGroupGetBits(flags) : 0;
+}
+
+void progress_reporter_stop(const char *order_id, const char *dose_id)
+{
+    if (!flags || strcmp(order_id, current_order_id) != 0 ||
+        (dose_id && strcmp(dose_id, current_dose_id) != 0))
+    {
+        return;
+    }
+    ESP_LOGI(TAG, "Stop requested by the server");
+    xEventGroupSetBits(flags, PROGRESS_STOP_BIT);
+}
+
+bool progress_reporter_flush(unsigned int timeout_ms)
+{
+    TickType_t start = xTaskGetTickCount();
+    unsigned int target = atomic_load(&published_seq);
+
+    // Send what was collected so far without waiting for the end of the batch window
+    if ((int)(atomic_load(&handled_seq) - target) < 0)
+    {
+        progress_message_t marker = {.flush = true};
+        mailbox_push(&marker);
+    }
+
+    // Samples dropped from a full mailbox are skipped, so any handled seq past the target means it was sent
+    while ((int)(atomic_load(&handled_seq) - target) < 0)
+    {
+        if ((xTaskGetTickCount() - start) >= pdMS_TO_TICKS(timeout_ms))
+        {
+            return false;
+        }
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    return true;
+}
@@ -0,0 +1,27 @@
+#ifndef PROGRESS_REPORTER_H
+#define PROGRESS_REPORTER_H
+
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+
+// Event flags raised by the network task, polled by the pump control loop
+#define PROGRESS_STOP_BIT BIT0 // Server answered continue=false (dose complete or order cancelled)
+
+// Start reporting for a new dose, clears the flags of the previous one
+bool progress_reporter_begin(const char *order_id, const char *dose_id);
+
+// Never blocks: queues the sample, the network task sends the samples of each batch window in one request
+void progress_reporter_publish(float weight_progress);
+
+// Never blocks: current PROGRESS_*_BIT flags
+EventBits_t progress_reporter_poll(void);
+
+// Raise PROGRESS_STOP_BIT if the dose being poured belongs to `order_id` (and `dose_id` unless NULL),
+// for stops pushed by the server outside of a progress answer
+void progress_reporter_stop(const char *order_id, const char *dose_id);
+
+// Wait until the last published value was sent (or queued in the outbox), false on timeout
+bool progress_reporter_flush(unsigned int timeout_ms);
+
+#endif // PROGRESS_REPORTER_H
@@ -0,0 +1,199 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "cJSON.h"
+
+#include "request_arena.h"
+
+static const char *TAG = "request_arena";
+
+#define ARENA_ALIGN 8
+#define MAX_TRACKED_ENDPOINTS 12
+
+// Each block starts with its size so realloc knows how much to copy
+typedef struct
+{
+    size_t size;
+    size_t reserved; // Keeps the payload 8-byte aligned
+} block_header_t;
+
+typedef struct
+{
+    const char *endpoint;
+    size_t high_water;
+    unsigned int heap_fallbacks;
+} endpoint_stats_t;
+
+static uint8_t arena[REQUEST_ARENA_SIZE] __attribute__((aligned(ARENA_ALIGN)));
+static size_t arena_used = 0;
+static size_t arena_peak = 0; // High-water mark of the current scope
+static block_header_t *last_block = NULL; // Can grow in place
+static unsigned int heap_fallbacks = 0;
+static _Atomic(TaskHandle_t) owner = NULL;
+static bool hooks_installed = false;
+
+static endpoint_stats_t stats[MAX_TRACKED_ENDPOINTS];
+
+static bool in_arena(const void *ptr)
+{
+    return (const uint8_t *)ptr >= arena && (const uint8_t *)ptr < arena + REQUEST_ARENA_SIZE;
+}
+
+static bool owned_by_caller(void)
+{
+    return atomic_load(&owner) == xTaskGetCurrentTaskHandle();
+}
+
+static size_t align_up(size_t size)
+{
+    return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+void request_arena_begin(void)
+{
+    if (!hooks_installed)
+    {
+        cJSON_Hooks hooks = {
+            .malloc_fn = request_arena_malloc,
+            .free_fn = request_arena_free};
+        cJSON_InitHooks(&hooks);
+        hooks_installed = true;
+    }
+
+    // Nested or concurrent scopes keep using the heap
+    TaskHandle_t expected = NULL;
+    if (!atomic_compare_exchange_strong(&owner, &expected, xTaskGetCurrentTaskHandle()))
+    {
+        return;
+    }
+
+    arena_used = 0;
+    arena_peak = 0;
+    last_block = NULL;
+    heap_fallbacks = 0;
+}
+
+void request_arena_end(const char *endpoint)
+{
+    if (!owned_by_caller())
+    {
+        return;
+    }
+
+    for (int i = 0; i < MAX_TRACKED_ENDPOINTS; i++)
+    {
+        if (stats[i].endpoint && strcmp(stats[i].endpoint, endpoint) != 0)
+        {
+            continue;
+        }
+        if (!stats[i].endpoint)
+        {
+            stats[i].endpoint = endpoint;
+        }
+        if (arena_peak > stats[i].high_water)
+        {
+            stats[i].high_water = arena_peak;
+            ESP_LOGI(TAG, "New high-water mark for %s: %u/%u bytes", endpoint, arena_peak, REQUEST_ARENA_SIZE);
+        }
+        if (heap_fallbacks)
+        {
+            stats[i].heap_fallbacks += heap_fallbacks;
+            ESP_LOGI(TAG, "%u allocations for %s did not fit in the arena", heap_fallbacks, endpoint);
+        }
+        break;
+    }
+
+    // Everything allocated in the scope is gone at once
+    arena_used = 0;
+    last_block = NULL;
+    atomic_store(&owner, NULL);
+}
+
+void *request_arena_malloc(size_t size)
+{
+    if (owned_by_caller())
+    {
+        size_t needed = sizeof(block_header_t) + align_up(size);
+        if (arena_used + needed <= REQUEST_ARENA_SIZE)
+        {
+            block_header_t *block = (block_header_t *)(arena + arena_used);
+            block->size = size;
+            arena_used += needed;
+            arena_peak = arena_used > arena_peak ? arena_used : arena_peak;
+            last_block = block;
+            return block + 1;
+        }
+        heap_fallbacks++;
+    }
+    return malloc(size);
+}
+
+void *request_arena_realloc(void *ptr, size_t size)
+{
+    if (!ptr)
+    {
+        return request_arena_malloc(size);
+    }
+    if (!in_arena(ptr))
+    {
+        return realloc(ptr, size);
+    }
+
+    block_header_t *block = (block_header_t *)ptr - 1;
+
+    // The response buffer is usually the last block, grow it in place
+    if (block == last_block)
+    {
+        size_t start = (uint8_t *)ptr - arena;
+        if (start + align_up(size) <= REQUEST_ARENA_SIZE)
+        {
+            arena_used = start + align_up(size);
+            arena_peak = arena_used > arena_peak ? arena_used : arena_peak;
+            block->size = size;
+            return ptr;
+        }
+    }
+
+    void *moved = request_arena_malloc(size);
+    if (moved)
+    {
+        memcpy(moved, ptr, block->size < size ? block->size : size);
+    }
+    return moved;
+}
+
+void request_arena_free(void *ptr)
+{
+    if (!ptr)
+    {
+        return;
+    }
+    if (!in_arena(ptr))
+    {
+        free(ptr);
+        return;
+    }
+
+    // Other arena blocks are released with the scope, the last one can be given back now,
+    // which keeps failed attempts of a retried request from piling up
+    block_header_t *block = (block_header_t *)ptr - 1;
+    if (block == last_block)
+    {
+        arena_used = (uint8_t *)block - arena;
+        last_block = NULL;
+    }
+}
+
+void request_arena_log_stats(void)
+{
+    for (int i = 0; i < MAX_TRACKED_ENDPOINTS && stats[i].endpoint; i++)
+    {
+        ESP_LOGI(TAG, "%s: high-water %u/%u bytes, %u heap fallbacks", stats[i].endpoint, stats[i].high_water,
+                 REQUEST_ARENA_SIZE, stats[i].heap_fallbacks);
+    }
+}
@@ -0,0 +1,26 @@
+#ifndef REQUEST_ARENA_H
+#define REQUEST_ARENA_H
+
+#include <stddef.h>
+
+// Bump allocator for the cJSON DOMs and response buffers of one API call, released at once
+// at the end of the call so the long-running device does not fragment its heap.
+// Only the task that opened the scope allocates from the arena, other tasks and
+// requests larger than the arena fall back to the heap.
+
+#define REQUEST_ARENA_SIZE 8192
+
+// Open a request scope, also installs the cJSON hooks on first use
+void request_arena_begin(void);
+
+// Release everything allocated in the scope in O(1) and record its high-water mark for `endpoint`
+void request_arena_end(const char *endpoint);
+
+void *request_arena_malloc(size_t size);
+void *request_arena_realloc(void *ptr, size_t size);
+void request_arena_free(void *ptr);
+
+// Log the high-water mark of every endpoint seen so far
+void request_arena_log_stats(void);
+
+#endif // REQUEST_ARENA_H
@@ -0,0 +1,218 @@
+#include "retry_policy.h"
+#include "wifi_config.h"
+#include "esp_log.h"
+#include "esp_random.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+static const char *TAG = "retry_policy";
+
+// Circuit breaker: after this many failed attempts in a row the server is considered down
+#define CIRCUIT_FAILURE_THRESHOLD 3
+#define CIRCUIT_OPEN_MS 30000 // Calls fail fast for this long, then one attempt probes the server again
+
+typedef struct
+{
+    unsigned int deadline_ms;    // Whole call, retries and backoff included
+    unsigned int base_delay_ms;  // First backoff, doubled after each failure
+    unsigned int max_delay_ms;
+    unsigned int max_attempts;
+    unsigned int min_attempt_ms; // No retry if less than this would be left for it
+    bool probe;                  // Goes through an open circuit, its success closes it
+} retry_policy_t;
+
+// The long-poll of the action call lasts up to 35 s, its deadline leaves room for one quick retry
+static const retry_policy_t policies[API_CALL_CLASS_COUNT] = {
+    [API_CALL_CONTROL] = {.deadline_ms = 120000, .base_delay_ms = 2000, .max_delay_ms = 30000, .max_attempts = 6, .min_attempt_ms = 5000, .probe = true},
+    [API_CALL_POLL] = {.deadline_ms = 60000, .base_delay_ms = 1000, .max_delay_ms = 8000, .max_attempts = 3, .min_attempt_ms = 5000, .probe = false},
+    [API_CALL_POUR] = {.deadline_ms = 5000, .base_delay_ms = 250, .max_delay_ms = 1000, .max_attempts = 3, .min_attempt_ms = 1500, .probe = false},
+    [API_CALL_REPORT] = {.deadline_ms = 30000, .base_delay_ms = 1000, .max_delay_ms = 8000, .max_attempts = 4, .min_attempt_ms = 3000, .probe = false},
+};
+
+// Shared by every task calling the server
+static portMUX_TYPE circuit_lock = portMUX_INITIALIZER_UNLOCKED;
+static unsigned int consecutive_failures = 0;
+static int64_t circuit_open_until_us = 0;
+
+static void circuit_record_failure()
+{
+    int64_t now = esp_timer_get_time();
+    bool opened = false;
+
+    taskENTER_CRITICAL(&circuit_lock);
+    consecutive_failures++;
+    if (consecutive_failures >= CIRCUIT_FAILURE_THRESHOLD)
+    {
+        opened = circuit_open_until_us <= now;
+        circuit_open_until_us = now + (int64_t)CIRCUIT_OPEN_MS * 1000;
+    }
+    taskEXIT_CRITICAL(&circuit_lock);
+
+    if (opened)
+    {
+        ESP_LOGW(TAG, "Server unreachable after %d failures, failing fast for %d ms", CIRCUIT_FAILURE_THRESHOLD, CIRCUIT_OPEN_MS);
+    }
+}
+
+static void circuit_record_success()
+{
+    bool closed;
+
+    taskENTER_CRITICAL(&circuit_lock);
+    closed = consecutive_failures >= CIRCUIT_FAILURE_THRESHOLD;
+    consecutive_failures = 0;
+    circuit_open_until_us = 0;
+    taskEXIT_CRITICAL(&circuit_lock);
+
+    if (closed)
+    {
+        ESP_LOGI(TAG, "Server reachable again");
+    }
+}
+
+bool retry_circuit_open()
+{
+    taskENTER_CRITICAL(&circuit_lock);
+    bool open = circuit_open_until_us > esp_timer_get_time();
+    taskEXIT_CRITICAL(&circuit_lock);
+    return open;
+}
+
+void retry_begin(retry_state_t *state, api_call_class_t call_class)
+{
+    const retry_policy_t *policy = &policies[call_class];
+    state->call_class = call_class;
+    state->deadline_us = esp_timer_get_time() + (int64_t)policy->deadline_ms * 1000;
+    state->attempt = 0;
+    state->delay_ms = policy->base_delay_ms;
+    state->failure = RETRY_FAILURE_NONE;
+    state->status_code = 0;
+}
+
+bool retry_attempt(retry_state_t *state, int *timeout_ms)
+{
+    const retry_policy_t *policy = &policies[state->call_class];
+
+    // Nothing reaches the server without a link. Only the calls patient enough to probe the server
+    // wait for the Wi-Fi supervisor to bring it back, the others fail at once
+    if (!wifi_link_up())
+    {
+        int64_t link_wait_ms = (state->deadline_us - esp_timer_get_time()) / 1000;
+        if (!policy->probe || link_wait_ms <= 0 || !wifi_wait_link_up((int)link_wait_ms))
+        {
+            state->failure = RETRY_FAILURE_LINK;
+            return false;
+        }
+    }
+
+    if (!policy->probe && retry_circuit_open())
+    {
+        state->failure = RETRY_FAILURE_CIRCUIT;
+        return false;
+    }
+
+    int64_t remaining_ms = (state->deadline_us - esp_timer_get_time()) / 1000;
+    if (remaining_ms <= 0)
+    {
+        state->failure = RETRY_FAILURE_DEADLINE;
+        return false;
+    }
+    if (*timeout_ms > remaining_ms)
+    {
+        *timeout_ms = (int)remaining_ms;
+    }
+    return true;
+}
+
+retry_failure_t retry_failure_from_status(int status_code)
+{
+    if (status_code == 200)
+    {
+        return RETRY_FAILURE_NONE;
+    }
+    // Timeouts and rate limiting on the server side are worth another try
+    if (status_code >= 500 || status_code == 408 || status_code == 429)
+    {
+        return RETRY_FAILURE_SERVER;
+    }
+    return RETRY_FAILURE_CLIENT;
+}
+
+bool retry_next(retry_state_t *state, retry_failure_t failure)
+{
+    const retry_policy_t *policy = &policies[state->call_class];
+    state->failure = failure;
+
+    switch (failure)
+    {
+    case RETRY_FAILURE_NONE:
+        circuit_record_success();
+        return false;
+    case RETRY_FAILURE_CLIENT:
+        // The server answered, it is up, but the request itself is wrong
+        circuit_record_success();
+        return false;
+    case RETRY_FAILURE_CONNECT:
+    case RETRY_FAILURE_TRANSPORT:
+    case RETRY_FAILURE_SERVER:
+        circuit_record_failure();
+        break;
+    default:
+        return false;
+    }
+
+    state->attempt++;
+    if (state->attempt >= policy->max_attempts)
+    {
+        return false;
+    }
+    if (!policy->probe && retry_circuit_open())
+    {
+        return false;
+    }
+
+    // Equal jitter: half the backoff is fixed, the other half random, so devices restarted
+    // together by a power cut do not hit the server in lockstep
+    unsigned int delay_ms = state->delay_ms / 2 + esp_random() % (state->delay_ms / 2 + 1);
+    int64_t remaining_ms = (state->deadline_us - esp_timer_get_time()) / 1000;
+    if (remaining_ms < (int64_t)delay_ms + policy->min_attempt_ms)
+    {
+        return false;
+    }
+
+    ESP_LOGI(TAG, "Retrying after %s in %u ms (attempt %u/%u)", retry_failure_name(failure), delay_ms, state->attempt + 1, policy->max_attempts);
+    vTaskDelay(pdMS_TO_TICKS(delay_ms));
+
+    state->delay_ms *= 2;
+    if (state->delay_ms > policy->max_delay_ms)
+    {
+        state->delay_ms = policy->max_delay_ms;
+    }
+    return true;
+}
+
+const char *retry_failure_name(retry_failure_t failure)
+{
+    switch (failure)
+    {
+    case RETRY_FAILURE_NONE:
+        return "success";
+    case RETRY_FAILURE_CONNECT:
+        return "connect error";
+    case RETRY_FAILURE_TRANSPORT:
+        return "transport error";
+    case RETRY_FAILURE_SERVER:
+        return "server error";
+    case RETRY_FAILURE_CLIENT:
+        return "client error";
+    case RETRY_FAILURE_CIRCUIT:
+        return "open circuit";
+    case RETRY_FAILURE_DEADLINE:
+        return "deadline";
+    case RETRY_FAILURE_LINK:
+        return "Wi-Fi down";
+    default:
+        return "unknown";
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef RETRY_POLICY_H
+#define RETRY_POLICY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// How patient a server call may be, each class has its own deadline and backoff
+typedef enum
+{
+    API_CALL_CONTROL,  // verify and manifest, nothing else can happen until they succeed
+    API_CALL_POLL,     // action and weight, the main loop asks again anyway
+    API_CALL_POUR,     // progress during a pour, the pump is running while we wait
+    API_CALL_REPORT,   // dose complete, error and cancel, the device is waiting on the answer
+    API_CALL_CLASS_COUNT
+} api_call_class_t;
+
+// Why an attempt failed, decides whether another one is worth it
+typedef enum
+{
+    RETRY_FAILURE_NONE,
+    RETRY_FAILURE_CONNECT,   // TCP or TLS could not be established, the server is probably unreachable
+    RETRY_FAILURE_TRANSPORT, // Timeout or dropped connection once connected
+    RETRY_FAILURE_SERVER,    // 5xx, 408, 429 or a 200 with an unusable body
+    RETRY_FAILURE_CLIENT,    // Other 4xx, the same request would be refused again
+    RETRY_FAILURE_CIRCUIT,   // Not attempted, the server is known to be down
+    RETRY_FAILURE_DEADLINE,  // Not attempted, no time left
+    RETRY_FAILURE_LINK,      // Not attempted, Wi-Fi is down and the supervisor is reconnecting
+} retry_failure_t;
+
+// State of one call, on the caller's stack
+typedef struct
+{
+    api_call_class_t call_class;
+    int64_t deadline_us;
+    unsigned int attempt;
+    unsigned int delay_ms; // Backoff ceiling for the next retry
+    retry_failure_t failure;
+    int status_code; // HTTP status of the last response, 0 if none arrived
+} retry_state_t;
+
+void retry_begin(retry_state_t *state, api_call_class_t call_class);
+
+// Check before each attempt: false if Wi-Fi is down, the circuit is open or the deadline passed,
+// otherwise `*timeout_ms` is lowered to what is left of the deadline
+bool retry_attempt(retry_state_t *state, int *timeout_ms);
+
+// Classify an HTTP status, 200 is a success
+retry_failure_t retry_failure_from_status(int status_code);
+
+// Record the outcome of the last attempt. On failure, sleeps the backoff and returns true
+// if another attempt fits in the deadline
+bool retry_next(retry_state_t *state, retry_failure_t failure);
+
+// True while calls fail fast because the server was found unreachable
+bool retry_circuit_open();
+
+const char *retry_failure_name(retry_failure_t failure);
+
+#endif // RETRY_POLICY_H
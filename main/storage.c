@@ -1,80 +1,231 @@
 #include "storage.h"
 #include "nvs_flash.h"
 #include "nvs.h"
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 
-// static const char *TAG = "storage";
+static const char *TAG = "storage";
 
-void initialize_nvs(void)
+#define CONFIG_KEY "config"
+#define CONFIG_VERSION 1
+#define CONFIG_PUMP_GPIO_COUNT 40 // GPIO 0 to 39
+
+// Everything the device keeps across reboots, persisted as one blob and read from RAM afterwards.
+// Bump CONFIG_VERSION when the layout changes, an unknown version is migrated from the legacy keys.
+typedef struct
 {
-    esp_err_t ret = nvs_flash_init();
-    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND)
+    uint16_t version;
+    uint16_t size;
+    uint32_t crc; // CRC32 of the whole struct, computed with this field at 0
+
+    char ssid[MAX_SSID_LEN];
+    char password[MAX_PASS_LEN];
+    char server_url[MAX_URL_LEN];
+    char api_token[MAX_TOKEN_LEN];
+
+    bool has_hx711;
+    unsigned int hx711_dt_pin;
+    unsigned int hx711_sck_pin;
+    int hx711_offset;
+    float hx711_scale;
+
+    bool has_hx711_filter;
+    int hx711_filter_type;
+    int hx711_median_size;
+} device_config_t;
+
+static device_config_t config;
+static SemaphoreHandle_t config_lock = NULL;
+
+// Drip compensation keeps one small key per pump, so learning it does not rewrite the config blob
+static uint64_t has_pump_drip; // Bit per GPIO
+static float pump_drip_s[CONFIG_PUMP_GPIO_COUNT];
+
+static void store_blob(const char *key, const void *blob, size_t size);
+
+static uint32_t config_crc(device_config_t *blob)
+{
+    uint32_t stored = blob->crc;
+    blob->crc = 0;
+    uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *)blob, sizeof(device_config_t));
+    blob->crc = stored;
+    return crc;
+}
+
+static void pump_drip_key(int pump_gpio, char *key, size_t size)
+{
+    snprintf(key, size, "pump_drip_%d", pump_gpio);
+}
+
+// Caller holds the lock
+static void save_config()
+{
+    config.version = CONFIG_VERSION;
+    config.size = sizeof(device_config_t);
+    config.crc = config_crc(&config);
+
+    nvs_handle_t nvs_handle;
+    ESP_ERROR_CHECK(nvs_open("storage", NVS_READWRITE, &nvs_handle));
+    ESP_ERROR_CHECK(nvs_set_blob(nvs_handle, CONFIG_KEY, &config, sizeof(device_config_t)));
+
+    // Mirrored into the legacy keys so a firmware rolled back to before the blob finds current values.
+    // NVS skips items whose value did not change, only the field that changed is written again.
+    ESP_ERROR_CHECK(nvs_set_str(nvs_handle, "ssid", config.ssid));
+    ESP_ERROR_CHECK(nvs_set_str(nvs_handle, "password", config.password));
+    ESP_ERROR_CHECK(nvs_set_str(nvs_handle, "server_url", config.server_url));
+    ESP_ERROR_CHECK(nvs_set_str(nvs_handle, "api_token", config.api_token));
+    if (config.has_hx711)
     {
-        ESP_ERROR_CHECK(nvs_flash_erase());
-        ret = nvs_flash_init();
+        ESP_ERROR_CHECK(nvs_set_blob(nvs_handle, "hx711_dt_pin", &config.hx711_dt_pin, sizeof(unsigned int)));
+        ESP_ERROR_CHECK(nvs_set_blob(nvs_handle, "hx711_sck_pin", &config.hx711_sck_pin, sizeof(unsigned int)));
+        ESP_ERROR_CHECK(nvs_set_blob(nvs_handle, "hx711_offset", &config.hx711_offset, sizeof(int)));
+        ESP_ERROR_CHECK(nvs_set_blob(nvs_handle, "hx711_scale", &config.hx711_scale, sizeof(float)));
     }
-    ESP_ERROR_CHECK(ret);
+    if (config.has_hx711_filter)
+    {
+        int filter[2] = {config.hx711_filter_type, config.hx711_median_size};
+        ESP_ERROR_CHECK(nvs_set_blob(nvs_handle, "hx711_filter", filter, sizeof(filter)));
+    }
+    ESP_ERROR_CHECK(nvs_commit(nvs_handle));
+    nvs_close(nvs_handle);
 }
 
-bool get_stored_wifi_credentials(char *ssid, char *password)
+// One-time import of the keys written by firmwares before the config blob, save_config keeps them current
+static void load_legacy_config(nvs_handle_t nvs_handle)
 {
-    nvs_handle_t nvs_handle;
-    esp_err_t err = nvs_open("storage", NVS_READONLY, &nvs_handle);
-    if (err != ESP_OK)
-        return false;
+    size_t length = sizeof(config.ssid);
+    nvs_get_str(nvs_handle, "ssid", config.ssid, &length);
+    length = sizeof(config.password);
+    nvs_get_str(nvs_handle, "password", config.password, &length);
+    length = sizeof(config.server_url);
+    nvs_get_str(nvs_handle, "server_url", config.server_url, &length);
+    length = sizeof(config.api_token);
+    nvs_get_str(nvs_handle, "api_token", config.api_token, &length);
+
+    size_t dt_size = sizeof(unsigned int), sck_size = sizeof(unsigned int), offset_size = sizeof(int), scale_size = sizeof(float);
+    config.has_hx711 = nvs_get_blob(nvs_handle, "hx711_dt_pin", &config.hx711_dt_pin, &dt_size) == ESP_OK &&
+                       nvs_get_blob(nvs_handle, "hx711_sck_pin", &config.hx711_sck_pin, &sck_size) == ESP_OK &&
+                       nvs_get_blob(nvs_handle, "hx711_offset", &config.hx711_offset, &offset_size) == ESP_OK &&
+                       nvs_get_blob(nvs_handle, "hx711_scale", &config.hx711_scale, &scale_size) == ESP_OK;
+
+    int filter[2];
+    size_t filter_size = sizeof(filter);
+    if (nvs_get_blob(nvs_handle, "hx711_filter", filter, &filter_size) == ESP_OK)
+    {
+        config.has_hx711_filter = true;
+        config.hx711_filter_type = filter[0];
+        config.hx711_median_size = filter[1];
+    }
+}
 
-    size_t ssid_len = MAX_SSID_LEN;
-    size_t pass_len = MAX_PASS_LEN;
+static void load_pump_drip(nvs_handle_t nvs_handle)
+{
+    for (int gpio = 0; gpio < CONFIG_PUMP_GPIO_COUNT; gpio++)
+    {
+        char key[16];
+        pump_drip_key(gpio, key, sizeof(key));
+        size_t drip_size = sizeof(float);
+        if (nvs_get_blob(nvs_handle, key, &pump_drip_s[gpio], &drip_size) == ESP_OK)
+        {
+            has_pump_drip |= 1ULL << gpio;
+        }
+    }
+}
+
+static void load_config()
+{
+    memset(&config, 0, sizeof(config));
 
-    err = nvs_get_str(nvs_handle, "ssid", ssid, &ssid_len);
-    if (err != ESP_OK || ssid_len <= 1)
+    nvs_handle_t nvs_handle;
+    if (nvs_open("storage", NVS_READONLY, &nvs_handle) != ESP_OK)
     {
-        nvs_close(nvs_handle);
-        return false;
+        return; // Nothing stored yet
     }
 
-    err = nvs_get_str(nvs_handle, "password", password, &pass_len);
-    if (err != ESP_OK)
+    load_pump_drip(nvs_handle);
+
+    size_t size = sizeof(device_config_t);
+    esp_err_t err = nvs_get_blob(nvs_handle, CONFIG_KEY, &config, &size);
+    if (err == ESP_OK && size == sizeof(device_config_t) && config.version == CONFIG_VERSION &&
+        config.size == sizeof(device_config_t) && config.crc == config_crc(&config))
     {
         nvs_close(nvs_handle);
-        return false;
+        return;
     }
 
+    if (err == ESP_OK)
+    {
+        ESP_LOGW(TAG, "Stored config is corrupted or from another version, importing the legacy keys");
+    }
+    memset(&config, 0, sizeof(config));
+    load_legacy_config(nvs_handle);
     nvs_close(nvs_handle);
-    return strlen(ssid) > 0;
+    save_config();
 }
 
-void store_wifi_credentials(const char *ssid, const char *password)
+void initialize_nvs(void)
 {
-    nvs_handle_t nvs_handle;
-    ESP_ERROR_CHECK(nvs_open("storage", NVS_READWRITE, &nvs_handle));
-
-    ESP_ERROR_CHECK(nvs_set_str(nvs_handle, "ssid", ssid));
-    ESP_ERROR_CHECK(nvs_set_str(nvs_handle, "password", password));
+    esp_err_t ret = nvs_flash_init();
+    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND)
+    {
+        ESP_ERROR_CHECK(nvs_flash_erase());
+        ret = nvs_flash_init();
+    }
+    ESP_ERROR_CHECK(ret);
 
-    ESP_ERROR_CHECK(nvs_commit(nvs_handle));
-    nvs_close(nvs_handle);
+    config_lock = xSemaphoreCreateMutex();
+    load_config();
 }
 
-bool get_stored_server_url(char *url)
+// Copy `value` into the `field` string, true if it changed
+static bool update_string(char *field, size_t size, const char *value)
 {
-    nvs_handle_t nvs_handle;
-    esp_err_t err = nvs_open("storage", NVS_READONLY, &nvs_handle);
-    if (err != ESP_OK)
+    char updated[MAX_URL_LEN] = {0}; // Largest of the config strings
+    strncpy(updated, value, size - 1);
+    if (strcmp(field, updated) == 0)
+    {
         return false;
+    }
+    strcpy(field, updated);
+    return true;
+}
 
-    size_t url_len = MAX_URL_LEN;
-    err = nvs_get_str(nvs_handle, "server_url", url, &url_len);
+bool get_stored_wifi_credentials(char *ssid, char *password)
+{
+    xSemaphoreTake(config_lock, portMAX_DELAY);
+    strcpy(ssid, config.ssid);
+    strcpy(password, config.password);
+    xSemaphoreGive(config_lock);
+    return strlen(ssid) > 0;
+}
 
-    nvs_close(nvs_handle);
-    return (err == ESP_OK && url_len > 1);
+void store_wifi_credentials(const char *ssid, const char *password)
+{
+    xSemaphoreTake(config_lock, portMAX_DELAY);
+    bool changed = update_string(config.ssid, sizeof(config.ssid), ssid);
+    changed |= update_string(config.password, sizeof(config.password), password);
+    if (changed)
+    {
+        save_config();
+    }
+    xSemaphoreGive(config_lock);
 }
 
-void store_server_url(const char *url)
+bool get_stored_server_url(char *url)
 {
-    nvs_handle_t nvs_handle;
-    ESP_ERROR_CHECK(nvs_open("storage", NVS_READWRITE, &nvs_handle));
+    xSemaphoreTake(config_lock, portMAX_DELAY);
+    strcpy(url, config.server_url);
+    xSemaphoreGive(config_lock);
+    return strlen(url) > 0;
+}
 
+void store_server_url(const char *url)
+{
     // Remove trailing slash if it exists
     char clean_url[MAX_URL_LEN];
     strncpy(clean_url, url, MAX_URL_LEN - 1);
@@ -86,35 +237,30 @@ void store_server_url(const char *url)
         clean_url[len - 1] = '\0';
     }
 
-    ESP_ERROR_CHECK(nvs_set_str(nvs_handle, "server_url", clean_url));
-
-    ESP_ERROR_CHECK(nvs_commit(nvs_handle));
-    nvs_close(nvs_handle);
+    xSemaphoreTake(config_lock, portMAX_DELAY);
+    if (update_string(config.server_url, sizeof(config.server_url), clean_url))
+    {
+        save_config();
+    }
+    xSemaphoreGive(config_lock);
 }
 
 bool get_stored_api_token(char *token)
 {
-    nvs_handle_t nvs_handle;
-    esp_err_t err = nvs_open("storage", NVS_READONLY, &nvs_handle);
-    if (err != ESP_OK)
-        return false;
-
-    size_t token_len = MAX_TOKEN_LEN;
-    err = nvs_get_str(nvs_handle, "api_token", token, &token_len);
-
-    nvs_close(nvs_handle);
-    return (err == ESP_OK && token_len > 1);
+    xSemaphoreTake(config_lock, portMAX_DELAY);
+    strcpy(token, config.api_token);
+    xSemaphoreGive(config_lock);
+    return strlen(token) > 0;
 }
 
 void store_api_token(const char *token)
 {
-    nvs_handle_t nvs_handle;
-    ESP_ERROR_CHECK(nvs_open("storage", NVS_READWRITE, &nvs_handle));
-
-    ESP_ERROR_CHECK(nvs_set_str(nvs_handle, "api_token", token));
-
-    ESP_ERROR_CHECK(nvs_commit(nvs_handle));
-    nvs_close(nvs_handle);
+    xSemaphoreTake(config_lock, portMAX_DELAY);
+    if (update_string(config.api_token, sizeof(config.api_token), token))
+    {
+        save_config();
+    }
+    xSemaphoreGive(config_lock);
 }
 
 bool get_stored_hx711_config(unsigned int *dt_pin, unsigned int *sck_pin, int *offset, float *scale)
@@ -123,57 +269,154 @@ bool get_stored_hx711_config(unsigned int *dt_pin, unsigned int *sck_pin, int *o
     *offset = 0;
     *scale = 1.0;
 
-    nvs_handle_t nvs_handle;
-    esp_err_t err = nvs_open("storage", NVS_READONLY, &nvs_handle);
-    if (err != ESP_OK)
-        return false;
+    xSemaphoreTake(config_lock, portMAX_DELAY);
+    bool found = config.has_hx711;
+    if (found)
+    {
+        *dt_pin = config.hx711_dt_pin;
+        *sck_pin = config.hx711_sck_pin;
+        *offset = config.hx711_offset;
+        *scale = config.hx711_scale;
+    }
+    xSemaphoreGive(config_lock);
+    return found;
+}
 
-    size_t required_size = sizeof(unsigned int);
-    err = nvs_get_blob(nvs_handle, "hx711_dt_pin", dt_pin, &required_size);
-    if (err != ESP_OK)
+void store_hx711_config(unsigned int dt_pin, unsigned int sck_pin, int offset, float scale)
+{
+    xSemaphoreTake(config_lock, portMAX_DELAY);
+    if (!config.has_hx711 || config.hx711_dt_pin != dt_pin || config.hx711_sck_pin != sck_pin ||
+        config.hx711_offset != offset || config.hx711_scale != scale)
     {
-        nvs_close(nvs_handle);
-        return false;
+        config.has_hx711 = true;
+        config.hx711_dt_pin = dt_pin;
+        config.hx711_sck_pin = sck_pin;
+        config.hx711_offset = offset;
+        config.hx711_scale = scale;
+        save_config();
     }
+    xSemaphoreGive(config_lock);
+}
 
-    required_size = sizeof(unsigned int);
-    err = nvs_get_blob(nvs_handle, "hx711_sck_pin", sck_pin, &required_size);
-    if (err != ESP_OK)
+bool get_stored_hx711_filter(int *filter_type, int *median_size)
+{
+    xSemaphoreTake(config_lock, portMAX_DELAY);
+    bool found = config.has_hx711_filter;
+    if (found)
     {
-        nvs_close(nvs_handle);
-        return false;
+        *filter_type = config.hx711_filter_type;
+        *median_size = config.hx711_median_size;
     }
+    xSemaphoreGive(config_lock);
+    return found;
+}
 
-    required_size = sizeof(int);
-    err = nvs_get_blob(nvs_handle, "hx711_offset", offset, &required_size);
-    if (err != ESP_OK)
+void store_hx711_filter(int filter_type, int median_size)
+{
+    xSemaphoreTake(config_lock, portMAX_DELAY);
+    if (!config.has_hx711_filter || config.hx711_filter_type != filter_type || config.hx711_median_size != median_size)
     {
-        nvs_close(nvs_handle);
+        config.has_hx711_filter = true;
+        config.hx711_filter_type = filter_type;
+        config.hx711_median_size = median_size;
+        save_config();
+    }
+    xSemaphoreGive(config_lock);
+}
+
+bool get_stored_pump_drip(int pump_gpio, float *drip_s)
+{
+    if (pump_gpio < 0 || pump_gpio >= CONFIG_PUMP_GPIO_COUNT)
         return false;
+
+    xSemaphoreTake(config_lock, portMAX_DELAY);
+    bool found = has_pump_drip & (1ULL << pump_gpio);
+    if (found)
+    {
+        *drip_s = pump_drip_s[pump_gpio];
     }
+    xSemaphoreGive(config_lock);
+    return found;
+}
 
-    required_size = sizeof(float);
-    err = nvs_get_blob(nvs_handle, "hx711_scale", scale, &required_size);
-    if (err != ESP_OK)
+void store_pump_drip(int pump_gpio, float drip_s)
+{
+    if (pump_gpio < 0 || pump_gpio >= CONFIG_PUMP_GPIO_COUNT)
+        return;
+
+    xSemaphoreTake(config_lock, portMAX_DELAY);
+    if (!(has_pump_drip & (1ULL << pump_gpio)) || pump_drip_s[pump_gpio] != drip_s)
     {
-        nvs_close(nvs_handle);
-        return false;
+        has_pump_drip |= 1ULL << pump_gpio;
+        pump_drip_s[pump_gpio] = drip_s;
+        char key[16];
+        pump_drip_key(pump_gpio, key, sizeof(key));
+        store_blob(key, &drip_s, sizeof(float));
     }
+    xSemaphoreGive(config_lock);
+}
+
+static bool get_stored_blob(const char *key, void *blob, size_t *size)
+{
+    nvs_handle_t nvs_handle;
+    esp_err_t err = nvs_open("storage", NVS_READONLY, &nvs_handle);
+    if (err != ESP_OK)
+        return false;
+
+    err = nvs_get_blob(nvs_handle, key, blob, size);
 
     nvs_close(nvs_handle);
-    return true;
+    return err == ESP_OK;
 }
 
-void store_hx711_config(unsigned int dt_pin, unsigned int sck_pin, int offset, float scale)
+static void store_blob(const char *key, const void *blob, size_t size)
 {
     nvs_handle_t nvs_handle;
     ESP_ERROR_CHECK(nvs_open("storage", NVS_READWRITE, &nvs_handle));
 
-    ESP_ERROR_CHECK(nvs_set_blob(nvs_handle, "hx711_dt_pin", &dt_pin, sizeof(unsigned int)));
-    ESP_ERROR_CHECK(nvs_set_blob(nvs_handle, "hx711_sck_pin", &sck_pin, sizeof(unsigned int)));
-    ESP_ERROR_CHECK(nvs_set_blob(nvs_handle, "hx711_offset", &offset, sizeof(int)));
-    ESP_ERROR_CHECK(nvs_set_blob(nvs_handle, "hx711_scale", &scale, sizeof(float)));
+    if (size > 0)
+    {
+        ESP_ERROR_CHECK(nvs_set_blob(nvs_handle, key, blob, size));
+    }
+    else
+    {
+        esp_err_t err = nvs_erase_key(nvs_handle, key);
+        if (err != ESP_ERR_NVS_NOT_FOUND)
+        {
+            ESP_ERROR_CHECK(err);
+        }
+    }
 
     ESP_ERROR_CHECK(nvs_commit(nvs_handle));
     nvs_close(nvs_handle);
 }
+
+bool get_stored_outbox(void *blob, size_t *size)
+{
+    return get_stored_blob("outbox", blob, size);
+}
+
+void store_outbox(const void *blob, size_t size)
+{
+    store_blob("outbox", blob, size);
+}
+
+bool get_stored_ota_checkpoint(void *blob, size_t *size)
+{
+    return get_stored_blob("ota_resume", blob, size);
+}
+
+void store_ota_checkpoint(const void *blob, size_t size)
+{
+    store_blob("ota_resume", blob, size);
+}
+
+bool get_stored_wifi_cache(void *blob, size_t *size)
+{
+    return get_stored_blob("wifi_cache", blob, size);
+}
+
+void store_wifi_cache(const void *blob, size_t size)
+{
+    store_blob("wifi_cache", blob, size);
+}
@@ -2,6 +2,7 @@
 #define STORAGE_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include "esp_err.h"
 
 #define MAX_SSID_LEN 32
@@ -9,6 +10,8 @@
 #define MAX_URL_LEN 128
 #define MAX_TOKEN_LEN 64
 
+// Also loads the configuration in RAM: the getters below never read flash,
+// the setters write the single config blob only when a value changes
 void initialize_nvs(void);
 bool get_stored_wifi_credentials(char *ssid, char *password);
 void store_wifi_credentials(const char *ssid, const char *password);
@@ -25,4 +28,25 @@ void store_api_token(const char *token);
 bool get_stored_hx711_config(unsigned int *dt_pin, unsigned int *sck_pin, int *offset, float *scale);
 void store_hx711_config(unsigned int dt_pin, unsigned int sck_pin, int offset, float scale);
 
+// Weight filter selection, see weight_filter_type_t
+bool get_stored_hx711_filter(int *filter_type, int *median_size);
+void store_hx711_filter(int filter_type, int median_size);
+
+// Per pump drip-tail compensation, in seconds of flow, learned from previous pours
+bool get_stored_pump_drip(int pump_gpio, float *drip_s);
+void store_pump_drip(int pump_gpio, float drip_s);
+
+// Reports not acknowledged by the server, `*size` is the buffer size in and the blob size out.
+// A size of 0 erases them.
+bool get_stored_outbox(void *blob, size_t *size);
+void store_outbox(const void *blob, size_t size);
+
+// Resume point of the firmware download in progress, same conventions as the outbox
+bool get_stored_ota_checkpoint(void *blob, size_t *size);
+void store_ota_checkpoint(const void *blob, size_t size);
+
+// Access point of the last connection, for a connection without scan at boot. Same conventions as the outbox
+bool get_stored_wifi_cache(void *blob, size_t *size);
+void store_wifi_cache(const void *blob, size_t size);
+
 #endif // STORAGE_H
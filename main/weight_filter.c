@@ -0,0 +1,159 @@
+#include <math.h>
+#include <string.h>
+
+#include "weight_filter.h"
+
+// Noise model in grams, converted to raw units with the calibration scale
+#define MEASUREMENT_NOISE_G 0.5f // Standard deviation of a single conversion
+#define PROCESS_NOISE_G 20.0f    // Standard deviation of the flow acceleration, in g/s^2
+#define EMA_ALPHA 0.3f
+#define DEFAULT_DT_S 0.1f // HX711 at 10 Hz
+#define STEP_THRESHOLD_G 10.0f // A jump no pour produces within one sample: a glass was set down or lifted
+
+static int32_t median_of(const int32_t *values, int count)
+{
+    int32_t sorted[WEIGHT_FILTER_MAX_MEDIAN];
+    memcpy(sorted, values, count * sizeof(int32_t));
+
+    // Insertion sort, the window is tiny
+    for (int i = 1; i < count; i++)
+    {
+        int32_t v = sorted[i];
+        int j = i - 1;
+        while (j >= 0 && sorted[j] > v)
+        {
+            sorted[j + 1] = sorted[j];
+            j--;
+        }
+        sorted[j + 1] = v;
+    }
+    return sorted[count / 2];
+}
+
+void weight_filter_init(weight_filter_t *filter, const weight_filter_config_t *config, float scale)
+{
+    memset(filter, 0, sizeof(weight_filter_t));
+    filter->config = *config;
+
+    // Keep the median window odd and in bounds
+    if (filter->config.median_size < 1)
+    {
+        filter->config.median_size = 1;
+    }
+    if (filter->config.median_size > WEIGHT_FILTER_MAX_MEDIAN)
+    {
+        filter->config.median_size = WEIGHT_FILTER_MAX_MEDIAN;
+    }
+    if (filter->config.median_size % 2 == 0)
+    {
+        filter->config.median_size--;
+    }
+
+    float grams_per_raw = fabsf(scale) > 1e-9f ? fabsf(scale) : 1.0f;
+    filter->measurement_noise = powf(MEASUREMENT_NOISE_G / grams_per_raw, 2);
+    filter->process_noise = powf(PROCESS_NOISE_G / grams_per_raw, 2);
+    filter->step_threshold = STEP_THRESHOLD_G / grams_per_raw;
+}
+
+static void restart_at(weight_filter_t *filter, float z, float dt)
+{
+    filter->value = z;
+    filter->velocity = 0;
+    filter->p[0][0] = filter->measurement_noise;
+    filter->p[0][1] = 0;
+    filter->p[1][0] = 0;
+    filter->p[1][1] = filter->measurement_noise / (dt * dt);
+}
+
+static void kalman_update(weight_filter_t *filter, float z, float dt)
+{
+    float(*p)[2] = filter->p;
+    float q = filter->process_noise;
+
+    // Predict with a constant velocity model, white noise acceleration
+    filter->value += filter->velocity * dt;
+    float dt2 = dt * dt;
+    float p00 = p[0][0] + dt * (p[1][0] + p[0][1]) + dt2 * p[1][1] + q * dt2 * dt2 / 4;
+    float p01 = p[0][1] + dt * p[1][1] + q * dt2 * dt / 2;
+    float p10 = p[1][0] + dt * p[1][1] + q * dt2 * dt / 2;
+    float p11 = p[1][1] + q * dt2;
+
+    // Correct with the measured position
+    float s = p00 + filter->measurement_noise;
+    float k0 = p00 / s;
+    float k1 = p10 / s;
+    float innovation = z - filter->value;
+    filter->value += k0 * innovation;
+    filter->velocity += k1 * innovation;
+
+    p[0][0] = (1 - k0) * p00;
+    p[0][1] = (1 - k0) * p01;
+    p[1][0] = p10 - k1 * p00;
+    p[1][1] = p11 - k1 * p01;
+}
+
+void weight_filter_update(weight_filter_t *filter, int32_t raw, int64_t timestamp_us, float *value, float *variance)
+{
+    // Spike rejection: median of the last `median_size` conversions
+    filter->window[filter->window_next] = raw;
+    filter->window_next = (filter->window_next + 1) % filter->config.median_size;
+    if (filter->window_count < filter->config.median_size)
+    {
+        filter->window_count++;
+    }
+    float z = (float)median_of(filter->window, filter->window_count);
+
+    float dt = filter->initialized ? (float)(timestamp_us - filter->last_us) / 1e6f : DEFAULT_DT_S;
+    if (dt <= 0 || dt > 1.0f)
+    {
+        dt = DEFAULT_DT_S;
+    }
+    filter->last_us = timestamp_us;
+
+    if (!filter->initialized)
+    {
+        filter->initialized = true;
+        restart_at(filter, z, dt);
+    }
+    else if (filter->config.type != WEIGHT_FILTER_NONE && fabsf(z - filter->value) > filter->step_threshold)
+    {
+        // Smoothing a load change only delays it, and the Kalman velocity would overshoot it
+        restart_at(filter, z, dt);
+    }
+    else
+    {
+        switch (filter->config.type)
+        {
+        case WEIGHT_FILTER_EMA:
+        {
+            // Track the variance of the residuals, the estimate variance follows from the EMA gain
+            float delta = z - filter->value;
+            filter->value += EMA_ALPHA * delta;
+            filter->p[0][0] = (1 - EMA_ALPHA) * (filter->p[0][0] + EMA_ALPHA * delta * delta);
+            break;
+        }
+        case WEIGHT_FILTER_KALMAN:
+            kalman_update(filter, z, dt);
+            break;
+        case WEIGHT_FILTER_NONE:
+        default:
+            filter->value = z;
+            break;
+        }
+    }
+
+    *value = filter->value;
+    switch (filter->config.type)
+    {
+    case WEIGHT_FILTER_EMA:
+        *variance = filter->p[0][0] * EMA_ALPHA / (2 - EMA_ALPHA);
+        break;
+    case WEIGHT_FILTER_KALMAN:
+        *variance = filter->p[0][0];
+        break;
+    case WEIGHT_FILTER_NONE:
+    default:
+        *variance = filter->measurement_noise;
+        break;
+    }
+}
@@ -0,0 +1,48 @@
+#ifndef WEIGHT_FILTER_H
+#define WEIGHT_FILTER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define WEIGHT_FILTER_MAX_MEDIAN 9
+
+// Smoother applied after the median spike rejection, values match the server `hx711Filter` field
+typedef enum
+{
+    WEIGHT_FILTER_NONE = 0,   // Median only, readers average the samples themselves
+    WEIGHT_FILTER_EMA = 1,    // Exponential moving average
+    WEIGHT_FILTER_KALMAN = 2, // Constant velocity Kalman filter, follows a pour without lag
+} weight_filter_type_t;
+
+typedef struct
+{
+    weight_filter_type_t type;
+    int median_size; // Odd, 1 disables spike rejection
+} weight_filter_config_t;
+
+#define WEIGHT_FILTER_DEFAULT_CONFIG {.type = WEIGHT_FILTER_KALMAN, .median_size = 5}
+
+// Streaming filter state, all values in raw HX711 units
+typedef struct
+{
+    weight_filter_config_t config;
+    int32_t window[WEIGHT_FILTER_MAX_MEDIAN];
+    int window_count;
+    int window_next;
+    bool initialized;
+    int64_t last_us;
+    float value;
+    float velocity; // Kalman only, raw units per second
+    float p[2][2];  // Kalman covariance, or EMA variance in p[0][0]
+    float measurement_noise;
+    float process_noise;
+    float step_threshold; // Jump restarting the estimate at the new load
+} weight_filter_t;
+
+// `scale` is the calibration scale (g per raw unit), used to express the noise model in grams
+void weight_filter_init(weight_filter_t *filter, const weight_filter_config_t *config, float scale);
+
+// Feed one conversion, returns the filtered value and the variance of that estimate
+void weight_filter_update(weight_filter_t *filter, int32_t raw, int64_t timestamp_us, float *value, float *variance);
+
+#endif // WEIGHT_FILTER_H
@@ -1,4 +1,12 @@
+#include <math.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
 
 // components
 // https://esp-idf-lib.github.io/hx711/
@@ -6,58 +14,471 @@
 
 // local files
 #include "weight_scale.h"
+#include "weight_filter.h"
 #include "storage.h"
 #include "api.h"
 
 static const char *TAG = "weight_scale";
 
+// The sampling task owns the HX711 and runs on the APP CPU, away from WiFi and lwIP
+#define SAMPLING_TASK_CORE 1
+#define SAMPLING_TASK_PRIORITY 10
+#define SAMPLING_TASK_STACK_SIZE 3072
+#define HX711_WAIT_TIMEOUT_MS 200 // 10 Hz conversions, so 2 periods before giving up
+
+// Power of two so that sequence numbers wrap cleanly onto slots
+#define SAMPLE_RING_SIZE 64
+// A reader considers the sampler stalled if the newest sample is older than this
+#define SAMPLE_STALE_US (500 * 1000)
+
+// measure_weight_until_stable needs a few samples before trusting the spread
+#define STABLE_MIN_SAMPLES 3
+// Below this the MAD underestimates the noise, the plain standard deviation is used instead
+#define STABLE_MAD_MIN_SAMPLES 8
+#define STABLE_OUTLIER_SIGMAS 4.0f
+#define CALIBRATION_TOLERANCE_G 0.5f
+#define CALIBRATION_MAX_MS 2000
+
 typedef struct
 {
     hx711_t hx711;
     int offset;
     float scale;
+    weight_filter_config_t filter_config;
+    weight_filter_t filter; // Only touched by the sampling task, or under hx711_mutex
 } WeightScale;
 
 WeightScale weight_scale;
 
+// Single producer / multiple consumers ring. Each slot carries the sequence number
+// of the sample it holds (0 while being written) so readers can detect a slot that
+// was overwritten while they were copying it, without taking any lock.
+typedef struct
+{
+    atomic_uint seq;
+    weight_sample_t sample;
+} sample_slot_t;
+
+static sample_slot_t sample_ring[SAMPLE_RING_SIZE];
+static atomic_uint sample_head = 0;        // number of samples ever produced
+static atomic_uint sample_first_valid = 0; // samples before this come from a previous HX711 setup
+
+static TaskHandle_t sampling_task = NULL;
+static SemaphoreHandle_t hx711_mutex = NULL;
+
+static void sample_ring_push(const weight_sample_t *sample)
+{
+    unsigned int seq = atomic_load_explicit(&sample_head, memory_order_relaxed) + 1;
+    sample_slot_t *slot = &sample_ring[seq % SAMPLE_RING_SIZE];
+
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->sample = *sample;
+    atomic_store_explicit(&slot->seq, seq, memory_order_release);
+    atomic_store_explicit(&sample_head, seq, memory_order_release);
+}
+
+// Copy sample number `seq` (1-based), fails if it was already overwritten
+static bool sample_ring_get(unsigned int seq, weight_sample_t *sample)
+{
+    sample_slot_t *slot = &sample_ring[seq % SAMPLE_RING_SIZE];
+
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) != seq)
+    {
+        return false;
+    }
+    *sample = slot->sample;
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&slot->seq, memory_order_relaxed) == seq;
+}
+
+// Oldest sample number still readable and produced with the current HX711 setup
+static unsigned int sample_ring_oldest(unsigned int head)
+{
+    unsigned int oldest = head > SAMPLE_RING_SIZE - 1 ? head - (SAMPLE_RING_SIZE - 1) : 1;
+    unsigned int first_valid = atomic_load_explicit(&sample_first_valid, memory_order_acquire);
+    return oldest > first_valid ? oldest : first_valid;
+}
+
+static void weight_sampling_task(void *arg)
+{
+    int consecutive_errors = 0;
+
+    while (1)
+    {
+        weight_sample_t sample = {0};
+
+        xSemaphoreTake(hx711_mutex, portMAX_DELAY);
+        // hx711_wait returns as soon as DOUT goes low, i.e. a conversion is ready
+        esp_err_t err = hx711_wait(&weight_scale.hx711, HX711_WAIT_TIMEOUT_MS);
+        sample.timestamp_us = esp_timer_get_time();
+        if (err == ESP_OK)
+        {
+            err = hx711_read_data(&weight_scale.hx711, &sample.raw);
+        }
+        if (err == ESP_OK)
+        {
+            weight_filter_update(&weight_scale.filter, sample.raw, sample.timestamp_us, &sample.filtered, &sample.variance);
+        }
+        xSemaphoreGive(hx711_mutex);
+
+        if (err == ESP_OK)
+        {
+            sample_ring_push(&sample);
+            consecutive_errors = 0;
+        }
+        else
+        {
+            // Only log the first failure of a series, the scale may be unplugged for a while
+            if (consecutive_errors++ == 0)
+            {
+                ESP_LOGE(TAG, "Failed to read HX711: %s", esp_err_to_name(err));
+            }
+            vTaskDelay(pdMS_TO_TICKS(HX711_WAIT_TIMEOUT_MS));
+        }
+    }
+}
+
+float weight_interface_to_grams(float raw_measure)
+{
+    return weight_scale.scale * (raw_measure - weight_scale.offset);
+}
+
+bool weight_interface_wait_sample(uint32_t *cursor, weight_sample_t *sample, unsigned int timeout_ms)
+{
+    int64_t deadline_us = esp_timer_get_time() + (int64_t)timeout_ms * 1000;
+
+    if (*cursor == 0)
+    {
+        *cursor = atomic_load_explicit(&sample_head, memory_order_acquire);
+    }
+
+    while (1)
+    {
+        unsigned int head = atomic_load_explicit(&sample_head, memory_order_acquire);
+        if (head != *cursor)
+        {
+            // Skip what was overwritten if the caller fell more than a ring behind
+            unsigned int seq = *cursor + 1;
+            unsigned int oldest = sample_ring_oldest(head);
+            if ((int)(oldest - seq) > 0)
+            {
+                seq = oldest;
+            }
+            if (sample_ring_get(seq, sample))
+            {
+                *cursor = seq;
+                return true;
+            }
+            *cursor = seq;
+            continue;
+        }
+        if (esp_timer_get_time() >= deadline_us)
+        {
+            return false;
+        }
+        vTaskDelay(1);
+    }
+}
+
+bool measure_weight_latest(float *measure, float *variance, int64_t *timestamp_us)
+{
+    weight_sample_t sample;
+    unsigned int head = atomic_load_explicit(&sample_head, memory_order_acquire);
+
+    if (head == 0 || head < atomic_load_explicit(&sample_first_valid, memory_order_acquire) ||
+        !sample_ring_get(head, &sample))
+    {
+        return false;
+    }
+    if (esp_timer_get_time() - sample.timestamp_us > SAMPLE_STALE_US)
+    {
+        return false;
+    }
+
+    *measure = weight_interface_to_grams(sample.filtered);
+    if (variance)
+    {
+        *variance = weight_scale.scale * weight_scale.scale * sample.variance;
+    }
+    if (timestamp_us)
+    {
+        *timestamp_us = sample.timestamp_us;
+    }
+    return true;
+}
+
+// Average up to `count` samples going back from `head`, stopping at the first one older than `since_us`
+static bool average_samples(unsigned int head, unsigned int count, int64_t since_us, int32_t *raw_measure, unsigned int *used)
+{
+    double sum = 0;
+    unsigned int n = 0;
+    unsigned int oldest = sample_ring_oldest(head);
+
+    for (unsigned int seq = head; seq >= oldest && seq > 0 && n < count; seq--)
+    {
+        weight_sample_t sample;
+        if (!sample_ring_get(seq, &sample) || sample.timestamp_us < since_us)
+        {
+            break;
+        }
+        sum += sample.filtered;
+        n++;
+    }
+
+    *used = n;
+    if (n == 0)
+    {
+        return false;
+    }
+    *raw_measure = (int32_t)lround(sum / n);
+    return true;
+}
+
+bool measure_weight_window(float *measure, int32_t *raw_measure, unsigned int window_ms)
+{
+    unsigned int used = 0;
+    unsigned int head = atomic_load_explicit(&sample_head, memory_order_acquire);
+    int64_t since_us = esp_timer_get_time() - (int64_t)window_ms * 1000;
+
+    if (!average_samples(head, SAMPLE_RING_SIZE, since_us, raw_measure, &used))
+    {
+        return false;
+    }
+    *measure = weight_interface_to_grams(*raw_measure);
+    return true;
+}
+
 bool measure_weight(float *measure, int32_t *raw_measure, unsigned int times)
 {
+    if (times == 0 || times > SAMPLE_RING_SIZE - 1)
+    {
+        ESP_LOGE(TAG, "Cannot average over %u samples", times);
+        return false;
+    }
+
+    // Only wait for the samples we do not have yet, the sampler is always running
+    int64_t since_us = esp_timer_get_time() - SAMPLE_STALE_US;
+    int64_t deadline_us = esp_timer_get_time() + (int64_t)times * HX711_WAIT_TIMEOUT_MS * 1000;
+    unsigned int used = 0;
+
+    while (1)
+    {
+        unsigned int head = atomic_load_explicit(&sample_head, memory_order_acquire);
+        if (average_samples(head, times, since_us, raw_measure, &used) && used == times)
+        {
+            break;
+        }
+        if (esp_timer_get_time() >= deadline_us)
+        {
+            ESP_LOGE(TAG, "Failed to read weight");
+            return false;
+        }
+        vTaskDelay(pdMS_TO_TICKS(20));
+    }
+
+    // ESP_LOGI(TAG, "Values offset=%i, scale=%lf", weight_scale.offset, weight_scale.scale);
+    *measure = weight_interface_to_grams(*raw_measure);
+    ESP_LOGI(TAG, "Weight measure raw=%ld, clean=%lf. Averaged over %i times", *raw_measure, *measure, times);
+    return true;
+}
+
+static int compare_float(const void *a, const void *b)
+{
+    float fa = *(const float *)a, fb = *(const float *)b;
+    return (fa > fb) - (fa < fb);
+}
+
+// Median and scaled median absolute deviation (a robust standard deviation) of `values`
+static void robust_stats(const float *values, unsigned int n, float *median, float *sigma)
+{
+    float sorted[SAMPLE_RING_SIZE];
+    memcpy(sorted, values, n * sizeof(float));
+    qsort(sorted, n, sizeof(float), compare_float);
+    *median = n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
 
-    esp_err_t err = hx711_read_average(&weight_scale.hx711, times, raw_measure);
-    if (err != ESP_OK)
+    for (unsigned int i = 0; i < n; i++)
+    {
+        sorted[i] = fabsf(sorted[i] - *median);
+    }
+    qsort(sorted, n, sizeof(float), compare_float);
+    float mad = n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+    *sigma = 1.4826f * mad;
+}
+
+// Mean and sample standard deviation of `values`
+static void sample_stats(const float *values, unsigned int n, float *mean, float *sigma)
+{
+    double sum = 0, sum_sq = 0;
+    for (unsigned int i = 0; i < n; i++)
+    {
+        sum += values[i];
+    }
+    *mean = sum / n;
+    for (unsigned int i = 0; i < n; i++)
+    {
+        sum_sq += (values[i] - *mean) * (values[i] - *mean);
+    }
+    *sigma = n > 1 ? sqrt(sum_sq / (n - 1)) : INFINITY;
+}
+
+bool measure_weight_until_stable(float tolerance_g, unsigned int max_ms, float *measure, int32_t *raw_measure, weight_stability_t *stability)
+{
+    float values[SAMPLE_RING_SIZE];
+    unsigned int n = 0;
+    uint32_t cursor = 0;
+    int64_t start_us = esp_timer_get_time();
+    int64_t deadline_us = start_us + (int64_t)max_ms * 1000;
+    float mean = 0, std_error = INFINITY;
+    bool stable = false;
+
+    while (n < SAMPLE_RING_SIZE)
+    {
+        weight_sample_t sample;
+        int64_t remaining_ms = (deadline_us - esp_timer_get_time()) / 1000;
+        if (remaining_ms <= 0 || !weight_interface_wait_sample(&cursor, &sample, remaining_ms))
+        {
+            break;
+        }
+        // Raw conversions are independent, unlike filtered ones, so their spread is the real noise
+        values[n++] = (float)sample.raw;
+
+        if (n < STABLE_MIN_SAMPLES)
+        {
+            continue;
+        }
+
+        // Mean of the inliers around the median, its standard error from the robust spread.
+        // With few samples nothing is rejected: a spike inflates the spread and keeps the loop reading
+        float sigma;
+        unsigned int inliers = 0;
+        if (n < STABLE_MAD_MIN_SAMPLES)
+        {
+            sample_stats(values, n, &mean, &sigma);
+            inliers = n;
+        }
+        else
+        {
+            float median;
+            robust_stats(values, n, &median, &sigma);
+            double sum = 0;
+            for (unsigned int i = 0; i < n; i++)
+            {
+                if (fabsf(values[i] - median) <= STABLE_OUTLIER_SIGMAS * sigma)
+                {
+                    sum += values[i];
+                    inliers++;
+                }
+            }
+            mean = inliers > 0 ? sum / inliers : median;
+        }
+        std_error = fabsf(weight_scale.scale) * sigma / sqrtf(inliers > 0 ? inliers : 1);
+
+        if (std_error <= tolerance_g)
+        {
+            stable = true;
+            break;
+        }
+    }
+
+    if (stability)
+    {
+        stability->samples = n;
+        stability->elapsed_ms = (esp_timer_get_time() - start_us) / 1000;
+        stability->std_error = std_error;
+        stability->stable = stable;
+    }
+
+    if (n == 0)
     {
         ESP_LOGE(TAG, "Failed to read weight");
         return false;
     }
-    else
+    if (n < STABLE_MIN_SAMPLES)
+    {
+        float sigma;
+        robust_stats(values, n, &mean, &sigma);
+    }
+
+    *raw_measure = (int32_t)lroundf(mean);
+    *measure = weight_interface_to_grams(mean);
+    ESP_LOGI(TAG, "Weight measure raw=%ld, clean=%lf. %s after %u samples in %lld ms (std error %.3fg)",
+             *raw_measure, *measure, stable ? "Stable" : "Not stable", n, (esp_timer_get_time() - start_us) / 1000, std_error);
+    return true;
+}
+
+// Stored and server values are plain integers, only known filter types are accepted
+static bool filter_type_from_int(int value, weight_filter_type_t *type)
+{
+    switch (value)
     {
-        // ESP_LOGI(TAG, "Values offset=%i, scale=%lf", weight_scale.offset, weight_scale.scale);
-        *measure = weight_scale.scale * (*raw_measure - weight_scale.offset);
-        ESP_LOGI(TAG, "Weight measure raw=%ld, clean=%lf. Averaged over %i times", *raw_measure, *measure, times);
+    case WEIGHT_FILTER_NONE:
+    case WEIGHT_FILTER_EMA:
+    case WEIGHT_FILTER_KALMAN:
+        *type = (weight_filter_type_t)value;
         return true;
+    default:
+        ESP_LOGW(TAG, "Unknown weight filter type %d, ignored", value);
+        return false;
     }
 }
 
 bool weight_interface_init()
 {
     unsigned int dt_pin, sck_pin;
-    if (get_stored_hx711_config(&dt_pin, &sck_pin, &weight_scale.offset, &weight_scale.scale))
+    int offset;
+    float scale;
+    weight_filter_config_t filter_config = WEIGHT_FILTER_DEFAULT_CONFIG;
+
+    if (!hx711_mutex)
+    {
+        hx711_mutex = xSemaphoreCreateMutex();
+    }
+
+    // Devices that never received a filter selection keep the default pipeline
+    int stored_type, stored_median;
+    if (get_stored_hx711_filter(&stored_type, &stored_median) && filter_type_from_int(stored_type, &filter_config.type))
+    {
+        filter_config.median_size = stored_median;
+    }
+
+    if (get_stored_hx711_config(&dt_pin, &sck_pin, &offset, &scale))
     {
+        xSemaphoreTake(hx711_mutex, portMAX_DELAY);
+        weight_scale.offset = offset;
+        weight_scale.scale = scale;
+        weight_scale.filter_config = filter_config;
+        weight_filter_init(&weight_scale.filter, &filter_config, scale);
         weight_scale.hx711.dout = (gpio_num_t)dt_pin;
         weight_scale.hx711.pd_sck = (gpio_num_t)sck_pin;
         weight_scale.hx711.gain = HX711_GAIN_A_128;
-        if (hx711_init(&weight_scale.hx711) != ESP_OK)
+        esp_err_t err = hx711_init(&weight_scale.hx711);
+        // Samples read with the previous pins or gain must not be averaged with new ones
+        atomic_store_explicit(&sample_first_valid, atomic_load_explicit(&sample_head, memory_order_acquire) + 1, memory_order_release);
+        xSemaphoreGive(hx711_mutex);
+
+        if (err != ESP_OK)
         {
             ESP_LOGE(TAG, "Failed to init HX711 hardware");
         }
         else
         {
+            if (!sampling_task &&
+                xTaskCreatePinnedToCore(weight_sampling_task, "weight_sampling", SAMPLING_TASK_STACK_SIZE, NULL,
+                                        SAMPLING_TASK_PRIORITY, &sampling_task, SAMPLING_TASK_CORE) != pdPASS)
+            {
+                ESP_LOGE(TAG, "Failed to start weight sampling task");
+                sampling_task = NULL;
+                return false;
+            }
             ESP_LOGI(TAG, "Weight scale is initialized");
             return true;
         }
     }
     else
     {
+        weight_scale.offset = offset;
+        weight_scale.scale = scale;
         ESP_LOGE(TAG, "The weight scale parameters are not found in the storage");
     }
     return false;
@@ -69,7 +490,7 @@ bool weight_interface_need_calibration()
     int32_t raw_measure = 0;
     bool measurement_failed = false;
 
-    if (!measure_weight(&measure, &raw_measure, 10))
+    if (!measure_weight_until_stable(CALIBRATION_TOLERANCE_G, CALIBRATION_MAX_MS, &measure, &raw_measure, NULL))
     {
         ESP_LOGE(TAG, "Failed to measure weight");
         measurement_failed = true;
@@ -82,14 +503,22 @@ bool weight_interface_need_calibration()
     unsigned int server_sck_pin = 0;
     int server_offset = 0;
     float server_scale = 1.0;
+    weight_filter_config_t server_filter = weight_scale.filter_config;
+    int server_filter_type = server_filter.type;
 
     // Call API to send the measure and get calibration parameters back
-    if (!send_weight_measurement(measure, (int)raw_measure, &server_need_calibration, &server_dt_pin, &server_sck_pin, &server_offset, &server_scale))
+    if (!send_weight_measurement(measure, (int)raw_measure, &server_need_calibration, &server_dt_pin, &server_sck_pin, &server_offset, &server_scale,
+                                 &server_filter_type, &server_filter.median_size))
     {
         ESP_LOGE(TAG, "Failed to send weight measurement to server");
         return true; // Assume calibration needed if API call fails
     }
 
+    if (!filter_type_from_int(server_filter_type, &server_filter.type))
+    {
+        server_filter = weight_scale.filter_config;
+    }
+
     bool parameters_changed = false;
 
     // Compare server parameters with current parameters
@@ -103,21 +532,36 @@ bool weight_interface_need_calibration()
         // Store new parameters
         store_hx711_config(server_dt_pin, server_sck_pin, server_offset, server_scale);
 
-        // Update local parameters
+        // Update local parameters, the filter noise model depends on the scale
+        xSemaphoreTake(hx711_mutex, portMAX_DELAY);
         weight_scale.offset = server_offset;
         weight_scale.scale = server_scale;
+        weight_filter_init(&weight_scale.filter, &weight_scale.filter_config, server_scale);
+        xSemaphoreGive(hx711_mutex);
 
-        // If pin configuration changed, reinitialize hardware
+        // If pin configuration changed, reinitialize hardware from the stored parameters
         if (server_dt_pin != (unsigned int)weight_scale.hx711.dout || server_sck_pin != (unsigned int)weight_scale.hx711.pd_sck)
         {
-            weight_scale.hx711.dout = (gpio_num_t)server_dt_pin;
-            weight_scale.hx711.pd_sck = (gpio_num_t)server_sck_pin;
             weight_interface_init();
         }
 
         parameters_changed = true;
     }
 
+    if (server_filter.type != weight_scale.filter_config.type ||
+        server_filter.median_size != weight_scale.filter_config.median_size)
+    {
+        ESP_LOGI(TAG, "Weight filter changed to type=%d, median=%d", server_filter.type, server_filter.median_size);
+        store_hx711_filter(server_filter.type, server_filter.median_size);
+
+        xSemaphoreTake(hx711_mutex, portMAX_DELAY);
+        weight_scale.filter_config = server_filter;
+        weight_filter_init(&weight_scale.filter, &server_filter, weight_scale.scale);
+        xSemaphoreGive(hx711_mutex);
+
+        parameters_changed = true;
+    }
+
     // If measurement failed, we need to keep calibrating
     if (measurement_failed)
     {
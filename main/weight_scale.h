@@ -1,8 +1,48 @@
 #ifndef WEIGTH_SCALE_H
 #define WEIGTH_SCALE_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
+// HX711 conversion as pushed by the sampling task, values in raw HX711 units
+typedef struct
+{
+    int32_t raw;
+    float filtered;       // Output of the weight_filter pipeline
+    float variance;       // Variance of `filtered`
+    int64_t timestamp_us; // esp_timer_get_time() when DOUT went ready
+} weight_sample_t;
+
 bool weight_interface_init();
 bool weight_interface_need_calibration();
+
+// Average of the `times` most recent conversions, waits only if fewer are available yet
 bool measure_weight(float *measure, int32_t *raw_measure, unsigned int times);
 
+// How much sampling measure_weight_until_stable needed
+typedef struct
+{
+    unsigned int samples;  // Conversions used, outliers included
+    unsigned int elapsed_ms;
+    float std_error;       // Standard error of the result in grams
+    bool stable;           // false if max_ms ran out before reaching the tolerance
+} weight_stability_t;
+
+// Sample fresh conversions until the standard error of their robust mean is under `tolerance_g`,
+// or `max_ms` is spent. Spikes are left out of the mean. False only if no conversion arrived.
+bool measure_weight_until_stable(float tolerance_g, unsigned int max_ms, float *measure, int32_t *raw_measure, weight_stability_t *stability);
+
+// Non-blocking read of the most recent filtered conversion, `variance` is in g^2
+bool measure_weight_latest(float *measure, float *variance, int64_t *timestamp_us);
+
+// Non-blocking average of the conversions taken during the last `window_ms`
+bool measure_weight_window(float *measure, int32_t *raw_measure, unsigned int window_ms);
+
+// Wait up to `timeout_ms` for a conversion newer than `*cursor`, then advance the cursor.
+// Start with `*cursor = 0` to get the next conversion from now on.
+bool weight_interface_wait_sample(uint32_t *cursor, weight_sample_t *sample, unsigned int timeout_ms);
+
+// Convert a raw HX711 value to grams using the current calibration
+float weight_interface_to_grams(float raw_measure);
+
 #endif // WEIGTH_SCALE_H
@@ -3,87 +3,410 @@
 #include "esp_wifi.h"
 #include "esp_event.h"
 #include "esp_http_client.h"
+#include "esp_random.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
 #include "freertos/event_groups.h"
+#include "esp_timer.h"
+#include <string.h>
 
 #include "storage.h"
+#include "wifi_config.h"
 
 static const char *TAG = "wifi";
 
-/* FreeRTOS event group to signal when we are connected*/
+/* FreeRTOS event group to signal the state of the link, kept for as long as the supervisor runs:
+ * - we are connected to the AP with an IP
+ * - we failed to connect after the maximum amount of retries, to a network never joined before
+ * - the AP refused the credentials, only the configuration portal can fix them */
 static EventGroupHandle_t s_wifi_event_group;
 
-/* The event group allows multiple bits for each event, but we only care about two events:
- * - we are connected to the AP with an IP
- * - we failed to connect after the maximum amount of retries */
 #define WIFI_CONNECTED_BIT BIT0
 #define WIFI_FAIL_BIT      BIT1
+#define WIFI_REJECTED_BIT  BIT2
 
-static int s_retry_num = 0;
 static const int WIFI_MAXIMUM_RETRY = 5;
 
+#define WIFI_AUTH_FAILURE_LIMIT 5      // Handshake failures in a row before the password is considered wrong
+#define WIFI_BACKOFF_MIN_MS 1000       // First reconnection delay, doubled after each failure
+#define WIFI_BACKOFF_MAX_MS 60000
+#define WIFI_BACKOFF_PORTAL_MAX_MS 15000 // Next to the portal, someone is waiting for the network to come back
+#define WIFI_ROAM_CHECK_MS 10000       // Signal of the access point checked this often while connected
+#define WIFI_ROAM_SCAN_MS 60000        // At most one roaming scan this often
+#define WIFI_ROAM_RSSI_THRESHOLD (-75) // dBm, below it a better access point with the same SSID is looked for
+#define WIFI_ROAM_RSSI_MARGIN 8        // dB, a candidate must be this much stronger to be worth the switch
+#define WIFI_ROAM_MAX_APS 8
+
+// Access point of the last successful connection. The DHCP lease is kept by lwIP itself
+// (CONFIG_LWIP_DHCP_RESTORE_LAST_IP), it asks for the same address again without a discover
+typedef struct {
+    char ssid[MAX_SSID_LEN]; // The cache is only valid for the stored credentials
+    uint8_t bssid[6];
+    uint8_t channel;
+} wifi_cache_t;
+
+// Driver events are handed to the supervisor task, it alone decides when to connect
+typedef enum {
+    SUPERVISOR_DISCONNECTED,
+    SUPERVISOR_GOT_IP,
+    SUPERVISOR_SCAN_DONE,
+    SUPERVISOR_RETRY_NOW,
+} supervisor_event_type_t;
+
+typedef struct {
+    supervisor_event_type_t type;
+    uint16_t reason; // wifi_err_reason_t of a disconnection
+} supervisor_event_t;
+
+static QueueHandle_t s_supervisor_queue;
+
+// Owned by the supervisor task once Wi-Fi is started
+static wifi_config_t s_wifi_config;
+static bool s_bssid_locked = false;     // Joining one access point, the cached or roaming one, not any with the SSID
+static bool s_leaving_for_roam = false; // Disconnected on purpose to join the locked access point
+static bool s_known_network = false;    // Joined before, with these credentials: never give up on it
+static bool s_link_up = false;
+static bool s_roam_scanning = false;
+static int8_t s_roam_from_rssi = 0;
+static uint8_t s_roam_from_bssid[6];
+static int64_t s_last_roam_scan_us = 0;
+static int64_t s_reconnect_at_us = 0;   // Next attempt once the backoff expires, 0 if none pending
+static int s_retry_num = 0;             // Failed attempts since the last connection
+static int s_auth_failures = 0;         // In a row, any other outcome resets it
+static wifi_timing_t s_timing;
+
+// The cached or roaming access point is gone: back to the strongest one with the SSID
+static void unlock_bssid(void)
+{
+    s_bssid_locked = false;
+    s_wifi_config.sta.channel = 0;
+    s_wifi_config.sta.bssid_set = false;
+    esp_wifi_set_config(WIFI_IF_STA, &s_wifi_config);
+}
+
+static void update_wifi_cache(const char *ssid)
+{
+    wifi_ap_record_t ap;
+    if (esp_wifi_sta_get_ap_info(&ap) != ESP_OK) {
+        return;
+    }
+
+    wifi_cache_t cache = {0};
+    strncpy(cache.ssid, ssid, sizeof(cache.ssid) - 1);
+    memcpy(cache.bssid, ap.bssid, sizeof(cache.bssid));
+    cache.channel = ap.primary;
+
+    // Flash is only written when the access point changed
+    wifi_cache_t stored;
+    size_t size = sizeof(stored);
+    if (!get_stored_wifi_cache(&stored, &size) || size != sizeof(stored) || memcmp(&stored, &cache, sizeof(cache)) != 0) {
+        ESP_LOGI(TAG, "Caching access point " MACSTR " on channel %d", MAC2STR(cache.bssid), cache.channel);
+        store_wifi_cache(&cache, sizeof(cache));
+    }
+}
+
+// Reasons the access point gives when the password does not match, anything else is the radio or the AP
+static bool is_auth_failure(uint16_t reason)
+{
+    switch (reason) {
+    case WIFI_REASON_4WAY_HANDSHAKE_TIMEOUT:
+    case WIFI_REASON_802_1X_AUTH_FAILED:
+    case WIFI_REASON_AUTH_FAIL:
+    case WIFI_REASON_HANDSHAKE_TIMEOUT:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void schedule_reconnect(void)
+{
+    // Each attempt scans every channel, which the portal clients feel: shorter delays only while it runs
+    wifi_mode_t mode;
+    unsigned int max_delay_ms = WIFI_BACKOFF_MAX_MS;
+    if (esp_wifi_get_mode(&mode) == ESP_OK && mode == WIFI_MODE_APSTA) {
+        max_delay_ms = WIFI_BACKOFF_PORTAL_MAX_MS;
+    }
+
+    // Equal jitter like the server calls, devices restarted by a power cut do not all hit the AP at once
+    unsigned int delay_ms = WIFI_BACKOFF_MIN_MS << (s_retry_num < 6 ? s_retry_num : 6);
+    if (delay_ms > max_delay_ms) {
+        delay_ms = max_delay_ms;
+    }
+    delay_ms = delay_ms / 2 + esp_random() % (delay_ms / 2 + 1);
+
+    s_retry_num++;
+    s_reconnect_at_us = esp_timer_get_time() + (int64_t)delay_ms * 1000;
+    ESP_LOGI(TAG, "retry to connect to the AP in %u ms (attempt %d)", delay_ms, s_retry_num);
+}
+
+static void connect(void)
+{
+    esp_err_t err = esp_wifi_connect();
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to start connecting: %s", esp_err_to_name(err));
+        schedule_reconnect();
+    }
+}
+
+static void handle_disconnection(uint16_t reason)
+{
+    s_roam_scanning = false;
+    if (s_leaving_for_roam) {
+        s_leaving_for_roam = false;
+        connect();
+        return;
+    }
+
+    if (s_link_up) {
+        s_link_up = false;
+        ESP_LOGW(TAG, "Link lost (reason %d), reconnecting", reason);
+    } else {
+        ESP_LOGI(TAG, "connect to the AP fail (reason %d)", reason);
+    }
+
+    // A cached or roaming access point that is gone costs one failed attempt, then the full scan runs
+    if (s_bssid_locked) {
+        ESP_LOGW(TAG, "Access point " MACSTR " not reachable, scanning", MAC2STR(s_wifi_config.sta.bssid));
+        if (s_timing.got_ip_us == 0) {
+            s_timing.fast = false;
+        }
+        unlock_bssid();
+        connect();
+        return;
+    }
+
+    // A single handshake timeout happens with a busy AP, a series of them means the password changed.
+    // Attempts go on behind the portal, the AP may get its old password back
+    if (is_auth_failure(reason)) {
+        s_auth_failures++;
+        if (s_auth_failures == WIFI_AUTH_FAILURE_LIMIT) {
+            ESP_LOGE(TAG, "Credentials refused %d times in a row, configuration needed", s_auth_failures);
+            xEventGroupSetBits(s_wifi_event_group, WIFI_REJECTED_BIT);
+        }
+    } else {
+        s_auth_failures = 0;
+    }
+
+    // A network never joined with these credentials may well be a typo, the portal gets a chance to fix it
+    if (!s_known_network && s_retry_num >= WIFI_MAXIMUM_RETRY) {
+        xEventGroupSetBits(s_wifi_event_group, WIFI_FAIL_BIT);
+    }
+    schedule_reconnect();
+}
+
+static void handle_got_ip(void)
+{
+    s_link_up = true;
+    s_known_network = true;
+    s_retry_num = 0;
+    s_auth_failures = 0;
+    s_reconnect_at_us = 0;
+    if (s_timing.got_ip_us == 0) {
+        s_timing.got_ip_us = esp_timer_get_time();
+    }
+    update_wifi_cache((const char *)s_wifi_config.sta.ssid);
+    xEventGroupClearBits(s_wifi_event_group, WIFI_FAIL_BIT | WIFI_REJECTED_BIT);
+    xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+}
+
+// Weak signal: look for another access point of the same network, at most once per WIFI_ROAM_SCAN_MS
+static void check_roaming(void)
+{
+    wifi_ap_record_t ap;
+    if (s_roam_scanning || esp_wifi_sta_get_ap_info(&ap) != ESP_OK || ap.rssi >= WIFI_ROAM_RSSI_THRESHOLD) {
+        return;
+    }
+
+    int64_t now = esp_timer_get_time();
+    if (s_last_roam_scan_us != 0 && now - s_last_roam_scan_us < (int64_t)WIFI_ROAM_SCAN_MS * 1000) {
+        return;
+    }
+    s_last_roam_scan_us = now;
+
+    wifi_scan_config_t scan_config = {.ssid = s_wifi_config.sta.ssid};
+    if (esp_wifi_scan_start(&scan_config, false) == ESP_OK) {
+        ESP_LOGI(TAG, "Weak signal (%d dBm), scanning for a better access point", ap.rssi);
+        s_roam_scanning = true;
+        s_roam_from_rssi = ap.rssi;
+        memcpy(s_roam_from_bssid, ap.bssid, sizeof(s_roam_from_bssid));
+    }
+}
+
+static void finish_roaming_scan(void)
+{
+    wifi_ap_record_t records[WIFI_ROAM_MAX_APS];
+    uint16_t count = WIFI_ROAM_MAX_APS;
+    if (!s_roam_scanning) {
+        esp_wifi_clear_ap_list();
+        return;
+    }
+    s_roam_scanning = false;
+    if (esp_wifi_scan_get_ap_records(&count, records) != ESP_OK) {
+        return;
+    }
+
+    const wifi_ap_record_t *best = NULL;
+    for (int i = 0; i < count; i++) {
+        if (memcmp(records[i].bssid, s_roam_from_bssid, sizeof(s_roam_from_bssid)) != 0 &&
+            (!best || records[i].rssi > best->rssi)) {
+            best = &records[i];
+        }
+    }
+    if (!best || best->rssi < s_roam_from_rssi + WIFI_ROAM_RSSI_MARGIN || !s_link_up) {
+        return;
+    }
+
+    ESP_LOGI(TAG, "Roaming from " MACSTR " (%d dBm) to " MACSTR " (%d dBm) on channel %d",
+             MAC2STR(s_roam_from_bssid), s_roam_from_rssi, MAC2STR(best->bssid), best->rssi, best->primary);
+    s_bssid_locked = true;
+    s_leaving_for_roam = true;
+    s_wifi_config.sta.channel = best->primary;
+    s_wifi_config.sta.bssid_set = true;
+    memcpy(s_wifi_config.sta.bssid, best->bssid, sizeof(s_wifi_config.sta.bssid));
+    esp_wifi_set_config(WIFI_IF_STA, &s_wifi_config);
+    esp_wifi_disconnect();
+}
+
+// Owns the station: reconnects with backoff, roams, and tells the rest of the firmware whether the link is up
+static void supervisor_task(void *arg)
+{
+    supervisor_event_t event;
+    while (true) {
+        TickType_t wait = portMAX_DELAY;
+        if (s_reconnect_at_us != 0) {
+            int64_t left_us = s_reconnect_at_us - esp_timer_get_time();
+            wait = left_us > 0 ? pdMS_TO_TICKS(left_us / 1000) + 1 : 0;
+        } else if (s_link_up) {
+            wait = pdMS_TO_TICKS(WIFI_ROAM_CHECK_MS);
+        }
+
+        if (xQueueReceive(s_supervisor_queue, &event, wait) == pdTRUE) {
+            switch (event.type) {
+            case SUPERVISOR_DISCONNECTED:
+                handle_disconnection(event.reason);
+                break;
+            case SUPERVISOR_GOT_IP:
+                handle_got_ip();
+                break;
+            case SUPERVISOR_SCAN_DONE:
+                finish_roaming_scan();
+                break;
+            case SUPERVISOR_RETRY_NOW:
+                // Only a pending backoff is cut short, an attempt in progress reports on its own
+                if (s_reconnect_at_us != 0) {
+                    s_retry_num = 0;
+                    s_reconnect_at_us = esp_timer_get_time();
+                }
+                break;
+            }
+        } else if (s_reconnect_at_us != 0) {
+            if (esp_timer_get_time() >= s_reconnect_at_us) {
+                s_reconnect_at_us = 0;
+                connect();
+            }
+        } else if (s_link_up) {
+            check_roaming();
+        }
+    }
+}
 
 static void event_handler(void* arg, esp_event_base_t event_base,
                                 int32_t event_id, void* event_data)
 {
+    supervisor_event_t event = {0};
     if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
         esp_wifi_connect();
-    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-        if (s_retry_num < WIFI_MAXIMUM_RETRY) {
-            esp_wifi_connect();
-            s_retry_num++;
-            ESP_LOGI(TAG, "retry to connect to the AP");
-        } else {
-            xEventGroupSetBits(s_wifi_event_group, WIFI_FAIL_BIT);
+        return;
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED) {
+        if (s_timing.connected_us == 0) {
+            s_timing.connected_us = esp_timer_get_time();
         }
-        ESP_LOGI(TAG,"connect to the AP fail");
+        return;
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
+        wifi_event_sta_disconnected_t* disconnected = (wifi_event_sta_disconnected_t*) event_data;
+        // Requests fail fast from now on, without waiting for the supervisor
+        xEventGroupClearBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+        event.type = SUPERVISOR_DISCONNECTED;
+        event.reason = disconnected->reason;
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_SCAN_DONE) {
+        event.type = SUPERVISOR_SCAN_DONE;
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
-        ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
-        ESP_LOGI(TAG, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
-        s_retry_num = 0;
-        xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
+        ip_event_got_ip_t* got_ip = (ip_event_got_ip_t*) event_data;
+        ESP_LOGI(TAG, "got ip:" IPSTR, IP2STR(&got_ip->ip_info.ip));
+        event.type = SUPERVISOR_GOT_IP;
+    } else {
+        return;
+    }
+
+    if (xQueueSend(s_supervisor_queue, &event, 0) != pdTRUE) {
+        ESP_LOGE(TAG, "Supervisor queue full, event %d dropped", event.type);
     }
 }
 
 bool try_wifi_connect(const char *ssid, const char *password) {
     s_wifi_event_group = xEventGroupCreate();
+    s_supervisor_queue = xQueueCreate(8, sizeof(supervisor_event_t));
     s_retry_num = 0;
 
-    esp_event_handler_instance_t instance_any_id;
-    esp_event_handler_instance_t instance_got_ip;
-    
     ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
                                                         ESP_EVENT_ANY_ID,
                                                         &event_handler,
                                                         NULL,
-                                                        &instance_any_id));
+                                                        NULL));
     ESP_ERROR_CHECK(esp_event_handler_instance_register(IP_EVENT,
                                                         IP_EVENT_STA_GOT_IP,
                                                         &event_handler,
                                                         NULL,
-                                                        &instance_got_ip));
+                                                        NULL));
 
-    wifi_config_t wifi_config = {0};
-    memcpy(wifi_config.sta.ssid, ssid, strlen(ssid));
-    memcpy(wifi_config.sta.password, password, strlen(password));
+    wifi_config_t *wifi_config = &s_wifi_config;
+    memset(wifi_config, 0, sizeof(wifi_config_t));
+    memcpy(wifi_config->sta.ssid, ssid, strlen(ssid));
+    memcpy(wifi_config->sta.password, password, strlen(password));
     
     if (strlen(password) == 0) {
-        wifi_config.sta.threshold.authmode = WIFI_AUTH_OPEN;
+        wifi_config->sta.threshold.authmode = WIFI_AUTH_OPEN;
     } else {
-        wifi_config.sta.threshold.authmode = WIFI_AUTH_WPA2_PSK;
-        wifi_config.sta.pmf_cfg.capable = true;
-        wifi_config.sta.pmf_cfg.required = false;
+        wifi_config->sta.threshold.authmode = WIFI_AUTH_WPA2_PSK;
+        wifi_config->sta.pmf_cfg.capable = true;
+        wifi_config->sta.pmf_cfg.required = false;
     }
 
+    // Without a locked BSSID every attempt picks the strongest access point broadcasting the SSID
+    wifi_config->sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+    wifi_config->sta.sort_method = WIFI_CONNECT_AP_BY_SIGNAL;
+
+    // Straight to the access point of the last boot: one channel probed instead of all of them
+    wifi_cache_t cache;
+    size_t cache_size = sizeof(cache);
+    s_known_network = get_stored_wifi_cache(&cache, &cache_size) && cache_size == sizeof(cache) &&
+                      strncmp(cache.ssid, ssid, sizeof(cache.ssid)) == 0 && cache.channel > 0;
+    s_bssid_locked = s_known_network;
+    if (s_bssid_locked) {
+        ESP_LOGI(TAG, "Fast connect to " MACSTR " on channel %d", MAC2STR(cache.bssid), cache.channel);
+        wifi_config->sta.channel = cache.channel;
+        wifi_config->sta.bssid_set = true;
+        memcpy(wifi_config->sta.bssid, cache.bssid, sizeof(cache.bssid));
+    }
+
+    memset(&s_timing, 0, sizeof(s_timing));
+    s_timing.fast = s_bssid_locked;
+    s_timing.start_us = esp_timer_get_time();
+
+    // Above the main task, a lost link is noticed before the next request goes out
+    xTaskCreate(supervisor_task, "wifi_supervisor", 4096, NULL, tskIDLE_PRIORITY + 2, NULL);
+
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &wifi_config));
+    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, wifi_config));
     ESP_ERROR_CHECK(esp_wifi_start());
 
-    /* Waiting until either the connection is established (WIFI_CONNECTED_BIT) or connection failed for the maximum
-     * number of re-tries (WIFI_FAIL_BIT). The bits are set by event_handler() (see above) */
+    /* Waiting until either the connection is established (WIFI_CONNECTED_BIT), the credentials are refused
+     * (WIFI_REJECTED_BIT) or a network never joined could not be found (WIFI_FAIL_BIT). A known network
+     * is waited for, the supervisor keeps trying. The bits are set by the supervisor (see above) */
     EventBits_t bits = xEventGroupWaitBits(s_wifi_event_group,
-            WIFI_CONNECTED_BIT | WIFI_FAIL_BIT,
+            WIFI_CONNECTED_BIT | WIFI_FAIL_BIT | WIFI_REJECTED_BIT,
             pdFALSE,
             pdFALSE,
             portMAX_DELAY);
@@ -94,7 +417,7 @@ bool try_wifi_connect(const char *ssid, const char *password) {
     if (bits & WIFI_CONNECTED_BIT) {
         ESP_LOGI(TAG, "connected to ap SSID:%s", ssid);
         success = true;
-    } else if (bits & WIFI_FAIL_BIT) {
+    } else if (bits & (WIFI_FAIL_BIT | WIFI_REJECTED_BIT)) {
         ESP_LOGI(TAG, "Failed to connect to SSID:%s", ssid);
         success = false;
     } else {
@@ -102,27 +425,35 @@ bool try_wifi_connect(const char *ssid, const char *password) {
         success = false;
     }
 
-    /* The event will not be processed after unregister */
-    ESP_ERROR_CHECK(esp_event_handler_instance_unregister(IP_EVENT, IP_EVENT_STA_GOT_IP, instance_got_ip));
-    ESP_ERROR_CHECK(esp_event_handler_instance_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID, instance_any_id));
-    vEventGroupDelete(s_wifi_event_group);
-
     return success;
 }
 
-bool wifi_connect_success(void)
+void wifi_init_driver(void)
 {
-    // Configuration variables
-    char ssid[MAX_SSID_LEN] = {0};
-    char password[MAX_PASS_LEN] = {0};
+    static bool initialized = false;
+    if (initialized) {
+        return;
+    }
+    initialized = true;
 
-    // Initialize TCP/IP and WiFi components first
     ESP_ERROR_CHECK(esp_netif_init());
     ESP_ERROR_CHECK(esp_event_loop_create_default());
     esp_netif_create_default_wifi_sta();
 
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+    // The configuration is set on every boot, the driver does not need to write it to flash
+    ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
+}
+
+bool wifi_connect_success(void)
+{
+    // Configuration variables
+    char ssid[MAX_SSID_LEN] = {0};
+    char password[MAX_PASS_LEN] = {0};
+
+    // Initialize TCP/IP and WiFi components first
+    wifi_init_driver();
 
     // Check if we have all required configuration
     if (!get_stored_wifi_credentials(ssid, password))
@@ -149,3 +480,36 @@ bool wifi_connect_success(void)
     
     return connected; // true = success, false = failed
 }
+
+void wifi_get_timing(wifi_timing_t *timing)
+{
+    *timing = s_timing;
+}
+
+bool wifi_link_up(void)
+{
+    return s_wifi_event_group && (xEventGroupGetBits(s_wifi_event_group) & WIFI_CONNECTED_BIT);
+}
+
+bool wifi_wait_link_up(int timeout_ms)
+{
+    if (!s_wifi_event_group) {
+        return false;
+    }
+    EventBits_t bits = xEventGroupWaitBits(s_wifi_event_group, WIFI_CONNECTED_BIT, pdFALSE, pdTRUE, pdMS_TO_TICKS(timeout_ms));
+    return bits & WIFI_CONNECTED_BIT;
+}
+
+bool wifi_credentials_invalid(void)
+{
+    return s_wifi_event_group && (xEventGroupGetBits(s_wifi_event_group) & WIFI_REJECTED_BIT);
+}
+
+void wifi_retry_now(void)
+{
+    if (!s_supervisor_queue) {
+        return;
+    }
+    supervisor_event_t event = {.type = SUPERVISOR_RETRY_NOW};
+    xQueueSend(s_supervisor_queue, &event, 0);
+}
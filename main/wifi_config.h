@@ -1,6 +1,37 @@
 #ifndef WIFI_CONFIG_H
 #define WIFI_CONFIG_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
+// Timestamps of the first connection, in esp_timer microseconds since boot
+typedef struct
+{
+    int64_t start_us;     // Wi-Fi started
+    int64_t connected_us; // Associated with the access point
+    int64_t got_ip_us;    // DHCP done
+    bool fast;            // Connected to the cached access point without a scan
+} wifi_timing_t;
+
+// Network interfaces, event loop and driver, shared by the station and the configuration portal
+void wifi_init_driver(void);
+
+// Start the station and its supervisor, which keeps reconnecting in the background.
+// False without credentials, when they are refused, or when a network never joined is not found
 bool wifi_connect_success(void);
 
+void wifi_get_timing(wifi_timing_t *timing);
+
+// Associated with an IP, requests have a chance to go out
+bool wifi_link_up(void);
+
+// Block until the link is up, false on timeout
+bool wifi_wait_link_up(int timeout_ms);
+
+// The access point refused the password repeatedly, only the configuration portal can help
+bool wifi_credentials_invalid(void);
+
+// Cut the backoff short and try the stored network again, no-op before the supervisor starts
+void wifi_retry_now(void);
+
 #endif // WIFI_CONFIG_H
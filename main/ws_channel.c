@@ -0,0 +1,405 @@
+#include <stdatomic.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_websocket_client.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+
+#include "storage.h"
+#include "json_stream.h"
+#include "progress_reporter.h"
+#include "ws_channel.h"
+
+static const char *TAG = "ws_channel";
+
+#define WS_BUFFER_SIZE 2048
+#define WS_FRAME_MAX_SIZE 4096 // Largest text frame accepted, a full plan fits
+#define WS_TASK_STACK_SIZE 6144 // TLS handshake and frame parsing happen in this task
+#define WS_RECONNECT_MS 5000
+#define WS_NETWORK_TIMEOUT_MS 10000
+#define WS_PING_INTERVAL_S 10
+#define WS_SEND_TIMEOUT_MS 1000
+#define WS_PROGRESS_ACK_MS 1000 // Past it the frame may be lost on a half-open socket, HTTP takes over
+#define WS_MESSAGE_SIZE 384
+#define WS_KEY_SIZE 16
+
+#define WS_OPCODE_CONTINUATION 0x00
+#define WS_OPCODE_TEXT 0x01
+
+extern const uint8_t server_cert_pem_start[] asm("_binary_server_cert_pem_start");
+
+static esp_websocket_client_handle_t client = NULL;
+// Queue of length 1 holding the length of the frame in `action_frame`, 0 wakes the caller on disconnect
+static QueueHandle_t action_mailbox = NULL;
+static SemaphoreHandle_t action_frame_lock = NULL;
+static char action_frame[WS_FRAME_MAX_SIZE + 1];
+static atomic_bool authenticated = false;
+
+// Answer of the server to a progress frame, matched by id
+typedef struct
+{
+    uint32_t id;
+    bool should_continue;
+} progress_ack_t;
+
+// Queue of length 1 holding the last progress ack, only the progress reporter task waits on it
+static QueueHandle_t progress_mailbox = NULL;
+static uint32_t progress_id = 0;
+
+static char ws_uri[MAX_URL_LEN + 64];
+static char api_token[MAX_TOKEN_LEN];
+
+// Reassembly of text frames split by the client buffer
+static char frame_buffer[WS_FRAME_MAX_SIZE + 1];
+static size_t frame_length = 0;
+static bool frame_too_large = false;
+
+static void post_action(const char *frame, size_t length)
+{
+    size_t stale;
+    xQueueReceive(action_mailbox, &stale, 0);
+
+    if (length > 0)
+    {
+        xSemaphoreTake(action_frame_lock, portMAX_DELAY);
+        memcpy(action_frame, frame, length);
+        action_frame[length] = '\0';
+        xSemaphoreGive(action_frame_lock);
+    }
+    xQueueSend(action_mailbox, &length, 0);
+}
+
+static bool send_message(json_writer_t *writer)
+{
+    json_write_object_end(writer);
+    if (!json_writer_finish(writer))
+    {
+        ESP_LOGE(TAG, "Message does not fit in %d bytes", writer->size);
+        return false;
+    }
+    return esp_websocket_client_send_text(client, writer->buffer, writer->length, pdMS_TO_TICKS(WS_SEND_TIMEOUT_MS)) >= 0;
+}
+
+static void send_hello(void)
+{
+    char message[WS_MESSAGE_SIZE];
+    json_writer_t writer;
+    json_writer_init(&writer, message, sizeof(message));
+    json_write_object_begin(&writer, NULL);
+    json_write_string(&writer, "type", "hello");
+    json_write_string(&writer, "token", api_token);
+    if (!send_message(&writer))
+    {
+        ESP_LOGE(TAG, "Failed to send hello");
+    }
+}
+
+static void handle_frame(const char *text, size_t length)
+{
+    json_reader_t reader;
+    char key[WS_KEY_SIZE];
+    char type[16] = {0};
+    char order_id[64] = {0};
+    char dose_id[64] = {0};
+    progress_ack_t ack = {.should_continue = true};
+
+    // Only the routing fields are read here, api.c decodes action frames
+    json_reader_init(&reader, text, length);
+    json_read_object_begin(&reader);
+    while (json_read_next_key(&reader, key, sizeof(key)))
+    {
+        if (strcmp(key, "type") == 0)
+        {
+            json_read_string(&reader, type, sizeof(type));
+        }
+        else if (strcmp(key, "orderId") == 0)
+        {
+            json_read_string(&reader, order_id, sizeof(order_id));
+        }
+        else if (strcmp(key, "doseId") == 0)
+        {
+            json_read_string(&reader, dose_id, sizeof(dose_id));
+        }
+        else if (strcmp(key, "id") == 0)
+        {
+            double id = 0;
+            json_read_number(&reader, &id);
+            ack.id = (uint32_t)id;
+        }
+        else if (strcmp(key, "continue") == 0)
+        {
+            json_read_bool(&reader, &ack.should_continue);
+        }
+        else
+        {
+            json_skip_value(&reader);
+        }
+    }
+
+    if (reader.error)
+    {
+        ESP_LOGE(TAG, "Failed to parse frame");
+    }
+    else if (type[0] == '\0')
+    {
+        ESP_LOGE(TAG, "No type field found in frame");
+    }
+    else if (strcmp(type, "welcome") == 0)
+    {
+        ESP_LOGI(TAG, "Authenticated");
+        atomic_store(&authenticated, true);
+    }
+    else if (strcmp(type, "action") == 0)
+    {
+        post_action(text, length);
+    }
+    else if (strcmp(type, "progressAck") == 0)
+    {
+        // Overwrite an ack nobody waited for, the reporter discards ids it did not send last
+        xQueueOverwrite(progress_mailbox, &ack);
+    }
+    else if (strcmp(type, "cancel") == 0)
+    {
+        if (order_id[0])
+        {
+            ESP_LOGI(TAG, "Server asked to cancel order %s", order_id);
+            progress_reporter_stop(order_id, NULL);
+        }
+    }
+    else
+    {
+        ESP_LOGE(TAG, "Unknown frame type: %s", type);
+    }
+}
+
+static void ws_event_handler(void *handler_args, esp_event_base_t base, int32_t event_id, void *event_data)
+{
+    esp_websocket_event_data_t *data = (esp_websocket_event_data_t *)event_data;
+
+    switch (event_id)
+    {
+    case WEBSOCKET_EVENT_CONNECTED:
+        ESP_LOGI(TAG, "Connected, authenticating");
+        send_hello();
+        break;
+    case WEBSOCKET_EVENT_DISCONNECTED:
+    case WEBSOCKET_EVENT_CLOSED:
+        ESP_LOGI(TAG, "Disconnected");
+        atomic_store(&authenticated, false);
+        post_action(NULL, 0); // Wake a pending request so it falls back to HTTP
+        break;
+    case WEBSOCKET_EVENT_DATA:
+        if (data->op_code != WS_OPCODE_TEXT && data->op_code != WS_OPCODE_CONTINUATION)
+        {
+            break;
+        }
+        if (data->payload_offset == 0)
+        {
+            frame_length = 0;
+            frame_too_large = false;
+        }
+        if (frame_length + data->data_len > WS_FRAME_MAX_SIZE)
+        {
+            frame_too_large = true;
+        }
+        else
+        {
+            memcpy(frame_buffer + frame_length, data->data_ptr, data->data_len);
+            frame_length += data->data_len;
+        }
+
+        if (data->payload_offset + data->data_len >= data->payload_len)
+        {
+            if (frame_too_large)
+            {
+                ESP_LOGE(TAG, "Frame of %d bytes dropped", data->payload_len);
+            }
+            else
+            {
+                frame_buffer[frame_length] = '\0';
+                handle_frame(frame_buffer, frame_length);
+            }
+        }
+        break;
+    case WEBSOCKET_EVENT_ERROR:
+        ESP_LOGE(TAG, "WebSocket error");
+        break;
+    default:
+        break;
+    }
+}
+
+bool ws_channel_start(const char *path)
+{
+    if (client)
+    {
+        return true;
+    }
+
+    char server_url[MAX_URL_LEN] = {0};
+    if (!get_stored_server_url(server_url) || !get_stored_api_token(api_token))
+    {
+        ESP_LOGE(TAG, "Missing server URL or API token");
+        return false;
+    }
+
+    // Same host and port as the HTTP API, only the scheme changes
+    if (strncmp(server_url, "https://", 8) == 0)
+    {
+        snprintf(ws_uri, sizeof(ws_uri), "wss://%s%s", server_url + 8, path);
+    }
+    else if (strncmp(server_url, "http://", 7) == 0)
+    {
+        snprintf(ws_uri, sizeof(ws_uri), "ws://%s%s", server_url + 7, path);
+    }
+    else
+    {
+        ESP_LOGE(TAG, "Unsupported server URL: %s", server_url);
+        return false;
+    }
+
+    if (!action_mailbox)
+    {
+        action_mailbox = xQueueCreate(1, sizeof(size_t));
+        action_frame_lock = xSemaphoreCreateMutex();
+        progress_mailbox = xQueueCreate(1, sizeof(progress_ack_t));
+        if (!action_mailbox || !action_frame_lock || !progress_mailbox)
+        {
+            ESP_LOGE(TAG, "Failed to create action mailbox");
+            return false;
+        }
+    }
+
+    esp_websocket_client_config_t config = {
+        .uri = ws_uri,
+        .cert_pem = (const char *)server_cert_pem_start,
+        .buffer_size = WS_BUFFER_SIZE,
+        .task_stack = WS_TASK_STACK_SIZE,
+        .reconnect_timeout_ms = WS_RECONNECT_MS,
+        .network_timeout_ms = WS_NETWORK_TIMEOUT_MS,
+        .ping_interval_sec = WS_PING_INTERVAL_S};
+
+    client = esp_websocket_client_init(&config);
+    if (!client)
+    {
+        ESP_LOGE(TAG, "Failed to create WebSocket client");
+        return false;
+    }
+
+    esp_websocket_register_events(client, WEBSOCKET_EVENT_ANY, ws_event_handler, NULL);
+    if (esp_websocket_client_start(client) != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Failed to start WebSocket client");
+        esp_websocket_client_destroy(client);
+        client = NULL;
+        return false;
+    }
+
+    ESP_LOGI(TAG, "WebSocket channel started on %s", ws_uri);
+    return true;
+}
+
+void ws_channel_stop(void)
+{
+    if (!client)
+    {
+        return;
+    }
+
+    esp_websocket_client_stop(client);
+    esp_websocket_client_destroy(client);
+    client = NULL;
+    atomic_store(&authenticated, false);
+    ESP_LOGI(TAG, "WebSocket channel stopped");
+}
+
+bool ws_channel_ready(void)
+{
+    return client && atomic_load(&authenticated) && esp_websocket_client_is_connected(client);
+}
+
+bool ws_channel_request_action(bool plan, unsigned int timeout_ms, char *frame, size_t frame_size, size_t *length)
+{
+    if (!ws_channel_ready())
+    {
+        return false;
+    }
+
+    // Drop an answer left over from an earlier request that timed out
+    size_t frame_length;
+    xQueueReceive(action_mailbox, &frame_length, 0);
+
+    char message[WS_MESSAGE_SIZE];
+    json_writer_t writer;
+    json_writer_init(&writer, message, sizeof(message));
+    json_write_object_begin(&writer, NULL);
+    json_write_string(&writer, "type", "next");
+    json_write_bool(&writer, "plan", plan);
+    if (!send_message(&writer))
+    {
+        ESP_LOGE(TAG, "Failed to send action request");
+        return false;
+    }
+
+    if (xQueueReceive(action_mailbox, &frame_length, pdMS_TO_TICKS(timeout_ms)) != pdTRUE)
+    {
+        ESP_LOGE(TAG, "No action received in %u ms", timeout_ms);
+        return false;
+    }
+    if (frame_length == 0 || frame_length >= frame_size)
+    {
+        return false;
+    }
+
+    xSemaphoreTake(action_frame_lock, portMAX_DELAY);
+    memcpy(frame, action_frame, frame_length + 1);
+    xSemaphoreGive(action_frame_lock);
+    *length = frame_length;
+    return true;
+}
+
+bool ws_channel_send_progress(const char *order_id, const char *dose_id, float weight_progress, bool *should_continue)
+{
+    if (!ws_channel_ready())
+    {
+        return false;
+    }
+
+    // Drop an ack left over from a frame that timed out
+    progress_ack_t ack;
+    xQueueReceive(progress_mailbox, &ack, 0);
+    uint32_t id = ++progress_id;
+
+    char message[WS_MESSAGE_SIZE];
+    json_writer_t writer;
+    json_writer_init(&writer, message, sizeof(message));
+    json_write_object_begin(&writer, NULL);
+    json_write_string(&writer, "type", "progress");
+    json_write_int(&writer, "id", (long)id);
+    json_write_string(&writer, "orderId", order_id);
+    json_write_string(&writer, "doseId", dose_id);
+    json_write_float(&writer, "weightProgress", weight_progress);
+    if (!send_message(&writer))
+    {
+        return false;
+    }
+
+    // Queued on the socket is not delivered, only the ack proves the server stored the progress
+    TickType_t deadline = xTaskGetTickCount() + pdMS_TO_TICKS(WS_PROGRESS_ACK_MS);
+    while (true)
+    {
+        TickType_t now = xTaskGetTickCount();
+        if ((int32_t)(deadline - now) <= 0 || xQueueReceive(progress_mailbox, &ack, deadline - now) != pdTRUE)
+        {
+            ESP_LOGW(TAG, "Progress %lu not acknowledged in %d ms", (unsigned long)id, WS_PROGRESS_ACK_MS);
+            return false;
+        }
+        if (ack.id == id)
+        {
+            *should_continue = ack.should_continue;
+            return true;
+        }
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef WS_CHANNEL_H
+#define WS_CHANNEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Optional persistent WebSocket to the server, api.c uses it for actions and progress when ready
+// and falls back to HTTP otherwise. Cancellations pushed by the server stop the pump directly.
+
+// Connect to `path` on the stored server URL, reconnects on its own. Does nothing if already started.
+bool ws_channel_start(const char *path);
+
+void ws_channel_stop(void);
+
+// Connected and authenticated
+bool ws_channel_ready(void);
+
+// Ask for the next action, copies the action frame text to `frame`, false on timeout or disconnect
+bool ws_channel_request_action(bool plan, unsigned int timeout_ms, char *frame, size_t frame_size, size_t *length);
+
+// Send a progress frame and wait for the server to acknowledge it, false if no ack came in time:
+// the progress may be lost and must go over HTTP. `should_continue` is false when the dose must end
+bool ws_channel_send_progress(const char *order_id, const char *dose_id, float weight_progress, bool *should_continue);
+
+#endif // WS_CHANNEL_H
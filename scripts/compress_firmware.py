@@ -0,0 +1,25 @@
+#!/usr/bin/env python3
+# Compress an application binary for OTA updates, the device inflates it with the ROM zlib decoder
+# Usage: compress_firmware.py <input.bin> <output.bin.zz>
+#
+# The image is cut in 64KB blocks compressed independently, each written as its length (32 bits,
+# little endian) and a zlib stream, so that an interrupted download resumes at a block boundary.
+
+import struct
+import sys
+import zlib
+
+BLOCK_SIZE = 64 * 1024
+
+with open(sys.argv[1], 'rb') as source:
+    image = source.read()
+
+compressed = bytearray()
+for offset in range(0, len(image), BLOCK_SIZE):
+    block = zlib.compress(image[offset:offset + BLOCK_SIZE], 9)
+    compressed += struct.pack('<I', len(block)) + block
+
+with open(sys.argv[2], 'wb') as target:
+    target.write(compressed)
+
+print(f'{sys.argv[2]}: {len(image)} -> {len(compressed)} bytes ({100 * len(compressed) / len(image):.0f}%)')
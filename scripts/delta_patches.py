@@ -0,0 +1,61 @@
+#!/usr/bin/env python3
+# Create delta OTA patches from previous releases to this build, and list them with the image hash in the OTA manifest
+# Usage: delta_patches.py <new.bin> <releases dir> <manifest.json> <output dir>
+#
+# Each release is kept as <releases dir>/<version>/autobar3.bin, a patch is created for every version
+# other than the one being built. Devices running that version download the patch instead of the image.
+
+import json
+import os
+import sys
+
+new_path, releases_dir, manifest_path, out_dir = sys.argv[1:5]
+
+with open(manifest_path) as source:
+    manifest = json.load(source)
+version = manifest['version']
+
+with open(new_path, 'rb') as source:
+    new_image = source.read()
+
+bases = []
+if os.path.isdir(releases_dir):
+    for base_version in sorted(os.listdir(releases_dir)):
+        base_path = os.path.join(releases_dir, base_version, 'autobar3.bin')
+        if base_version != version and os.path.isfile(base_path):
+            bases.append((base_version, base_path))
+
+patches = []
+if bases:
+    try:
+        import detools
+    except ImportError:
+        sys.exit('delta_patches.py: detools is required to create patches, pip install detools')
+
+    for base_version, base_path in bases:
+        with open(base_path, 'rb') as source:
+            base_image = source.read()
+
+        # The device compares it with esp_partition_get_sha256, which returns the hash appended to the image
+        if len(base_image) < 32 + 24 or base_image[23] != 1:
+            print(f'{base_path}: no appended SHA-256, skipped')
+            continue
+
+        patch_name = f'autobar3-{base_version}.patch'
+        patch_path = os.path.join(out_dir, patch_name)
+        with open(base_path, 'rb') as ffrom, open(new_path, 'rb') as fto, open(patch_path, 'wb') as fpatch:
+            detools.create_patch(ffrom, fto, fpatch, compression='heatshrink')
+
+        patch_size = os.path.getsize(patch_path)
+        print(f'{patch_name}: {base_version} -> {version}, {patch_size} bytes ({100 * patch_size / len(new_image):.1f}%)')
+        patches.append({'from': base_version, 'path': patch_name, 'sha256': base_image[-32:].hex()})
+
+manifest.setdefault('ota', {})['patches'] = patches
+
+# Devices check the image they downloaded, and key the resume point of an interrupted download, with it
+if len(new_image) >= 32 + 24 and new_image[23] == 1:
+    manifest['ota']['sha256'] = new_image[-32:].hex()
+
+with open(os.path.join(out_dir, 'manifest.json'), 'w') as target:
+    json.dump(manifest, target, indent=4)
+    target.write('\n')
@@ -0,0 +1,30 @@
+import { WebSocketServer } from 'ws';
+
+const DEVICE_SOCKET_PATH = '/api/devices/ws';
+
+/**
+ * Accept device WebSocket upgrades on an http server and hand them to the SvelteKit bundle
+ * Other upgrade requests are left alone (Vite HMR uses the same server in dev)
+ */
+export function attachDeviceSocket(server) {
+    const wss = new WebSocketServer({ noServer: true });
+
+    server.on('upgrade', (req, socket, head) => {
+        const { pathname } = new URL(req.url ?? '/', 'http://localhost');
+        if (pathname !== DEVICE_SOCKET_PATH) {
+            return;
+        }
+
+        // hooks.server.ts registers the handler when the bundle loads
+        const handleDeviceSocket = globalThis.autobarDeviceSocket;
+        if (!handleDeviceSocket) {
+            socket.destroy();
+            return;
+        }
+
+        wss.handleUpgrade(req, socket, head, (ws) => handleDeviceSocket(ws, req));
+    });
+
+    // Tells the verify API to advertise the WebSocket to devices
+    globalThis.autobarDeviceSocketPath = DEVICE_SOCKET_PATH;
+}
@@ -0,0 +1,16 @@
+// Production entry point: the adapter-node handler plus the device WebSocket
+import { createServer } from 'node:http';
+import { handler } from '../build/handler.js';
+import { attachDeviceSocket } from './device-socket.js';
+
+const host = process.env.HOST ?? '0.0.0.0';
+const port = Number(process.env.PORT ?? 3000);
+
+const server = createServer(handler);
+// Devices keep their connection between API calls, outlive their 55 s idle timeout
+server.keepAliveTimeout = 65 * 1000;
+attachDeviceSocket(server);
+
+server.listen(port, host, () => {
+    console.log(`Listening on http://${host}:${port}`);
+});
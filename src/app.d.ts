@@ -1,6 +1,13 @@
 // See https://svelte.dev/docs/kit/types#app.d.ts
 // for information about these interfaces
 declare global {
+    // Set by hooks.server.ts, called by the node server on device WebSocket upgrades
+    var autobarDeviceSocket:
+        | typeof import('$lib/server/device-socket').handleDeviceSocket
+        | undefined;
+    // Set by server/device-socket.js when the node server accepts device WebSockets
+    var autobarDeviceSocketPath: string | undefined;
+
     namespace App {
         interface Locals {
             user: import('$lib/server/auth').SessionValidationResult['user'];
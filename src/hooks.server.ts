@@ -1,5 +1,10 @@
 import type { Handle } from '@sveltejs/kit';
 import * as auth from '$lib/server/auth.js';
+import { handleDeviceSocket } from '$lib/server/device-socket';
+
+// The device WebSocket is upgraded by the node server (server/index.js) outside of SvelteKit,
+// it reaches the handler living in this bundle through globalThis
+globalThis.autobarDeviceSocket = handleDeviceSocket;
 
 const handleAuth: Handle = async ({ event, resolve }) => {
     const sessionToken = event.cookies.get(auth.sessionCookieName);
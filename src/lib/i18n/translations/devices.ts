@@ -87,6 +87,11 @@ export const devices = {
                     'Configure the GPIO pins for your HX711 weight sensor. After saving, the device will reinitialize its hardware.',
                 dtPin: 'DT Pin (Data)',
                 sckPin: 'SCK Pin (Clock)',
+                weightFilter: 'Weight Filter',
+                weightFilterNone: 'None (plain average)',
+                weightFilterEma: 'Exponential average',
+                weightFilterKalman: 'Kalman (recommended)',
+                medianSize: 'Spike Rejection Window (samples)',
                 savePins: 'Save Pins',
                 step2: 'Step 2: Weight Calibration',
                 calibrationDescription:
@@ -228,6 +233,11 @@ export const devices = {
                     "Configurez les broches GPIO pour votre capteur de poids HX711. Après sauvegarde, l'appareil réinitialisera son matériel.",
                 dtPin: 'Broche DT (Données)',
                 sckPin: 'Broche SCK (Horloge)',
+                weightFilter: 'Filtre de Poids',
+                weightFilterNone: 'Aucun (moyenne simple)',
+                weightFilterEma: 'Moyenne exponentielle',
+                weightFilterKalman: 'Kalman (recommandé)',
+                medianSize: 'Fenêtre de Rejet des Pics (échantillons)',
                 savePins: 'Sauvegarder les Broches',
                 step2: 'Étape 2: Calibrage du Poids',
                 calibrationDescription:
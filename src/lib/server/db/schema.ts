@@ -43,11 +43,15 @@ export const device = sqliteTable('device', {
     hx711Sck: integer('hx711_sck'), // GPIO pin for HX711 SCK (clock)
     hx711Offset: integer('hx711_offset'), // HX711 calibration offset (signed int)
     hx711Scale: real('hx711_scale'), // HX711 calibration scale (float)
+    hx711Filter: integer('hx711_filter').notNull().default(2), // Weight smoothing filter: 0 none, 1 EMA, 2 Kalman
+    hx711MedianSize: integer('hx711_median_size').notNull().default(5), // Median spike rejection window, odd, 1 disables it
     rgbRedPin: integer('rgb_red_pin'), // GPIO pin for RGB LED red channel
     rgbGreenPin: integer('rgb_green_pin'), // GPIO pin for RGB LED green channel
     rgbBluePin: integer('rgb_blue_pin'), // GPIO pin for RGB LED blue channel
     switchPin: integer('switch_pin'), // GPIO pin for switch/button input
-    switchIsInvertedLogic: integer('switch_is_inverted_logic', { mode: 'boolean' }).notNull().default(false) // true if low is active (pull-up), false if high is active (pull-down)
+    switchIsInvertedLogic: integer('switch_is_inverted_logic', { mode: 'boolean' }).notNull().default(false), // true if low is active (pull-up), false if high is active (pull-down)
+    reportEpoch: text('report_epoch'), // Outbox epoch of the last report replayed by the device
+    reportSeq: integer('report_seq').notNull().default(0) // Sequence number of that report, older ones are skipped
 });
 
 export const pump = sqliteTable('pump', {
@@ -0,0 +1,200 @@
+import { db } from '$lib/server/db';
+import * as table from '$lib/server/db/schema';
+import { eq, and, or, gt } from 'drizzle-orm';
+import { findPumpForOrderAndDose } from '$lib/server/device-capabilities';
+import { loadOrderDoses, buildPlan, isDoseComplete } from '$lib/server/dose-plan';
+import { waitForOrder, MAX_ACTION_WAIT_MS } from '$lib/server/order-notifier';
+
+export interface NextActionOptions {
+    plan?: boolean; // Device can run whole-order plans
+    wait?: number; // Long-poll duration in ms when there is no order
+    signal?: AbortSignal; // Stops the long-poll early
+}
+
+/**
+ * Next action for a device, shared by the action API and the device WebSocket
+ * Advances the order to its next dose, or completes it, as a side effect
+ */
+export async function getNextAction(
+    device: table.Device,
+    { plan, wait, signal }: NextActionOptions = {}
+): Promise<Record<string, unknown>> {
+    // Find pending or in-progress orders for this device
+    // Process in creation order (oldest first)
+    const findOrder = () =>
+        db
+            .select()
+            .from(table.order)
+            .where(
+                and(
+                    eq(table.order.deviceId, device.id),
+                    // Check for both pending and in-progress orders
+                    or(eq(table.order.status, 'pending'), eq(table.order.status, 'in_progress'))
+                )
+            )
+            .orderBy(table.order.createdAt)
+            .limit(1)
+            .get();
+
+    let order = await findOrder();
+
+    // Long-poll: hold the request until an order is created for this device
+    const waitMs = Math.min(Math.max(Number(wait) || 0, 0), MAX_ACTION_WAIT_MS);
+    if (!order && waitMs > 0) {
+        if (await waitForOrder(device.id, waitMs, signal)) {
+            order = await findOrder();
+        }
+    }
+
+    if (!order) {
+        return {
+            action: 'standby',
+            // The device already waited, it can ask again right away
+            idle: waitMs > 0 ? 0 : 1000
+        };
+    }
+
+    // If we have an order but no current dose, get the first dose
+    let currentDose;
+    if (!order.currentDoseId) {
+        // Get the first dose (lowest number) for this cocktail
+        currentDose = await db
+            .select()
+            .from(table.dose)
+            .where(eq(table.dose.cocktailId, order.cocktailId))
+            .orderBy(table.dose.number)
+            .limit(1)
+            .get();
+
+        if (currentDose) {
+            // Update the order with the first dose
+            await db
+                .update(table.order)
+                .set({
+                    currentDoseId: currentDose.id,
+                    doseProgress: 0, // Reset dose progress when setting a new dose
+                    updatedAt: new Date()
+                })
+                .where(eq(table.order.id, order.id));
+        }
+    } else {
+        // Get the current dose
+        currentDose = await db
+            .select()
+            .from(table.dose)
+            .where(eq(table.dose.id, order.currentDoseId))
+            .get();
+    }
+
+    // Verify the doseProgress of the Order
+    if (currentDose && isDoseComplete(order.doseProgress, currentDose.quantity)) {
+        // Find the next dose
+        const nextDose = await db
+            .select()
+            .from(table.dose)
+            .where(
+                and(
+                    eq(table.dose.cocktailId, order.cocktailId),
+                    gt(table.dose.number, currentDose.number)
+                )
+            )
+            .orderBy(table.dose.number)
+            .limit(1)
+            .get();
+
+        if (nextDose) {
+            // Move to the next dose and reset progress
+            await db
+                .update(table.order)
+                .set({
+                    currentDoseId: nextDose.id,
+                    doseProgress: 0,
+                    updatedAt: new Date()
+                })
+                .where(eq(table.order.id, order.id));
+
+            // Update currentDose to the next dose
+            currentDose = nextDose;
+        } else {
+            // No more doses, order is complete
+            await db
+                .update(table.order)
+                .set({
+                    status: 'completed',
+                    updatedAt: new Date()
+                })
+                .where(eq(table.order.id, order.id));
+
+            return {
+                action: 'completed',
+                orderId: order.id,
+                message: 'Order completed - drink ready for pickup'
+            };
+        }
+    }
+
+    if (!currentDose) {
+        return {
+            action: 'standby',
+            idle: 1000
+        };
+    }
+
+    // Firmware that can run a whole order gets every remaining dose it has a pump for
+    if (plan) {
+        const doses = await loadOrderDoses(order.cocktailId, device.id);
+        const startIndex = doses.findIndex(({ dose }) => dose.id === currentDose.id);
+        const plannedDoses =
+            startIndex >= 0 ? buildPlan(doses, startIndex, order.doseProgress || 0) : [];
+
+        if (plannedDoses.length === 0) {
+            return {
+                action: 'standby',
+                idle: 1000
+            };
+        }
+
+        return {
+            action: 'plan',
+            orderId: order.id,
+            doses: plannedDoses
+        };
+    }
+
+    // Find the pump for this dose
+    const pump = await findPumpForOrderAndDose(order.id, currentDose.id);
+    if (!pump || !pump.gpio) {
+        return {
+            action: 'standby',
+            idle: 1000
+        };
+    }
+
+    // Get ingredient information for weight conversion
+    const ingredient = await db
+        .select()
+        .from(table.ingredient)
+        .where(eq(table.ingredient.id, currentDose.ingredientId))
+        .get();
+
+    if (!ingredient) {
+        return {
+            action: 'standby',
+            idle: 1000
+        };
+    }
+
+    // Convert volumes (ml) to weights (grams) using ingredient density (g/L)
+    // Formula: weight_grams = volume_ml * (density_g_per_L / 1000)
+    const doseWeight = currentDose.quantity * (ingredient.density / 1000);
+    const doseWeightProgress = (order.doseProgress || 0) * (ingredient.density / 1000);
+
+    return {
+        action: 'pump',
+        orderId: order.id,
+        doseId: currentDose.id,
+        pumpGpio: pump.gpio,
+        doseWeight: doseWeight,
+        doseWeightProgress: doseWeightProgress
+    };
+}
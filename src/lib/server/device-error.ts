@@ -0,0 +1,63 @@
+import { db } from '$lib/server/db';
+import * as table from '$lib/server/db/schema';
+import { eq } from 'drizzle-orm';
+
+export interface OrderErrorResult {
+    status: number;
+    body: { success: boolean; message: string };
+}
+
+// Names of the firmware error_code_t values
+const errorCodeNames: Record<number, string> = {
+    0: 'Unknown error code',
+    1: 'General/unknown error',
+    2: 'Weight scale error',
+    3: 'No weight change',
+    4: 'Negative weight change',
+    5: 'Unable to report progress'
+};
+
+/**
+ * Mark an order as failed with the error reported by the device,
+ * shared by the error API and the report replay API
+ */
+export async function applyOrderError(
+    orderId: string,
+    errorCode: number,
+    message: string
+): Promise<OrderErrorResult> {
+    // Find the order
+    const order = await db.select().from(table.order).where(eq(table.order.id, orderId)).get();
+
+    if (!order) {
+        return {
+            status: 404,
+            body: {
+                success: false,
+                message: 'Order not found'
+            }
+        };
+    }
+
+    // Create a formatted error message combining error code and message
+    const errorCodeName = errorCodeNames[errorCode] || 'Unknown error code';
+    const formattedErrorMessage = `[${errorCode}] ${errorCodeName}: ${message}`;
+
+    // Update the order with the error
+    await db
+        .update(table.order)
+        .set({
+            status: 'failed',
+            errorMessage: formattedErrorMessage,
+            updatedAt: new Date()
+        })
+        .where(eq(table.order.id, orderId));
+
+    return {
+        status: 200,
+        body: {
+            success: true,
+            message: 'Error recorded'
+        }
+    };
+}
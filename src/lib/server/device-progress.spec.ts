@@ -0,0 +1,119 @@
+import { beforeEach, describe, expect, it, vi } from 'vitest';
+import * as table from '$lib/server/db/schema';
+import { applyDoseProgressSamples } from './device-progress';
+
+// Rows returned by the successive `select()...get()` of a transaction, and the updates it made
+const fake = vi.hoisted(() => ({
+    rows: [] as unknown[],
+    updates: [] as { table: unknown; values: Record<string, unknown> }[],
+    transactions: 0
+}));
+
+vi.mock('$lib/server/db', () => {
+    const tx = {
+        select: () => {
+            const query = {
+                from: () => query,
+                innerJoin: () => query,
+                where: () => query,
+                get: async () => fake.rows.shift()
+            };
+            return query;
+        },
+        update: (target: unknown) => ({
+            set: (values: Record<string, unknown>) => ({
+                where: async () => {
+                    fake.updates.push({ table: target, values });
+                }
+            })
+        })
+    };
+    return {
+        db: {
+            transaction: async (run: (transaction: typeof tx) => Promise<unknown>) => {
+                fake.transactions++;
+                return run(tx);
+            }
+        }
+    };
+});
+
+const order = { id: 'order-1', status: 'in_progress', currentDoseId: 'dose-1' };
+// 50 ml of an ingredient at 1000 g/L
+const dose = { dose: { id: 'dose-1', quantity: 50 }, ingredient: { density: 1000 } };
+
+describe('applyDoseProgressSamples', () => {
+    beforeEach(() => {
+        fake.rows = [];
+        fake.updates = [];
+        fake.transactions = 0;
+    });
+
+    it('stores only the latest sample of the batch, in one transaction', async () => {
+        fake.rows = [order, dose];
+        const result = await applyDoseProgressSamples('order-1', 'dose-1', [
+            { t: 0, weightProgress: 10 },
+            { t: 800, weightProgress: 30 },
+            { t: 400, weightProgress: 20 }
+        ]);
+
+        expect(result).toEqual({ status: 200, body: { message: 'Progress updated', continue: true } });
+        expect(fake.transactions).toBe(1);
+        expect(fake.updates).toHaveLength(1);
+        expect(fake.updates[0].table).toBe(table.order);
+        expect(fake.updates[0].values.doseProgress).toBe(30);
+    });
+
+    it('tells the device to stop once the dose quantity is reached', async () => {
+        fake.rows = [order, dose];
+        const result = await applyDoseProgressSamples('order-1', 'dose-1', [
+            { t: 0, weightProgress: 45 },
+            { t: 1000, weightProgress: 52 }
+        ]);
+
+        expect(result.status).toBe(200);
+        expect(result.body.continue).toBe(false);
+    });
+
+    it('starts a pending order before storing its progress', async () => {
+        fake.rows = [{ ...order, status: 'pending' }, dose];
+        await applyDoseProgressSamples('order-1', 'dose-1', [{ t: 0, weightProgress: 5 }]);
+
+        expect(fake.updates.map((update) => update.values.status)).toEqual([
+            'in_progress',
+            undefined
+        ]);
+    });
+
+    it('stops a dose of an order that is no longer active without storing anything', async () => {
+        fake.rows = [{ ...order, status: 'cancelled' }];
+        const result = await applyDoseProgressSamples('order-1', 'dose-1', [
+            { t: 0, weightProgress: 5 }
+        ]);
+
+        expect(result.status).toBe(200);
+        expect(result.body.continue).toBe(false);
+        expect(fake.updates).toHaveLength(0);
+    });
+
+    it('rejects a batch for a dose that is not the current one', async () => {
+        fake.rows = [{ ...order, currentDoseId: 'dose-2' }];
+        const result = await applyDoseProgressSamples('order-1', 'dose-1', [
+            { t: 0, weightProgress: 5 }
+        ]);
+
+        expect(result.status).toBe(400);
+        expect(result.body.continue).toBe(false);
+        expect(fake.updates.some((update) => 'doseProgress' in update.values)).toBe(false);
+    });
+
+    it('reports an unknown order', async () => {
+        fake.rows = [undefined];
+        const result = await applyDoseProgressSamples('missing', 'dose-1', [
+            { t: 0, weightProgress: 5 }
+        ]);
+
+        expect(result.status).toBe(404);
+        expect(fake.updates).toHaveLength(0);
+    });
+});
@@ -0,0 +1,141 @@
+import { db } from '$lib/server/db';
+import * as table from '$lib/server/db/schema';
+import { eq } from 'drizzle-orm';
+
+export interface DoseProgressResult {
+    status: number;
+    body: { message: string; continue?: boolean };
+}
+
+// Progress measured by the device `t` milliseconds after it started pouring the dose
+export interface ProgressSample {
+    t: number;
+    weightProgress: number;
+}
+
+type Transaction = Parameters<Parameters<typeof db.transaction>[0]>[0];
+
+/**
+ * Store the progress of the dose being poured, shared by the progress API and the device WebSocket
+ * `continue` is false once the dose is complete or the order is no longer active
+ */
+export async function applyDoseProgress(
+    orderId: string,
+    doseId: string,
+    weightProgress: number
+): Promise<DoseProgressResult> {
+    return applyDoseProgressSamples(orderId, doseId, [{ t: 0, weightProgress }]);
+}
+
+/**
+ * Store a batch of progress samples of one dose in a single transaction
+ * Progress is cumulative, so only the latest sample is written: one update whatever the batch size
+ */
+export async function applyDoseProgressSamples(
+    orderId: string,
+    doseId: string,
+    samples: ProgressSample[]
+): Promise<DoseProgressResult> {
+    const latest = samples.reduce((last, sample) => (sample.t >= last.t ? sample : last));
+    return db.transaction((tx) => storeDoseProgress(tx, orderId, doseId, latest.weightProgress));
+}
+
+async function storeDoseProgress(
+    tx: Transaction,
+    orderId: string,
+    doseId: string,
+    weightProgress: number
+): Promise<DoseProgressResult> {
+    // Find the order
+    const order = await tx.select().from(table.order).where(eq(table.order.id, orderId)).get();
+
+    if (!order) {
+        return {
+            status: 404,
+            body: {
+                message: 'Order not found'
+            }
+        };
+    }
+
+    // Check if order status is valid for progress updates
+    if (order.status !== 'pending' && order.status !== 'in_progress') {
+        // For cancelled/completed orders, tell device to stop but don't error
+        return {
+            status: 200,
+            body: {
+                message: `Order status is ${order.status} - stopping pump`,
+                continue: false
+            }
+        };
+    }
+
+    // If order is pending, update it to in_progress
+    if (order.status === 'pending') {
+        await tx
+            .update(table.order)
+            .set({
+                status: 'in_progress',
+                updatedAt: new Date()
+            })
+            .where(eq(table.order.id, orderId));
+    }
+
+    // Verify if the doseId in the request corresponds to the currentDose for this Order
+    if (order.currentDoseId !== doseId) {
+        return {
+            status: 400,
+            body: {
+                message: 'Reported dose does not match current dose for this order',
+                continue: false
+            }
+        };
+    }
+
+    // Get the current dose with ingredient information
+    const currentDose = await tx
+        .select({
+            dose: table.dose,
+            ingredient: table.ingredient
+        })
+        .from(table.dose)
+        .innerJoin(table.ingredient, eq(table.dose.ingredientId, table.ingredient.id))
+        .where(eq(table.dose.id, doseId))
+        .get();
+
+    if (!currentDose) {
+        return {
+            status: 404,
+            body: {
+                message: 'Dose not found'
+            }
+        };
+    }
+
+    // Convert weight progress to volume progress using ingredient density
+    // Formula: volume (ml) = weight (g) / density (g/L) * 1000
+    const volumeProgress = (weightProgress / currentDose.ingredient.density) * 1000;
+
+    // Update the progress after verification (store volume progress)
+    await tx
+        .update(table.order)
+        .set({
+            doseProgress: volumeProgress,
+            updatedAt: new Date()
+        })
+        .where(eq(table.order.id, orderId));
+
+    // We don't update the order status or move to the next dose here
+    // That will be handled by the action API when the device requests the next action
+
+    // If the volume progress >= dose quantity, tell the device to stop pouring
+    const shouldContinue = volumeProgress < currentDose.dose.quantity;
+
+    return {
+        status: 200,
+        body: {
+            message: 'Progress updated',
+            continue: shouldContinue
+        }
+    };
+}
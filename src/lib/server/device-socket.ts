@@ -0,0 +1,125 @@
+import type { IncomingMessage } from 'node:http';
+import type { WebSocket, RawData } from 'ws';
+import * as table from '$lib/server/db/schema';
+import { authenticateDevice } from '$lib/server/device-auth';
+import { getNextAction } from '$lib/server/device-action';
+import { applyDoseProgress } from '$lib/server/device-progress';
+import { onOrderCancelled, MAX_ACTION_WAIT_MS } from '$lib/server/order-notifier';
+
+const HELLO_TIMEOUT_MS = 10 * 1000;
+
+// Close codes in the application range
+const CLOSE_INVALID_MESSAGE = 4000;
+const CLOSE_UNAUTHORIZED = 4001;
+
+// authenticateDevice rate limits by forwarded IP, give it the upgrade request headers
+function toRequest(req: IncomingMessage): Request {
+    const headers = new Headers();
+    const forwarded = req.headers['x-forwarded-for'];
+    if (forwarded) {
+        headers.set('x-forwarded-for', Array.isArray(forwarded) ? forwarded[0] : forwarded);
+    }
+    return new Request(`http://localhost${req.url ?? '/'}`, { headers });
+}
+
+/**
+ * Serve one device WebSocket, frames are JSON text messages with a `type` field
+ * Device: hello (with token), next (ask for an action), progress
+ * Server: welcome, action, progressAck (answer to each progress frame), cancel
+ */
+export function handleDeviceSocket(socket: WebSocket, req: IncomingMessage): void {
+    let device: table.Device | null = null;
+    let closed = false;
+    let waitAbort: AbortController | null = null;
+    let unsubscribe: (() => void) | null = null;
+
+    const send = (message: Record<string, unknown>) => {
+        if (!closed) {
+            socket.send(JSON.stringify(message));
+        }
+    };
+
+    const helloTimer = setTimeout(() => socket.close(CLOSE_UNAUTHORIZED, 'Missing hello'), HELLO_TIMEOUT_MS);
+
+    socket.on('message', async (raw: RawData) => {
+        let data;
+        try {
+            data = JSON.parse(raw.toString());
+        } catch {
+            socket.close(CLOSE_INVALID_MESSAGE, 'Invalid JSON');
+            return;
+        }
+
+        if (!device) {
+            if (data.type !== 'hello') {
+                socket.close(CLOSE_UNAUTHORIZED, 'Not authenticated');
+                return;
+            }
+            clearTimeout(helloTimer);
+
+            const authResult = await authenticateDevice(toRequest(req), data.token);
+            if (!authResult.success) {
+                socket.close(CLOSE_UNAUTHORIZED, authResult.error);
+                return;
+            }
+            if (closed) {
+                return;
+            }
+
+            device = authResult.device;
+            unsubscribe = onOrderCancelled(device.id, (orderId) => send({ type: 'cancel', orderId }));
+            send({ type: 'welcome' });
+            return;
+        }
+
+        try {
+            switch (data.type) {
+                case 'next': {
+                    // A new request replaces any long-poll still waiting
+                    waitAbort?.abort();
+                    const abort = new AbortController();
+                    waitAbort = abort;
+                    const action = await getNextAction(device, {
+                        plan: data.plan,
+                        wait: MAX_ACTION_WAIT_MS,
+                        signal: abort.signal
+                    });
+                    if (!abort.signal.aborted) {
+                        send({ type: 'action', ...action });
+                    }
+                    break;
+                }
+                case 'progress': {
+                    const { status, body } = await applyDoseProgress(
+                        data.orderId,
+                        data.doseId,
+                        data.weightProgress
+                    );
+                    // The device only counts a progress as delivered once acknowledged,
+                    // otherwise it sends it again over HTTP
+                    send({
+                        type: 'progressAck',
+                        id: data.id,
+                        orderId: data.orderId,
+                        doseId: data.doseId,
+                        // An unknown order or dose stops the pump, like a refused HTTP report would
+                        continue: status === 200 && body.continue === true,
+                        message: body.message
+                    });
+                    break;
+                }
+                default:
+                    socket.close(CLOSE_INVALID_MESSAGE, 'Unknown message type');
+            }
+        } catch (error) {
+            console.error('Device socket error:', error);
+        }
+    });
+
+    socket.on('close', () => {
+        closed = true;
+        clearTimeout(helloTimer);
+        waitAbort?.abort();
+        unsubscribe?.();
+    });
+}
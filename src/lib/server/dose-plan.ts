@@ -0,0 +1,103 @@
+import { db } from '$lib/server/db';
+import * as table from '$lib/server/db/schema';
+import { eq, and, isNotNull } from 'drizzle-orm';
+
+export interface PlannedDose {
+    doseId: string;
+    pumpGpio: number;
+    doseWeight: number;
+    doseWeightProgress: number;
+}
+
+export interface OrderDose {
+    dose: table.Dose;
+    ingredient: table.Ingredient;
+    pumpGpio: number | null;
+}
+
+/**
+ * Load every dose of an order's cocktail, in serving order, with its ingredient
+ * and the GPIO of an available pump on the device (null if none)
+ * Two queries whatever the number of doses
+ */
+export async function loadOrderDoses(cocktailId: string, deviceId: string): Promise<OrderDose[]> {
+    const doses = await db
+        .select({
+            dose: table.dose,
+            ingredient: table.ingredient
+        })
+        .from(table.dose)
+        .innerJoin(table.ingredient, eq(table.dose.ingredientId, table.ingredient.id))
+        .where(eq(table.dose.cocktailId, cocktailId))
+        .orderBy(table.dose.number);
+
+    const pumps = await db
+        .select()
+        .from(table.pump)
+        .where(
+            and(
+                eq(table.pump.deviceId, deviceId),
+                eq(table.pump.isEmpty, false), // Pump is not empty
+                isNotNull(table.pump.gpio) // Has valid GPIO pin
+            )
+        );
+
+    // First available pump per ingredient, same choice as findPumpForOrderAndDose
+    const gpioByIngredient = new Map<string, number>();
+    for (const pump of pumps) {
+        if (pump.ingredientId && pump.gpio !== null && !gpioByIngredient.has(pump.ingredientId)) {
+            gpioByIngredient.set(pump.ingredientId, pump.gpio);
+        }
+    }
+
+    return doses.map(({ dose, ingredient }) => ({
+        dose,
+        ingredient,
+        pumpGpio: gpioByIngredient.get(ingredient.id) ?? null
+    }));
+}
+
+// Convert volumes (ml) to weights (grams) using ingredient density (g/L)
+export function volumeToWeight(volume: number, ingredient: table.Ingredient): number {
+    return volume * (ingredient.density / 1000);
+}
+
+// Convert weights (grams) to volumes (ml) using ingredient density (g/L)
+export function weightToVolume(weight: number, ingredient: table.Ingredient): number {
+    return (weight / ingredient.density) * 1000;
+}
+
+// Shortfall (ml) still counted as a complete dose, below what a second pump start could pour
+export const DOSE_COMPLETE_TOLERANCE_ML = 0.5;
+
+// Shared by the action and dose completion APIs so both agree on when to move to the next dose
+export function isDoseComplete(volumeProgress: number, quantity: number): boolean {
+    return volumeProgress >= quantity - DOSE_COMPLETE_TOLERANCE_ML;
+}
+
+/**
+ * Build the plan for the remaining doses, starting at `startIndex` with `startProgress` ml
+ * already poured. The plan stops before the first dose without a pump.
+ */
+export function buildPlan(
+    doses: OrderDose[],
+    startIndex: number,
+    startProgress: number
+): PlannedDose[] {
+    const plan: PlannedDose[] = [];
+
+    for (let i = startIndex; i < doses.length; i++) {
+        const { dose, ingredient, pumpGpio } = doses[i];
+        if (!pumpGpio) {
+            break;
+        }
+        plan.push({
+            doseId: dose.id,
+            pumpGpio,
+            doseWeight: volumeToWeight(dose.quantity, ingredient),
+            doseWeightProgress: i === startIndex ? volumeToWeight(startProgress, ingredient) : 0
+        });
+    }
+
+    return plan;
+}
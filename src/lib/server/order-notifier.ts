@@ -0,0 +1,78 @@
+// In-memory wake-up list for devices long-polling the action API
+// Map<deviceId, Set<wake callback>>
+const waitingDevices = new Map<string, Set<() => void>>();
+
+// Upper bound for the `wait` parameter, stays below common proxy idle timeouts
+export const MAX_ACTION_WAIT_MS = 30 * 1000;
+
+/**
+ * Resolve when an order is created for the device, or after `timeoutMs`
+ * Resolves true if woken by an order, false on timeout or abort
+ */
+export function waitForOrder(deviceId: string, timeoutMs: number, signal?: AbortSignal): Promise<boolean> {
+    return new Promise((resolve) => {
+        let waiters = waitingDevices.get(deviceId);
+        if (!waiters) {
+            waiters = new Set();
+            waitingDevices.set(deviceId, waiters);
+        }
+
+        const done = (woken: boolean) => {
+            clearTimeout(timer);
+            signal?.removeEventListener('abort', onAbort);
+            waiters!.delete(wake);
+            if (waiters!.size === 0 && waitingDevices.get(deviceId) === waiters) {
+                waitingDevices.delete(deviceId);
+            }
+            resolve(woken);
+        };
+        const wake = () => done(true);
+        const onAbort = () => done(false);
+        const timer = setTimeout(() => done(false), timeoutMs);
+
+        waiters.add(wake);
+        signal?.addEventListener('abort', onAbort);
+    });
+}
+
+// Wake every request waiting for an order on this device
+export function notifyOrder(deviceId: string): void {
+    const waiters = waitingDevices.get(deviceId);
+    if (!waiters) {
+        return;
+    }
+    for (const wake of [...waiters]) {
+        wake();
+    }
+}
+
+// Listeners for order cancellations, one per connected device socket
+// Map<deviceId, Set<listener>>
+const cancelListeners = new Map<string, Set<(orderId: string) => void>>();
+
+// Register a cancellation listener for a device, returns the unsubscribe function
+export function onOrderCancelled(deviceId: string, listener: (orderId: string) => void): () => void {
+    let listeners = cancelListeners.get(deviceId);
+    if (!listeners) {
+        listeners = new Set();
+        cancelListeners.set(deviceId, listeners);
+    }
+    listeners.add(listener);
+
+    return () => {
+        listeners!.delete(listener);
+        if (listeners!.size === 0 && cancelListeners.get(deviceId) === listeners) {
+            cancelListeners.delete(deviceId);
+        }
+    };
+}
+
+// Tell a connected device to stop pouring a cancelled order
+export function notifyOrderCancelled(deviceId: string | null, orderId: string): void {
+    if (!deviceId) {
+        return;
+    }
+    for (const listener of [...(cancelListeners.get(deviceId) ?? [])]) {
+        listener(orderId);
+    }
+}
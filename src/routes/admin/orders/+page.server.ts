@@ -4,6 +4,7 @@ import type { PageServerLoad, Actions } from './$types';
 import { db } from '$lib/server/db';
 import * as table from '$lib/server/db/schema';
 import { selectVerifiedProfile } from '$lib/server/auth.js';
+import { notifyOrderCancelled } from '$lib/server/order-notifier';
 
 export const load: PageServerLoad = async ({ locals }) => {
     // Check if user is logged in, profile exists and is verified
@@ -101,13 +102,19 @@ export const actions: Actions = {
         }
 
         // Update order status to cancelled
-        await db
+        const cancelled = await db
             .update(table.order)
             .set({
                 status: 'cancelled',
                 updatedAt: new Date()
             })
-            .where(eq(table.order.id, orderId));
+            .where(eq(table.order.id, orderId))
+            .returning({ deviceId: table.order.deviceId });
+
+        // Stop the pump right away on a device connected by WebSocket
+        for (const { deviceId } of cancelled) {
+            notifyOrderCancelled(deviceId, orderId);
+        }
 
         return { success: true };
     }
@@ -1,13 +1,10 @@
 import { json } from '@sveltejs/kit';
-import { db } from '$lib/server/db';
-import * as table from '$lib/server/db/schema';
-import { eq, and, or, gt, isNull } from 'drizzle-orm';
-import { findPumpForOrderAndDose } from '$lib/server/device-capabilities';
 import { authenticateDevice } from '$lib/server/device-auth';
+import { getNextAction } from '$lib/server/device-action';
 
 export async function POST({ request }) {
     const data = await request.json();
-    const { token } = data;
+    const { token, plan, wait } = data;
 
     // Authenticate device (don't update ping time here, we handle it below)
     const authResult = await authenticateDevice(request, token, false);
@@ -15,151 +12,5 @@ export async function POST({ request }) {
         return json({ error: authResult.error }, { status: authResult.status });
     }
 
-    const device = authResult.device;
-
-    // Find pending or in-progress orders for this device
-    // Process in creation order (oldest first)
-    const order = await db
-        .select()
-        .from(table.order)
-        .where(
-            and(
-                eq(table.order.deviceId, device.id),
-                // Check for both pending and in-progress orders
-                or(eq(table.order.status, 'pending'), eq(table.order.status, 'in_progress'))
-            )
-        )
-        .orderBy(table.order.createdAt)
-        .limit(1)
-        .get();
-
-    if (!order) {
-        return json({
-            action: 'standby',
-            idle: 1000
-        });
-    }
-
-    // If we have an order but no current dose, get the first dose
-    let currentDose;
-    if (!order.currentDoseId) {
-        // Get the first dose (lowest number) for this cocktail
-        currentDose = await db
-            .select()
-            .from(table.dose)
-            .where(eq(table.dose.cocktailId, order.cocktailId))
-            .orderBy(table.dose.number)
-            .limit(1)
-            .get();
-
-        if (currentDose) {
-            // Update the order with the first dose
-            await db
-                .update(table.order)
-                .set({
-                    currentDoseId: currentDose.id,
-                    doseProgress: 0, // Reset dose progress when setting a new dose
-                    updatedAt: new Date()
-                })
-                .where(eq(table.order.id, order.id));
-        }
-    } else {
-        // Get the current dose
-        currentDose = await db
-            .select()
-            .from(table.dose)
-            .where(eq(table.dose.id, order.currentDoseId))
-            .get();
-    }
-
-    // Verify the doseProgress of the Order
-    if (currentDose && order.doseProgress >= currentDose.quantity) {
-        // Find the next dose
-        const nextDose = await db
-            .select()
-            .from(table.dose)
-            .where(
-                and(
-                    eq(table.dose.cocktailId, order.cocktailId),
-                    gt(table.dose.number, currentDose.number)
-                )
-            )
-            .orderBy(table.dose.number)
-            .limit(1)
-            .get();
-
-        if (nextDose) {
-            // Move to the next dose and reset progress
-            await db
-                .update(table.order)
-                .set({
-                    currentDoseId: nextDose.id,
-                    doseProgress: 0,
-                    updatedAt: new Date()
-                })
-                .where(eq(table.order.id, order.id));
-
-            // Update currentDose to the next dose
-            currentDose = nextDose;
-        } else {
-            // No more doses, order is complete
-            await db
-                .update(table.order)
-                .set({
-                    status: 'completed',
-                    updatedAt: new Date()
-                })
-                .where(eq(table.order.id, order.id));
-
-            return json({
-                action: 'completed',
-                orderId: order.id,
-                message: 'Order completed - drink ready for pickup'
-            });
-        }
-    }
-
-    if (!currentDose) {
-        return json({
-            action: 'standby',
-            idle: 1000
-        });
-    }
-
-    // Find the pump for this dose
-    const pump = await findPumpForOrderAndDose(order.id, currentDose.id);
-    if (!pump || !pump.gpio) {
-        return json({
-            action: 'standby',
-            idle: 1000
-        });
-    }
-
-    // Get ingredient information for weight conversion
-    const ingredient = await db
-        .select()
-        .from(table.ingredient)
-        .where(eq(table.ingredient.id, currentDose.ingredientId))
-        .get();
-
-    if (!ingredient) {
-        return json({
-            action: 'standby',
-            idle: 1000
-        });
-    }
-
-    // Convert volumes (ml) to weights (grams) using ingredient density (g/L)
-    // Formula: weight_grams = volume_ml * (density_g_per_L / 1000)
-    const doseWeight = currentDose.quantity * (ingredient.density / 1000);
-    const doseWeightProgress = (order.doseProgress || 0) * (ingredient.density / 1000);
-
-    return json({
-        action: 'pump',
-        orderId: order.id,
-        doseId: currentDose.id,
-        pumpGpio: pump.gpio,
-        doseWeight: doseWeight,
-        doseWeightProgress: doseWeightProgress
-    });
+    return json(await getNextAction(authResult.device, { plan, wait, signal: request.signal }));
 }
@@ -0,0 +1,146 @@
+import { json } from '@sveltejs/kit';
+import { db } from '$lib/server/db';
+import * as table from '$lib/server/db/schema';
+import { eq, and, gt } from 'drizzle-orm';
+import { authenticateDevice } from '$lib/server/device-auth';
+import { weightToVolume, isDoseComplete } from '$lib/server/dose-plan';
+
+export async function POST({ request }) {
+    const data = await request.json();
+    const { token, orderId, doseId, weightProgress } = data;
+
+    if (!orderId || !doseId || weightProgress === undefined) {
+        return json(
+            {
+                message: 'Missing orderId, doseId, or weightProgress'
+            },
+            { status: 400 }
+        );
+    }
+
+    // Authenticate device
+    const authResult = await authenticateDevice(request, token);
+    if (!authResult.success) {
+        return json({ message: authResult.error }, { status: authResult.status });
+    }
+
+    // Find the order
+    const order = await db.select().from(table.order).where(eq(table.order.id, orderId)).get();
+
+    if (!order) {
+        return json(
+            {
+                message: 'Order not found'
+            },
+            { status: 404 }
+        );
+    }
+
+    // Cancelled or completed orders stop the plan
+    if (order.status !== 'pending' && order.status !== 'in_progress') {
+        return json({
+            message: `Order status is ${order.status} - stopping plan`,
+            continue: false
+        });
+    }
+
+    if (order.status === 'pending') {
+        await db
+            .update(table.order)
+            .set({
+                status: 'in_progress',
+                updatedAt: new Date()
+            })
+            .where(eq(table.order.id, orderId));
+    }
+
+    if (order.currentDoseId !== doseId) {
+        return json(
+            {
+                message: 'Reported dose does not match current dose for this order',
+                continue: false
+            },
+            { status: 400 }
+        );
+    }
+
+    const currentDose = await db
+        .select({
+            dose: table.dose,
+            ingredient: table.ingredient
+        })
+        .from(table.dose)
+        .innerJoin(table.ingredient, eq(table.dose.ingredientId, table.ingredient.id))
+        .where(eq(table.dose.id, doseId))
+        .get();
+
+    if (!currentDose) {
+        return json(
+            {
+                message: 'Dose not found'
+            },
+            { status: 404 }
+        );
+    }
+
+    const volumeProgress = weightToVolume(weightProgress, currentDose.ingredient);
+
+    // A short dose stays current, the device asks for a new plan to finish it
+    if (!isDoseComplete(volumeProgress, currentDose.dose.quantity)) {
+        await db
+            .update(table.order)
+            .set({
+                doseProgress: volumeProgress,
+                updatedAt: new Date()
+            })
+            .where(eq(table.order.id, orderId));
+
+        return json({
+            message: 'Dose incomplete',
+            continue: false
+        });
+    }
+
+    const nextDose = await db
+        .select()
+        .from(table.dose)
+        .where(
+            and(
+                eq(table.dose.cocktailId, order.cocktailId),
+                gt(table.dose.number, currentDose.dose.number)
+            )
+        )
+        .orderBy(table.dose.number)
+        .limit(1)
+        .get();
+
+    if (!nextDose) {
+        // Keep the last dose current, the action API marks the order as completed
+        await db
+            .update(table.order)
+            .set({
+                doseProgress: volumeProgress,
+                updatedAt: new Date()
+            })
+            .where(eq(table.order.id, orderId));
+
+        return json({
+            message: 'Last dose complete',
+            continue: false
+        });
+    }
+
+    await db
+        .update(table.order)
+        .set({
+            currentDoseId: nextDose.id,
+            doseProgress: 0,
+            updatedAt: new Date()
+        })
+        .where(eq(table.order.id, orderId));
+
+    return json({
+        message: 'Dose complete',
+        continue: true
+    });
+}
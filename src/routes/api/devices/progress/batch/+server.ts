@@ -0,0 +1,43 @@
+import { json } from '@sveltejs/kit';
+import { authenticateDevice } from '$lib/server/device-auth';
+import { applyDoseProgressSamples, type ProgressSample } from '$lib/server/device-progress';
+
+const MAX_SAMPLES = 100;
+
+export async function POST({ request }) {
+    const data = await request.json();
+    const { token, orderId, doseId, samples } = data;
+
+    if (!orderId || !doseId || !Array.isArray(samples) || samples.length === 0) {
+        return json(
+            {
+                message: 'Missing orderId, doseId, or samples'
+            },
+            { status: 400 }
+        );
+    }
+
+    if (
+        samples.length > MAX_SAMPLES ||
+        !samples.every(
+            (sample: ProgressSample) =>
+                typeof sample?.t === 'number' && typeof sample?.weightProgress === 'number'
+        )
+    ) {
+        return json(
+            {
+                message: `Expected at most ${MAX_SAMPLES} samples of { t, weightProgress }`
+            },
+            { status: 400 }
+        );
+    }
+
+    // Authenticate device
+    const authResult = await authenticateDevice(request, token);
+    if (!authResult.success) {
+        return json({ message: authResult.error }, { status: authResult.status });
+    }
+
+    const { status, body } = await applyDoseProgressSamples(orderId, doseId, samples);
+    return json(body, { status });
+}
@@ -0,0 +1,75 @@
+import { json } from '@sveltejs/kit';
+import { db } from '$lib/server/db';
+import * as table from '$lib/server/db/schema';
+import { eq } from 'drizzle-orm';
+import { authenticateDevice } from '$lib/server/device-auth';
+import { applyDoseProgress } from '$lib/server/device-progress';
+import { applyOrderError } from '$lib/server/device-error';
+
+interface ReportEvent {
+    seq: number;
+    type: 'progress' | 'error';
+    orderId: string;
+    doseId?: string;
+    weightProgress?: number;
+    errorCode?: number;
+    message?: string;
+}
+
+/**
+ * Replay of the reports the device could not deliver when they happened.
+ * Events are applied in `seq` order, and `(epoch, seq)` makes each one idempotent:
+ * those at or below the last applied sequence of the same epoch are skipped.
+ */
+export async function POST({ request }) {
+    const data = await request.json();
+    const { token, epoch, events } = data;
+
+    if (typeof epoch !== 'string' || !Array.isArray(events)) {
+        return json(
+            {
+                message: 'Missing epoch or events'
+            },
+            { status: 400 }
+        );
+    }
+
+    // Authenticate device
+    const authResult = await authenticateDevice(request, token);
+    if (!authResult.success) {
+        return json({ message: authResult.error }, { status: authResult.status });
+    }
+
+    const device = authResult.device;
+
+    // A new epoch means the device rebooted without pending reports, its sequence restarted
+    let ackedSeq = device.reportEpoch === epoch ? device.reportSeq : 0;
+    let applied = 0;
+
+    const sorted = (events as ReportEvent[]).slice().sort((a, b) => a.seq - b.seq);
+    for (const event of sorted) {
+        if (!Number.isInteger(event.seq) || event.seq <= ackedSeq) {
+            continue;
+        }
+
+        // Rejected events (unknown order, stale dose...) are acknowledged too, a replay would be rejected again
+        if (event.type === 'progress' && event.orderId && event.doseId && event.weightProgress !== undefined) {
+            await applyDoseProgress(event.orderId, event.doseId, event.weightProgress);
+        } else if (event.type === 'error' && event.orderId && event.message) {
+            await applyOrderError(event.orderId, event.errorCode ?? 0, event.message);
+        }
+
+        // Recorded after each event, so a failure halfway only replays the events not applied yet
+        ackedSeq = event.seq;
+        applied++;
+        await db
+            .update(table.device)
+            .set({ reportEpoch: epoch, reportSeq: ackedSeq })
+            .where(eq(table.device.id, device.id));
+    }
+
+    return json({
+        message: `${applied} reports applied`,
+        ackedSeq
+    });
+}
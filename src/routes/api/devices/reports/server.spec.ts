@@ -0,0 +1,111 @@
+import { beforeEach, describe, expect, it, vi } from 'vitest';
+import { authenticateDevice } from '$lib/server/device-auth';
+import { applyDoseProgress } from '$lib/server/device-progress';
+import { applyOrderError } from '$lib/server/device-error';
+import { POST } from './+server';
+
+// Each `update(device).set(...)` of the replay, in order
+const { deviceUpdates } = vi.hoisted(() => ({ deviceUpdates: [] as Record<string, unknown>[] }));
+
+vi.mock('$lib/server/db', () => ({
+    db: {
+        update: () => ({
+            set: (values: Record<string, unknown>) => ({
+                where: async () => {
+                    deviceUpdates.push(values);
+                }
+            })
+        })
+    }
+}));
+vi.mock('$lib/server/device-auth', () => ({ authenticateDevice: vi.fn() }));
+vi.mock('$lib/server/device-progress', () => ({ applyDoseProgress: vi.fn() }));
+vi.mock('$lib/server/device-error', () => ({ applyOrderError: vi.fn() }));
+
+function withDevice(reportEpoch: string | null, reportSeq: number) {
+    vi.mocked(authenticateDevice).mockResolvedValue({
+        success: true,
+        device: { id: 'device-1', reportEpoch, reportSeq } as never
+    });
+}
+
+async function replay(body: unknown) {
+    const request = new Request('http://localhost/api/devices/reports', {
+        method: 'POST',
+        body: JSON.stringify(body)
+    });
+    const response = await POST({ request } as Parameters<typeof POST>[0]);
+    return { status: response.status, body: await response.json() };
+}
+
+function progress(seq: number, weightProgress = seq) {
+    return { seq, type: 'progress', orderId: 'order-1', doseId: 'dose-1', weightProgress };
+}
+
+describe('POST /api/devices/reports', () => {
+    beforeEach(() => {
+        deviceUpdates.length = 0;
+        vi.mocked(applyDoseProgress).mockReset();
+        vi.mocked(applyDoseProgress).mockResolvedValue({
+            status: 200,
+            body: { message: 'Progress updated', continue: true }
+        });
+        vi.mocked(applyOrderError).mockReset();
+    });
+
+    it('rejects a replay without epoch', async () => {
+        withDevice('epoch-a', 0);
+        const { status } = await replay({ token: 't', events: [progress(1)] });
+        expect(status).toBe(400);
+        expect(applyDoseProgress).not.toHaveBeenCalled();
+    });
+
+    it('skips events at or below the acknowledged sequence of the same epoch', async () => {
+        withDevice('epoch-a', 5);
+        const { status, body } = await replay({
+            token: 't',
+            epoch: 'epoch-a',
+            events: [progress(4), progress(5), progress(6)]
+        });
+
+        expect(status).toBe(200);
+        expect(body.ackedSeq).toBe(6);
+        expect(applyDoseProgress).toHaveBeenCalledTimes(1);
+        expect(applyDoseProgress).toHaveBeenCalledWith('order-1', 'dose-1', 6);
+        expect(deviceUpdates).toEqual([{ reportEpoch: 'epoch-a', reportSeq: 6 }]);
+    });
+
+    it('applies events in sequence order whatever their order in the request', async () => {
+        withDevice('epoch-a', 0);
+        const events = [progress(3), progress(1), progress(2)];
+        await replay({ token: 't', epoch: 'epoch-a', events });
+
+        expect(vi.mocked(applyDoseProgress).mock.calls.map((call) => call[2])).toEqual([1, 2, 3]);
+        expect(deviceUpdates.map((update) => update.reportSeq)).toEqual([1, 2, 3]);
+    });
+
+    it('restarts the sequence on a new epoch', async () => {
+        withDevice('epoch-a', 40);
+        const events = [progress(1), progress(2)];
+        const { body } = await replay({ token: 't', epoch: 'epoch-b', events });
+
+        expect(body.ackedSeq).toBe(2);
+        expect(applyDoseProgress).toHaveBeenCalledTimes(2);
+        expect(deviceUpdates.at(-1)).toEqual({ reportEpoch: 'epoch-b', reportSeq: 2 });
+    });
+
+    it('acknowledges rejected events so they are not replayed again', async () => {
+        withDevice('epoch-a', 0);
+        vi.mocked(applyDoseProgress).mockResolvedValue({
+            status: 404,
+            body: { message: 'Order not found' }
+        });
+        const error = { seq: 2, type: 'error', orderId: 'gone', errorCode: 3, message: 'Timeout' };
+        const events = [progress(1), error];
+        const { body } = await replay({ token: 't', epoch: 'epoch-a', events });
+
+        expect(applyOrderError).toHaveBeenCalledWith('gone', 3, 'Timeout');
+        expect(body.ackedSeq).toBe(2);
+        expect(deviceUpdates.at(-1)).toEqual({ reportEpoch: 'epoch-a', reportSeq: 2 });
+    });
+});
@@ -47,6 +47,8 @@ export async function POST({ request }) {
     return json({
         tokenValid: true,
         message: 'Hello from the server',
-        needCalibration: device.needCalibration
+        needCalibration: device.needCalibration,
+        // Only when served by server/index.js or the dev server, devices fall back to HTTP otherwise
+        websocketPath: globalThis.autobarDeviceSocketPath
     });
 }
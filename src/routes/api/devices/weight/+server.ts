@@ -32,7 +32,9 @@ export async function POST({ request }) {
         hx711Dt: device.hx711Dt,
         hx711Sck: device.hx711Sck,
         hx711Offset: device.hx711Offset,
-        hx711Scale: device.hx711Scale
+        hx711Scale: device.hx711Scale,
+        hx711Filter: device.hx711Filter,
+        hx711MedianSize: device.hx711MedianSize
     };
 
     return json(response);
@@ -6,6 +6,7 @@ import { db } from '$lib/server/db';
 import * as table from '$lib/server/db/schema';
 import { selectVerifiedProfile } from '$lib/server/auth.js';
 import { checkCocktailAccess } from '$lib/server/cocktail-permissions';
+import { notifyOrder } from '$lib/server/order-notifier';
 
 export const load: PageServerLoad = async ({ params, locals }) => {
     // Get verified profile (reusing existing function)
@@ -124,6 +125,9 @@ export const actions: Actions = {
 
         await db.insert(table.order).values(newOrder);
 
+        // Start the order right away on a device waiting in the action API
+        notifyOrder(selectedDeviceId);
+
         // Redirect to my bar page (will be created in next step)
         throw redirect(303, '/my-bar');
     }
@@ -79,6 +79,8 @@ export const actions: Actions = {
 
         const dtPin = parseInt(formData.get('dtPin')?.toString() || '0');
         const sckPin = parseInt(formData.get('sckPin')?.toString() || '0');
+        const weightFilter = parseInt(formData.get('weightFilter')?.toString() || '2');
+        const medianSize = parseInt(formData.get('medianSize')?.toString() || '5');
 
         if (!deviceId) {
             return fail(400, { success: false, message: 'Device ID is required' });
@@ -88,6 +90,10 @@ export const actions: Actions = {
             return fail(400, { success: false, message: 'Both DT and SCK pins are required' });
         }
 
+        if (![0, 1, 2].includes(weightFilter) || ![1, 3, 5, 7, 9].includes(medianSize)) {
+            return fail(400, { success: false, message: 'Invalid weight filter settings' });
+        }
+
         // Verify device ownership
         const device = await db
             .select()
@@ -104,6 +110,8 @@ export const actions: Actions = {
             const updateData: any = {
                 hx711Dt: dtPin,
                 hx711Sck: sckPin,
+                hx711Filter: weightFilter,
+                hx711MedianSize: medianSize,
                 needCalibration: true // Keep true until full calibration is complete
             };
 
@@ -4,6 +4,7 @@ import type { PageServerLoad, Actions } from './$types';
 import { db } from '$lib/server/db';
 import * as table from '$lib/server/db/schema';
 import { selectVerifiedProfile } from '$lib/server/auth.js';
+import { notifyOrderCancelled } from '$lib/server/order-notifier';
 
 export const load: PageServerLoad = async ({ locals }) => {
     // Check if user is logged in, profile exists and is verified
@@ -198,6 +199,9 @@ export const actions: Actions = {
             })
             .where(eq(table.order.id, orderId));
 
+        // Stop the pump right away on a device connected by WebSocket
+        notifyOrderCancelled(order.deviceId, orderId);
+
         return { success: true };
     }
 };
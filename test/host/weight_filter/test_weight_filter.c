@@ -0,0 +1,235 @@
+// Host test of the weight filter on HX711 traces: it must settle faster than the 10-sample average
+// the pour loop used before, follow a pour without lag, and ignore single-sample glitches
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "weight_filter.h"
+
+#define TRACE_MAX_SAMPLES 256
+#define TRACE_SCALE 0.0025f // g per raw unit, as written in the trace headers
+#define TRACE_OFFSET 84000
+#define AVERAGE_SAMPLES 10  // measure_weight(..., 10) of the pour loop before the filter
+#define SETTLE_TOLERANCE_G 1.0f
+#define GLITCH_RAW 20000 // 50 g away from both neighbours within 100 ms
+// While pouring, a rejected glitch still shifts the median window by one sample, 2 g at 20 g/s
+#define GLITCH_TOLERANCE_G 4.0f
+
+typedef struct
+{
+    int64_t timestamp_us;
+    int32_t raw;
+} trace_sample_t;
+
+static int failures = 0;
+
+#define CHECK(condition, ...)                          \
+    do                                                 \
+    {                                                  \
+        if (!(condition))                              \
+        {                                              \
+            printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+            printf(__VA_ARGS__);                       \
+            printf("\n");                              \
+            failures++;                                \
+        }                                              \
+    } while (0)
+
+static float to_grams(float raw)
+{
+    return TRACE_SCALE * (raw - TRACE_OFFSET);
+}
+
+// CSV of `timestamp_us,raw`, lines starting with # are comments
+static int load_trace(const char *name, trace_sample_t *samples)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s.csv", TRACE_DIR, name);
+    FILE *file = fopen(path, "r");
+    if (!file)
+    {
+        printf("Cannot open %s\n", path);
+        exit(1);
+    }
+
+    char line[128];
+    int count = 0;
+    while (fgets(line, sizeof(line), file) && count < TRACE_MAX_SAMPLES)
+    {
+        long long timestamp_us;
+        long raw;
+        if (line[0] != '#' && sscanf(line, "%lld,%ld", &timestamp_us, &raw) == 2)
+        {
+            samples[count].timestamp_us = timestamp_us;
+            samples[count].raw = (int32_t)raw;
+            count++;
+        }
+    }
+    fclose(file);
+    return count;
+}
+
+static void run_filter(const trace_sample_t *samples, int count, weight_filter_type_t type, float *grams)
+{
+    weight_filter_config_t config = WEIGHT_FILTER_DEFAULT_CONFIG;
+    config.type = type;
+    weight_filter_t filter;
+    weight_filter_init(&filter, &config, TRACE_SCALE);
+
+    for (int i = 0; i < count; i++)
+    {
+        float value, variance;
+        weight_filter_update(&filter, samples[i].raw, samples[i].timestamp_us, &value, &variance);
+        grams[i] = to_grams(value);
+    }
+}
+
+// Average of the last AVERAGE_SAMPLES raw conversions, fewer at the start
+static void run_average(const trace_sample_t *samples, int count, float *grams)
+{
+    for (int i = 0; i < count; i++)
+    {
+        int first = i + 1 >= AVERAGE_SAMPLES ? i + 1 - AVERAGE_SAMPLES : 0;
+        double sum = 0;
+        for (int j = first; j <= i; j++)
+        {
+            sum += samples[j].raw;
+        }
+        grams[i] = to_grams((float)(sum / (i + 1 - first)));
+    }
+}
+
+// Time from `from_us` until the estimate stays within SETTLE_TOLERANCE_G of `target_g`, -1 if never
+static int64_t settle_latency_us(const trace_sample_t *samples, const float *grams, int count, int64_t from_us, int64_t until_us,
+                                 float target_g)
+{
+    int64_t settled_us = -1;
+    for (int i = 0; i < count && samples[i].timestamp_us < until_us; i++)
+    {
+        if (samples[i].timestamp_us < from_us)
+        {
+            continue;
+        }
+        if (fabsf(grams[i] - target_g) > SETTLE_TOLERANCE_G)
+        {
+            settled_us = -1;
+        }
+        else if (settled_us < 0)
+        {
+            settled_us = samples[i].timestamp_us - from_us;
+        }
+    }
+    return settled_us;
+}
+
+// Weight on the scale in the pour trace: a 150 g glass, 20 g/s from 1 s to 6 s
+static float pour_weight_g(int64_t timestamp_us)
+{
+    float t = timestamp_us / 1e6f;
+    return 150.0f + 20.0f * fminf(fmaxf(t - 1.0f, 0.0f), 5.0f);
+}
+
+static void test_glass_placed(void)
+{
+    trace_sample_t samples[TRACE_MAX_SAMPLES];
+    float filtered[TRACE_MAX_SAMPLES], averaged[TRACE_MAX_SAMPLES];
+    int count = load_trace("glass_placed", samples);
+
+    run_filter(samples, count, WEIGHT_FILTER_KALMAN, filtered);
+    run_average(samples, count, averaged);
+
+    int64_t filter_us = settle_latency_us(samples, filtered, count, 2000000, INT64_MAX, 150.0f);
+    int64_t average_us = settle_latency_us(samples, averaged, count, 2000000, INT64_MAX, 150.0f);
+    printf("glass_placed: settled in %lld ms with the filter, %lld ms with the average\n", (long long)filter_us / 1000,
+           (long long)average_us / 1000);
+
+    CHECK(filter_us >= 0, "filter never settled on the glass weight");
+    CHECK(average_us >= 0, "average never settled on the glass weight");
+    CHECK(filter_us < average_us, "filter settles in %lld ms, not faster than the average (%lld ms)",
+          (long long)filter_us / 1000, (long long)average_us / 1000);
+}
+
+// Same trace with every single-sample glitch replaced by the mean of its neighbours
+static int remove_glitches(const trace_sample_t *samples, int count, trace_sample_t *clean)
+{
+    int removed = 0;
+    for (int i = 0; i < count; i++)
+    {
+        clean[i] = samples[i];
+        if (i > 0 && i + 1 < count && abs(samples[i].raw - samples[i - 1].raw) > GLITCH_RAW &&
+            abs(samples[i].raw - samples[i + 1].raw) > GLITCH_RAW)
+        {
+            clean[i].raw = (samples[i - 1].raw + samples[i + 1].raw) / 2;
+            removed++;
+        }
+    }
+    return removed;
+}
+
+static void test_pour_glitches(void)
+{
+    trace_sample_t samples[TRACE_MAX_SAMPLES], clean[TRACE_MAX_SAMPLES];
+    float filtered[TRACE_MAX_SAMPLES], filtered_clean[TRACE_MAX_SAMPLES];
+    float averaged[TRACE_MAX_SAMPLES], averaged_clean[TRACE_MAX_SAMPLES];
+    int count = load_trace("pour_glitches", samples);
+    int glitches = remove_glitches(samples, count, clean);
+    CHECK(glitches == 4, "expected the 4 glitches of the trace header, found %d", glitches);
+
+    run_filter(samples, count, WEIGHT_FILTER_KALMAN, filtered);
+    run_filter(clean, count, WEIGHT_FILTER_KALMAN, filtered_clean);
+    run_average(samples, count, averaged);
+    run_average(clean, count, averaged_clean);
+
+    // How far the glitches move each estimate away from its own glitch-free run
+    float filter_deviation = 0, average_deviation = 0;
+    for (int i = 0; i < count; i++)
+    {
+        filter_deviation = fmaxf(filter_deviation, fabsf(filtered[i] - filtered_clean[i]));
+        average_deviation = fmaxf(average_deviation, fabsf(averaged[i] - averaged_clean[i]));
+    }
+
+    // Lag while the pump runs, once both estimators had time to pick the flow up
+    double filter_lag = 0, average_lag = 0;
+    int ramp_samples = 0;
+    for (int i = 0; i < count; i++)
+    {
+        int64_t t = clean[i].timestamp_us;
+        if (t >= 2000000 && t < 6000000)
+        {
+            filter_lag += fabsf(filtered_clean[i] - pour_weight_g(t));
+            average_lag += fabsf(averaged_clean[i] - pour_weight_g(t));
+            ramp_samples++;
+        }
+    }
+    filter_lag /= ramp_samples;
+    average_lag /= ramp_samples;
+
+    int64_t filter_us = settle_latency_us(samples, filtered, count, 6000000, INT64_MAX, 250.0f);
+    int64_t average_us = settle_latency_us(samples, averaged, count, 6000000, INT64_MAX, 250.0f);
+
+    printf("pour_glitches: glitches move the filter by %.2f g, the average by %.2f g\n", filter_deviation, average_deviation);
+    printf("pour_glitches: mean lag while pouring %.2f g with the filter, %.2f g with the average\n", filter_lag, average_lag);
+    printf("pour_glitches: settled in %lld ms after the pump stopped with the filter, %lld ms with the average\n",
+           (long long)filter_us / 1000, (long long)average_us / 1000);
+
+    // The glitches reach the full HX711 range, the median must keep them out entirely
+    CHECK(filter_deviation < GLITCH_TOLERANCE_G, "a glitch moved the filter by %.2f g", filter_deviation);
+    CHECK(average_deviation > 100.0f, "the trace glitches no longer stress the average (%.2f g)", average_deviation);
+    CHECK(filter_lag < average_lag, "filter lags %.2f g while pouring, average %.2f g", filter_lag, average_lag);
+    CHECK(filter_us >= 0 && (average_us < 0 || filter_us < average_us),
+          "filter settles in %lld ms after the pour, average %lld ms", (long long)filter_us / 1000, (long long)average_us / 1000);
+}
+
+int main(void)
+{
+    test_glass_placed();
+    test_pour_glitches();
+
+    if (failures)
+    {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("All weight filter checks passed\n");
+    return 0;
+}
@@ -1,7 +1,21 @@
 import { defineConfig } from 'vitest/config';
 import { sveltekit } from '@sveltejs/kit/vite';
-import { loadEnv } from 'vite';
+import { loadEnv, type Plugin } from 'vite';
 import fs from 'fs';
+import { attachDeviceSocket } from './server/device-socket.js';
+
+// Serve the device WebSocket from the dev and preview servers too
+const deviceSocket: Plugin = {
+    name: 'autobar-device-socket',
+    configureServer(server) {
+        if (server.httpServer) {
+            attachDeviceSocket(server.httpServer);
+        }
+    },
+    configurePreviewServer(server) {
+        attachDeviceSocket(server.httpServer);
+    }
+};
 
 export default defineConfig(({ command, mode }) => {
     if (command === 'serve') {
@@ -20,7 +34,7 @@ export default defineConfig(({ command, mode }) => {
                 : false;
 
         return {
-            plugins: [sveltekit()],
+            plugins: [sveltekit(), deviceSocket],
             server: {
                 https,
                 host: true
@@ -35,6 +49,7 @@ export default defineConfig(({ command, mode }) => {
         return {
             plugins: [
                 sveltekit(),
+                deviceSocket,
             ],
         };
     }